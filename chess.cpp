@@ -6,6 +6,36 @@
 #include <fstream>
 #include <regex>
 #include <limits>
+#include <poll.h>
+#include <cstdint>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cstring>
+#include <deque>
+#include <sstream>
+#include <future>
+#include <condition_variable>
+#include <random>
+#include <csignal>
+#include <ctime>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#endif
 
 using namespace std;
 
@@ -41,6 +71,11 @@ void block_read() {
     fcntl(STDIN_FILENO, F_SETFL, flags | F_RDLCK);
 }
 
+bool wait_for_input(int timeout_ms) {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&pfd, 1, timeout_ms) > 0;
+}
+
 int range(int x, int min, int max)
 {
     if(x < min)
@@ -65,1666 +100,7966 @@ enum State {LongCastling, ShortCastling, EnPassant, Nothing};
 
 Color reverse_color(Color color) { return (color == WHITE ? BLACK : WHITE); }
 
-class Highlight
-{
-    int x, y;
-    char* cmd;
+const int MAX_PLY = 64;
+const double MATE_SCORE = 1000.0;
+const double INF_SCORE = 100000.0;
 
-    public:
-    Highlight(int _x, int _y, char* _cmd) : x(_x), y(_y), cmd(_cmd) {}
-    int get_x() const {return x; }
-    void set_x(int _x) { x = _x; }
-    int get_y() const {return y; }
-    void set_y(int _y) { y = _y; }
-    char* get_cmd() const {return cmd; }
-};
+string square_name(int square)
+{
+    string str = "";
+    str += (char)('a' + square % 8);
+    str += (char)('1' + square / 8);
+    return str;
+}
 
-class Board;
+string score_to_string(double score)
+{
+    char buf[32];
+    if(fabs(score) >= MATE_SCORE - MAX_PLY)
+    {
+        int moves = ((int)(MATE_SCORE - fabs(score)) + 1) / 2;
+        snprintf(buf, sizeof(buf), "%s#%d", (score > 0 ? "" : "-"), moves);
+    }
+    else
+        snprintf(buf, sizeof(buf), "%+.2f", score);
+    return buf;
+}
 
-class Object
+//Moves are pulled out of free text, so move numbers, check marks and results are skipped
+const regex& notation_regex()
 {
-    Color clr;
-    char* img;
-    int x, y;
-    int extra;
-    Obj type;
-    int links;
+    static const regex r("([KQRBN]?[a-h]?[1-8]?x?[a-h][1-8])|(O-O(-O)?)");
+    return r;
+}
 
-    public:
-    Object(int _x, int _y, Color _clr = WHITE) : clr(_clr), x(_x), y(_y), extra(0), links(0) {}
-    Color   get_color()       const { return clr; }
-    void    set_color(Color _clr)   { clr = _clr; }
-    char*   get_img()         const { return img; }
-    void    set_img(char* _img)     { img = _img; }
-    int     get_x()           const { return x; }
-    void    set_x(int _x)           { x = _x; }
-    int     get_y()           const { return y; }
-    void    set_y(int _y)           { y = _y; }
-    int     get_extra()       const { return extra; }
-    void    inc_extra()             { extra++; }
-    void    dec_extra()             { extra--; }
-    void    set_extra(int _extra)   { extra = _extra; }
-    Obj     get_type()        const { return type; }
-    void    set_type(Obj _type)     { type = _type; }
-    int     get_links()       const { return links; }
-    void    inc_links()             { links++; }
-    void    dec_links()             { links--; }
+void parse_notation(string str, vector<string>& notation)
+{
+    smatch m;
+    while(regex_search(str, m, notation_regex()))
+    {
+        notation.push_back(m.str());
+        str = m.suffix();
+    }
+}
 
+//1 - white won, 0 - black won, 0.5 - draw, -1 - unknown
+double parse_result(const string& str)
+{
+    if(str.find("1/2-1/2") != string::npos) return 0.5;
+    if(str.find("1-0") != string::npos) return 1.0;
+    if(str.find("0-1") != string::npos) return 0.0;
+    return -1.0;
+}
 
-    virtual bool is_legal(Object* obj, Board* board) { return false; };
-    virtual ~Object() {}
+struct GameRecord
+{
+    string info[10];
+    vector<string> notation;
+    double result = -1.0;
+    //Moves of binary collections as from | to << 6, used instead of the notation
+    vector<uint16_t> moves;
 };
 
-class Square : public Object
+//Game file: 10 lines of game info, then the line with moves
+bool read_game_file(const string& path, GameRecord& game)
 {
-    public:
-    Square(int _x, int _y, Color _clr) : Object(_x, _y, _clr) {
-        if(this -> get_color() == WHITE)
-            this -> set_img((char*)"\u25A1");
-        else
-            this -> set_img((char*)"\u25A0");
-        this->set_type(Obj::Square);
+    ifstream f(path);
+    if(!f.is_open()) return false;
+    string str;
+    int pos = 0;
+    while(getline(f, str) && (pos != 10))
+        game.info[pos++] = str;
+    if(pos == 10)
+    {
+        parse_notation(str, game.notation);
+        game.result = parse_result(str);
     }
-    virtual bool is_legal(Object* obj, Board* board) 
+    return true;
+}
+
+string strip_pgn_comments(const string& str)
+{
+    string result = "";
+    int braces = 0;
+    int variations = 0;
+    for(char c : str)
     {
-        return false;
+        if(c == '{') braces++;
+        else if((c == '}') && (braces > 0)) braces--;
+        else if((c == '(') && (braces == 0)) variations++;
+        else if((c == ')') && (braces == 0) && (variations > 0)) variations--;
+        else if((braces == 0) && (variations == 0)) result += c;
     }
+    return result;
+}
 
-};
+//Binary collections (.cgb), see PACKED_GAMES_MAGIC
+bool read_packed_games(const string& path, vector<GameRecord>& games, size_t limit = SIZE_MAX);
+bool append_packed_game(const string& path, const GameRecord& game);
 
-class Turn
+bool has_extension(const string& path, const string& extension)
 {
-    Object* obj_from;
-    Object* obj_to;
-    Object* obj_replace;
-    int extra_index;
-    double ai_evaluation;
+    return (path.size() > extension.size()) && (path.compare(path.size() - extension.size(), extension.size(), extension) == 0);
+}
+
+//Reads the games of a PGN or game file one at a time, so a collection doesn't have to fit in memory
+class GameReader
+{
+    string path;
+    bool pgn;
+    ifstream f;
+    //Tag line that ended the previous game and starts the next one
+    string pending = "";
+    bool done = false;
 
     public:
-    Turn(Object* _from, Object* _to, int _castling_index = -1) : obj_from(_from), obj_to(_to), extra_index(_castling_index)
+    GameReader(const string& _path) : path(_path), pgn(has_extension(_path, ".pgn")), f(_path) {}
+    bool is_open() const { return f.is_open(); }
+    //Next game with moves; false at the end of the file
+    bool next(GameRecord& game)
     {
-        int x = obj_from->get_x();
-        int y = obj_from->get_y();
-        obj_replace = new class Square(x, y, (((x + y) % 2 == 1) ? WHITE : BLACK));
+        game = GameRecord();
+        if(!pgn)
+        {
+            if(done) return false;
+            done = true;
+            return read_game_file(path, game) && (game.notation.size() != 0);
+        }
+        string str;
+        string movetext = "";
+        while(!done)
+        {
+            if(!pending.empty())
+            {
+                str = pending;
+                pending = "";
+            }
+            else if(!getline(f, str))
+                done = true;
+            if(!done && (str.size() > 0) && (str[0] == '['))
+            {
+                if(movetext.find_first_not_of(" \t\r") != string::npos)
+                    pending = str;
+                else
+                {
+                    if(str.compare(0, 8, "[Result ") == 0)
+                        game.result = parse_result(str);
+                    continue;
+                }
+            }
+            else if(!done)
+            {
+                size_t comment = str.find(';');
+                if(comment != string::npos)
+                    str.erase(comment);
+                movetext += str + " ";
+                continue;
+            }
+            movetext = strip_pgn_comments(movetext);
+            parse_notation(movetext, game.notation);
+            if(game.result == -1.0)
+                game.result = parse_result(movetext);
+            if(game.notation.size() != 0)
+                return true;
+            game = GameRecord();
+            movetext = "";
+        }
+        return false;
     }
-    Object* get_from() const { return obj_from; }
-    Object* get_to() const { return obj_to; }
-    Object* get_replace() const { return obj_replace; }
-    void set_from(Object* _from)  { obj_from = _from; }
-    void set_to(Object* _to) { obj_to = _to; }
-    void set_replace(Object* _replace) { obj_replace = _replace; }
-    int get_extra_index()  const { return extra_index; }
-    void set_extra_index(int _extra_index)  { extra_index = _extra_index; }
-    double get_ai_evaluation()  const { return ai_evaluation; }
-    void set_ai_evaluation(double _ai_evaluation)  { ai_evaluation = _ai_evaluation; }
 };
 
-class AI
+//Games of a collection up to limit; the file is read no further than the last of them
+bool read_game_collection(const string& path, vector<GameRecord>& games, size_t limit = SIZE_MAX)
 {
-    int standard_pawn_reward[8] = {0, 0, 0, 0, 10, 20, 30, 0};
-    int passed_pawn_reward[8] = {0, 50, 50, 50, 70, 90, 110, 0};
+    if(has_extension(path, ".cgb"))
+        return read_packed_games(path, games, limit);
+    GameReader reader(path);
+    if(!reader.is_open()) return false;
+    GameRecord game;
+    while((games.size() < limit) && reader.next(game))
+        games.push_back(move(game));
+    return true;
+}
 
-    public:
-    double check_mobility(Object* obj, Board* board);
-    bool check_passed_pawn(Object* obj, Board* board);
-    double static_analyze(Board* board);
-    static bool compareTurnsForWhite(Turn* turn_1, Turn* turn_2)
+constexpr uint64_t splitmix64(uint64_t& state)
+{
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+//Keys are indexed by [color][Obj][y * 8 + x]; castling is [white short, white long, black short, black long]
+struct Zobrist
+{
+    uint64_t pieces[2][6][64];
+    uint64_t side;
+    uint64_t castling[4];
+    uint64_t king_moved[2];
+};
+
+constexpr Zobrist init_zobrist()
+{
+    Zobrist keys{};
+    uint64_t state = 0x5EEDC0DEULL;
+    for(int c = 0; c < 2; c++)
+        for(int t = 0; t < 6; t++)
+            for(int sq = 0; sq < 64; sq++)
+                keys.pieces[c][t][sq] = splitmix64(state);
+    keys.side = splitmix64(state);
+    for(int i = 0; i < 4; i++)
+        keys.castling[i] = splitmix64(state);
+    for(int i = 0; i < 2; i++)
+        keys.king_moved[i] = splitmix64(state);
+    return keys;
+}
+
+constexpr Zobrist zobrist = init_zobrist();
+
+//Masks and per-square tables for squares y * 8 + x, built by the compiler into read-only data
+struct BoardTables
+{
+    uint64_t file_mask[8];
+    uint64_t adjacent_files_mask[8];
+    //Enemy pawns in these squares stop a pawn of [color] on [square] from being passed
+    uint64_t passed_pawn_mask[2][64];
+    uint64_t pawn_attacks[2][64];
+    uint64_t knight_attacks[64];
+    uint64_t king_attacks[64];
+    //Rays to the board edge in directions N, NE, E, SE, S, SW, W, NW
+    uint64_t rays[8][64];
+    int distance[64][64];
+};
+
+constexpr int abs_constexpr(int x) { return (x < 0 ? -x : x); }
+
+constexpr BoardTables init_board_tables()
+{
+    BoardTables t{};
+    for(int x = 0; x < 8; x++)
+        for(int y = 0; y < 8; y++)
+            t.file_mask[x] |= 1ULL << (y * 8 + x);
+    for(int x = 0; x < 8; x++)
+        t.adjacent_files_mask[x] = (x > 0 ? t.file_mask[x - 1] : 0) | (x < 7 ? t.file_mask[x + 1] : 0);
+    for(int sq = 0; sq < 64; sq++)
     {
-        return (turn_1->get_ai_evaluation() > turn_2->get_ai_evaluation());
+        int x = sq % 8;
+        int y = sq / 8;
+        for(int to = 0; to < 64; to++)
+        {
+            int dx = abs_constexpr(to % 8 - x);
+            int dy = abs_constexpr(to / 8 - y);
+            t.distance[sq][to] = (dx > dy ? dx : dy);
+            if(dx * dy == 2) t.knight_attacks[sq] |= 1ULL << to;
+            if(t.distance[sq][to] == 1) t.king_attacks[sq] |= 1ULL << to;
+            if(dx == 1 && to / 8 == y + 1) t.pawn_attacks[WHITE][sq] |= 1ULL << to;
+            if(dx == 1 && to / 8 == y - 1) t.pawn_attacks[BLACK][sq] |= 1ULL << to;
+            if(dx <= 1 && to / 8 > y && to / 8 < 7) t.passed_pawn_mask[WHITE][sq] |= 1ULL << to;
+            if(dx <= 1 && to / 8 < y && to / 8 > 0) t.passed_pawn_mask[BLACK][sq] |= 1ULL << to;
+        }
+        const int ray_dx[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+        const int ray_dy[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+        for(int dir = 0; dir < 8; dir++)
+            for(int i = x + ray_dx[dir], j = y + ray_dy[dir]; (i >= 0) && (i < 8) && (j >= 0) && (j < 8); i += ray_dx[dir], j += ray_dy[dir])
+                t.rays[dir][sq] |= 1ULL << (j * 8 + i);
     }
-    static bool compareTurnsForBlack(Turn* turn_1, Turn* turn_2)
+    return t;
+}
+
+constexpr BoardTables board_tables = init_board_tables();
+
+//Ray up to and including the first occupied square
+inline uint64_t ray_attacks(int dir, int square, uint64_t occupied)
+{
+    uint64_t attacks = board_tables.rays[dir][square];
+    uint64_t blockers = attacks & occupied;
+    if(blockers != 0)
     {
-        return (turn_1->get_ai_evaluation() < turn_2->get_ai_evaluation());
+        //N, NE, E and NW rays go towards higher squares
+        int blocker = ((dir < 3) || (dir == 7)) ? __builtin_ctzll(blockers) : 63 - __builtin_clzll(blockers);
+        attacks ^= board_tables.rays[dir][blocker];
     }
-    double evaluate_best_answer(Board* board, Color turn_color, int depth);
-    Turn* analyze(Board* board, Color turn_color);
-};
+    return attacks;
+}
 
-class Board
+inline uint64_t piece_attacks(Obj type, int square, uint64_t occupied)
 {
-    int width = 8;
-    int height = 8;
+    uint64_t attacks = 0;
+    switch(type)
+    {
+        case Knight:
+            return board_tables.knight_attacks[square];
+        case King:
+            return board_tables.king_attacks[square];
+        case Queen:
+        case Rook:
+            for(int dir = 0; dir < 8; dir += 2)
+                attacks |= ray_attacks(dir, square, occupied);
+            if(type == Rook) break;
+        case Bishop:
+            for(int dir = 1; dir < 8; dir += 2)
+                attacks |= ray_attacks(dir, square, occupied);
+            break;
+        default:
+            break;
+    }
+    return attacks;
+}
 
-    char* high_alphabet = (char*)"ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-    char* low_alphabet = (char*)"abcdefghijklmnopqrstuvwxyz";
-    Object** board;
-    AI ai;
-    vector<Highlight*> hl_v;
-    Object* hit_field = NULL;
-    int inside_counter = 0;
+const uint64_t NOT_FILE_A = ~board_tables.file_mask[0];
+const uint64_t NOT_FILE_H = ~board_tables.file_mask[7];
 
-    Object* white_king;
-    bool white_castling;
-    Object* black_king;
-    bool black_castling;
-    bool double_check = false;
-    bool board_flipped = false;
-    string game_info[10];
-    bool skip = false;
-    vector<string> notation_turns;
-    int turn = -1;
-    vector<Turn*> turns;
-    vector<Turn*> extra_turns;
-    int free_extra_index;
-    Regime regime;
-    State cur_state;
-    bool AI_state;
+inline uint64_t pawns_attacks(Color color, uint64_t pawns)
+{
+    if(color == WHITE)
+        return ((pawns & NOT_FILE_A) << 7) | ((pawns & NOT_FILE_H) << 9);
+    return ((pawns & NOT_FILE_A) >> 9) | ((pawns & NOT_FILE_H) >> 7);
+}
+
+enum Bound {NoBound, UpperBound, LowerBound, ExactBound};
+
+struct TTData
+{
+    int depth;
+    int score;
+    Bound bound;
+    int from;
+    int to;
+};
+
+//Lockless table: every entry keeps key ^ data, so a torn write from another thread reads as a miss
+class TranspositionTable
+{
+    struct Entry
+    {
+        atomic<uint64_t> key;
+        atomic<uint64_t> data;
+    };
+    Entry* entries;
+    size_t mask;
+    bool owned = true;
 
     public:
-    Board()
+    static const size_t ENTRY_SIZE = sizeof(Entry);
+    TranspositionTable(int bits = 20) : mask((size_t(1) << bits) - 1)
     {
-        board = new Object*[width * height];
-        for(int i = height - 1; i >= 0; i--)
-            for(int j = 0; j < width; j++)
-                if((i + j) % 2 == 1)
-                    board[i * width + j] = new class Square(j, i, WHITE);
-                else    
-                    board[i * width + j] = new class Square(j, i, BLACK);
-        free_extra_index = 0;
-        AI_state = false;
+        entries = new Entry[mask + 1];
+        clear();
     }
-    friend class AI;
-    int get_width() const { return width; }
-    int get_height() const { return height; }
-    void add(Object* obj)
+    //Table over memory it doesn't own, such as a shared file mapping; zeroed memory reads as empty
+    TranspositionTable(void* memory, int bits) : entries((Entry*)memory), mask((size_t(1) << bits) - 1), owned(false) {}
+    void clear()
     {
-        delete board[obj->get_y() * width + obj->get_x()];
-        board[obj->get_y() * width + obj->get_x()] = obj;
-        if(obj->get_type() == King)
+        for(size_t i = 0; i <= mask; i++)
         {
-            if(obj->get_color() == WHITE)
-                white_king = obj;
-            else    
-                black_king = obj;
+            entries[i].key.store(0, memory_order_relaxed);
+            entries[i].data.store(0, memory_order_relaxed);
         }
     }
-    void add_wd(Object* obj)
+    bool probe(uint64_t key, TTData& out) const
     {
-        board[obj->get_y() * width + obj->get_x()] = obj;
-        if(obj->get_type() == King)
-        {
-            if(obj->get_color() == WHITE)
-                white_king = obj;
-            else    
-                black_king = obj;
-        }
+        Entry& entry = entries[key & mask];
+        uint64_t data = entry.data.load(memory_order_relaxed);
+        if((entry.key.load(memory_order_relaxed) ^ data) != key || data == 0)
+            return false;
+        out.score = (int32_t)(uint32_t)(data & 0xFFFFFFFF);
+        out.depth = (data >> 32) & 0xFF;
+        out.bound = (Bound)((data >> 40) & 0x3);
+        out.from = (int)((data >> 42) & 0x7F) - 1;
+        out.to = (int)((data >> 49) & 0x7F) - 1;
+        return true;
     }
-    Object* get(int x, int y)
+    void store(uint64_t key, int depth, int score, Bound bound, int from, int to)
     {
-        if((x < 0) || (x >= width) || (y < 0) || (y >= height)) return NULL;
-        return board[y * width + x];
+        Entry& entry = entries[key & mask];
+        uint64_t old_data = entry.data.load(memory_order_relaxed);
+        if(((entry.key.load(memory_order_relaxed) ^ old_data) == key) && (((old_data >> 32) & 0xFF) > (uint64_t)depth))
+            return;
+        uint64_t data = (uint64_t)(uint32_t)score
+            | ((uint64_t)depth << 32)
+            | ((uint64_t)bound << 40)
+            | ((uint64_t)(from + 1) << 42)
+            | ((uint64_t)(to + 1) << 49);
+        entry.key.store(key ^ data, memory_order_relaxed);
+        entry.data.store(data, memory_order_relaxed);
     }
-    void print_board()
+    ~TranspositionTable()
     {
-        if(board_flipped)
-        {
-            print_flipped_board();
-            return;
-        }
-        system("clear");
-        for(int i = height - 1; i >= 0; i--)
+        if(owned)
+            delete [] entries;
+    }
+};
+
+//Root results of earlier searches, shared between sessions and tools through a file mapping.
+//File: 8 byte magic "CHSCACH1", uint32 table bits, uint32 zero, then TranspositionTable entries.
+//A store cut off by a crash leaves key ^ data mismatched, so it reads as a miss.
+const char ANALYSIS_CACHE_MAGIC[8] = {'C', 'H', 'S', 'C', 'A', 'C', 'H', '1'};
+const int ANALYSIS_CACHE_BITS = 20;
+
+class AnalysisCache
+{
+    struct Header
+    {
+        char magic[8];
+        uint32_t bits;
+        uint32_t reserved;
+    };
+    void* data = NULL;
+    size_t bytes = 0;
+    TranspositionTable* table = NULL;
+
+    public:
+    AnalysisCache(const string& path, int bits = ANALYSIS_CACHE_BITS)
+    {
+        int fd = (path == "") ? -1 : open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if(fd == -1) return;
+        size_t size = sizeof(Header) + (TranspositionTable::ENTRY_SIZE << bits);
+        struct stat st;
+        if((fstat(fd, &st) == 0) && (((size_t)st.st_size == size) || ((st.st_size == 0) && (ftruncate(fd, size) == 0))))
         {
-            cout << i + 1 << " ";
-            for(int j = 0; j < width; j++)
+            void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if(mapped != MAP_FAILED)
             {
-                for(Highlight* k : hl_v)
-                    if(k -> get_x() == j && k -> get_y() == i)
-                        cout << k -> get_cmd();
-                cout << board[i * width + j]->get_img() << " ";
-                cout << "\x1b[0m";
+                Header* header = (Header*)mapped;
+                //A session that died right after creating the file left the header zeroed
+                if(header->bits == 0)
+                {
+                    memcpy(header->magic, ANALYSIS_CACHE_MAGIC, sizeof(header->magic));
+                    header->bits = bits;
+                }
+                if((memcmp(header->magic, ANALYSIS_CACHE_MAGIC, sizeof(header->magic)) == 0) && (header->bits == (uint32_t)bits))
+                {
+                    data = mapped;
+                    bytes = size;
+                    table = new TranspositionTable(header + 1, bits);
+                }
+                else
+                    munmap(mapped, size);
             }
-            cout << "\t" <<  game_info[height - i - 1];
         }
-        cout << "  ";
-        for(int k = 0; k < width; k++)
-            cout << high_alphabet[k] << " ";
-        cout << "\t" <<  game_info[8];
+        close(fd);
     }
-    void print_flipped_board()
+    bool is_open() const { return table != NULL; }
+    bool probe(uint64_t key, TTData& out) const { return (table != NULL) && table->probe(key, out); }
+    void store(uint64_t key, int depth, int score, Bound bound, int from, int to)
     {
-        system("clear");
-        for(int i = 0; i < height; i++)
-        {
-            cout << i + 1 << " ";
-            for(int j = width - 1; j >= 0; j--)
-            {
-                for(Highlight* k : hl_v)
-                    if(k -> get_x() == j && k -> get_y() == i)
-                        cout << k -> get_cmd();
-                cout << board[i * width + j]->get_img() << " ";
-                cout << "\x1b[0m";
-            }
-            cout << "\t" <<  game_info[i];
-        }
-        cout << "  ";
-        for(int k = 0; k < width; k++)
-            cout << high_alphabet[k] << " ";
-        cout << "\t" <<  game_info[8];
+        if(table != NULL)
+            table->store(key, depth, score, bound, from, to);
     }
-    void add_highliter(Highlight* hl) { hl_v.push_back(hl); }
-    void pop_last_highliter() { hl_v.pop_back(); }
-    Object* get_hit_field() const { return hit_field; }
-    void set_hit_field(Object* _hit_field) { hit_field = _hit_field; }
-    int get_turn() const {return turn; }
-    int  get_inside_counter() const { return inside_counter; }
-    void set_inside_counter(int _inside_counter) { inside_counter = _inside_counter; }
-    void dec_inside_counter() { inside_counter--; }
-    void set_cur_state(State _cur_state) { cur_state = _cur_state; }
-    void clear()
+    ~AnalysisCache()
     {
-        Object* obj;
-        for(int y = 0; y < height; y++)
-        {
-            for(int x = 0; x < width; x++)
-            {
-                obj = this->get(x, y);
-                if(obj->get_type() != Square)
-                    this->add(new class Square(x, y, ((x + y) % 2 == 1) ? WHITE : BLACK));
-                
-            }
-        }
+        delete table;
+        if(data != NULL)
+            munmap(data, bytes);
     }
-    void set_start_position();
-    bool get_board_flipped() { return board_flipped; }
-    Object* is_hitted(Object* obj, Color color = UNCOLORED, Obj type = Unknown, int x_hint = -1, int y_hint = -1)
+};
+
+//$CHESS_CACHE, otherwise analysis.cache in $XDG_CACHE_HOME/chess or ~/.cache/chess; empty leaves the cache off
+string analysis_cache_path()
+{
+    if(getenv("CHESS_CACHE") != NULL)
+        return getenv("CHESS_CACHE");
+    string dir;
+    if((getenv("XDG_CACHE_HOME") != NULL) && (getenv("XDG_CACHE_HOME")[0] == '/'))
+        dir = getenv("XDG_CACHE_HOME");
+    else if(getenv("HOME") != NULL)
     {
-        int threats_count = 0;
-        Object* threat = NULL; 
-        for(int y = 0; y < height; y++)
+        dir = string(getenv("HOME")) + "/.cache";
+        mkdir(dir.c_str(), 0755);
+    }
+    else
+        return "";
+    dir += "/chess";
+    mkdir(dir.c_str(), 0755);
+    return dir + "/analysis.cache";
+}
+
+AnalysisCache& analysis_cache()
+{
+    static AnalysisCache cache(analysis_cache_path());
+    return cache;
+}
+
+//Direct-mapped cache of centipawn scores, owned by one search thread
+class ScoreCache
+{
+    struct Entry
+    {
+        uint64_t key;
+        int32_t score;
+    };
+    vector<Entry> entries;
+    size_t mask;
+
+    public:
+    long probes = 0;
+    long hits = 0;
+    ScoreCache(int bits) : mask((size_t(1) << bits) - 1) {}
+    bool probe(uint64_t key, int& score)
+    {
+        if(entries.empty()) entries.resize(mask + 1, {~0ULL, 0});
+        probes++;
+        Entry& entry = entries[key & mask];
+        if(entry.key != key) return false;
+        hits++;
+        score = entry.score;
+        return true;
+    }
+    void store(uint64_t key, int score) { entries[key & mask] = {key, score}; }
+    void clear() { fill(entries.begin(), entries.end(), Entry{~0ULL, 0}); }
+    void reset_stats() { probes = hits = 0; }
+};
+
+//Evaluation weights in centipawns. Every term of static_analyze is weight * count with
+//counts taken white minus black, so the evaluation is linear in the weights and can be tuned.
+//Per-piece weights follow the Obj order starting from Queen; pawn rewards are indexed by relative rank.
+enum EvalParam
+{
+    QueenValue, RookValue, BishopValue, KnightValue, PawnValue,
+    QueenMobility, RookMobility, BishopMobility, KnightMobility,
+    QueenZoneAttack, RookZoneAttack, BishopZoneAttack, KnightZoneAttack,
+    PawnChain, DoubledPawn, IsolatedPawn, BishopPair, KingMovedUncastled,
+    PawnReward,
+    PassedPawnReward = PawnReward + 8,
+    EVAL_PARAMS_COUNT = PassedPawnReward + 8
+};
+
+struct EvalParams
+{
+    int values[EVAL_PARAMS_COUNT];
+};
+
+constexpr EvalParams default_eval_params = {{
+    950, 563, 333, 305, 100,
+    3, 3, 4, 9,
+    4, 3, 2, 2,
+    12, -25, -10, 50, -50,
+    0, 0, 0, 0, 10, 20, 30, 0,
+    0, 50, 50, 50, 70, 90, 110, 0
+}};
+
+const char* const eval_param_names[PawnReward] = {
+    "queen_value", "rook_value", "bishop_value", "knight_value", "pawn_value",
+    "queen_mobility", "rook_mobility", "bishop_mobility", "knight_mobility",
+    "queen_zone_attack", "rook_zone_attack", "bishop_zone_attack", "knight_zone_attack",
+    "pawn_chain", "doubled_pawn", "isolated_pawn", "bishop_pair", "king_moved_uncastled"
+};
+
+string eval_param_name(int param)
+{
+    if(param < PawnReward) return eval_param_names[param];
+    if(param < PassedPawnReward) return "pawn_reward_" + to_string(param - PawnReward);
+    return "passed_pawn_reward_" + to_string(param - PassedPawnReward);
+}
+
+//Parameter files hold "name value" lines; missing names keep their current value
+bool read_eval_params(const string& path, EvalParams& params)
+{
+    ifstream file(path);
+    if(!file.is_open()) return false;
+    //Applied only once the whole file has been read, a bad line leaves params untouched
+    EvalParams loaded = params;
+    string name;
+    int value;
+    while(file >> name >> value)
+    {
+        int param = 0;
+        while((param < EVAL_PARAMS_COUNT) && (eval_param_name(param) != name))
+            param++;
+        if(param == EVAL_PARAMS_COUNT)
         {
-            for(int x = 0; x < width; x++)
-            {
-                if((color != UNCOLORED) && (this->get(x, y)->get_color() != color)) continue;
-                if((type != Unknown) && (this->get(x, y)->get_type() != type)) continue;
-                if((x_hint != -1) && (x != x_hint)) continue;
-                if((y_hint != -1) && (y != y_hint)) continue;
-                if(this->get(x, y)->is_legal(obj, this))
-                {
-                    threat = this->get(x, y);
-                    threats_count++;
-                }
-            }
+            cerr << "Unknown evaluation parameter " << name << " in " << path << "\n";
+            return false;
         }
-        if(threats_count > 1) double_check = true;
-        return threat;
+        loaded.values[param] = value;
     }
-    Object* check_king_dependency(Object* figure, Object* next_stop)
+    if(!file.eof())
+        return false;
+    params = loaded;
+    return true;
+}
+
+bool write_eval_params(const string& path, const EvalParams& params)
+{
+    ofstream file(path);
+    if(!file.is_open()) return false;
+    for(int param = 0; param < EVAL_PARAMS_COUNT; param++)
+        file << eval_param_name(param) << " " << params.values[param] << "\n";
+    return true;
+}
+
+//Weights used by the engine: defaults overridden by eval.txt (or $CHESS_EVAL) when present
+const EvalParams& eval_params()
+{
+    static EvalParams params = []()
     {
-        Object* king = (figure->get_color() == WHITE ? this->get_white_king() : this->get_black_king());
-        int x = figure->get_x();
-        int y = figure->get_y();
-        int new_x = next_stop->get_x();
-        int new_y = next_stop->get_y();
+        EvalParams loaded = default_eval_params;
+        const char* path = (getenv("CHESS_EVAL") != NULL ? getenv("CHESS_EVAL") : "eval.txt");
+        if(!read_eval_params(path, loaded) && (getenv("CHESS_EVAL") != NULL))
+            cerr << "Can't read evaluation parameters " << path << "\n";
+        return loaded;
+    }();
+    return params;
+}
 
-        Object* temp = this->get(new_x, new_y);
-        figure->set_x(new_x);
-        figure->set_y(new_y);
-        this->add_wd(figure);
-        this->add_wd(new class Square(x, y, (x + y) % 2 == 1 ? WHITE : BLACK)); 
+//Accumulates weight * count; with coefficients set it also records the counts for tuning
+struct EvalTerms
+{
+    const int* weights;
+    int* coefficients = NULL;
+    int score = 0;
 
-        Object* is_hitted = this->is_hitted(king);
-        double_check = false;
+    void add(int param, int count)
+    {
+        score += weights[param] * count;
+        if(coefficients != NULL) coefficients[param] += count;
+    }
+};
 
-        figure->set_x(x);
-        figure->set_y(y);
-        this->add(figure);
-        this->add_wd(temp);
+//Evaluation flags: the king of that color has moved without castling
+const int WHITE_KING_MOVED = 1;
+const int BLACK_KING_MOVED = 2;
 
-        return is_hitted;
+//Trivially copyable position: what a search needs to rebuild a board on another thread and what the
+//evaluation reads. Board keeps the game, its UI state and the move machinery around it.
+struct Position
+{
+    uint64_t pieces[2][6];
+    //Board::hash for the side to move
+    uint64_t key;
+    uint8_t side;
+    //Bit 0 white short, 1 white long, 2 black short, 3 black long
+    uint8_t castling;
+    //Bit per color; evaluation state only, the key leaves them out so a position from FEN and the same one
+    //reached in a game share it
+    uint8_t king_moved;
+    uint8_t castled;
+    //Square a pawn can capture onto en passant, or -1
+    int8_t en_passant;
+    uint8_t halfmove;
+    uint16_t fullmove;
+
+    int eval_flags() const
+    {
+        int flags = 0;
+        if((king_moved & ~castled) & (1 << WHITE)) flags |= WHITE_KING_MOVED;
+        if((king_moved & ~castled) & (1 << BLACK)) flags |= BLACK_KING_MOVED;
+        return flags;
     }
-    bool check_king_overlap(Object* king, Object* checker)
+    bool piece_at(int square, int& color, int& type) const
     {
-        int x = checker->get_x();
-        int y = checker->get_y();
-        int new_x = king->get_x();
-        int new_y = king->get_y();
-        Color color = king->get_color();
-        Object* possible_blocker;
-        if((checker->get_type() == Knight) || (checker->get_type() == Pawn))
-        {
-            possible_blocker = this->is_hitted(checker, color);
-            if(
-                possible_blocker != NULL
-                && (this->check_king_dependency(possible_blocker, this->get(x, y)) == NULL)
-            )
-                return true;
-        }
-        if((checker->get_type() == Bishop) || (checker->get_type() == Queen))
-        {
-            if(abs(x - new_x) == abs(y - new_y))
+        for(color = WHITE; color <= BLACK; color++)
+            for(type = King; type <= Pawn; type++)
+                if((pieces[color][type] >> square) & 1)
+                    return true;
+        return false;
+    }
+};
+static_assert(is_trivially_copyable<Position>::value, "Position is copied between threads with memcpy");
+static_assert(sizeof(Position) <= 200, "Position must stay compact");
+
+//Positions in structure-of-arrays layout: one array per color and piece type bitboard
+struct PositionBatch
+{
+    vector<uint64_t> pieces[2][6];
+    vector<uint8_t> flags;
+
+    size_t size() const { return flags.size(); }
+    void add(const Position& position) { add(position.pieces, position.eval_flags()); }
+    void add(const uint64_t (&position)[2][6], int position_flags)
+    {
+        for(int c = 0; c < 2; c++)
+            for(int t = 0; t < 6; t++)
+                pieces[c][t].push_back(position[c][t]);
+        flags.push_back(position_flags);
+    }
+    void get(size_t index, uint64_t (&position)[2][6]) const
+    {
+        for(int c = 0; c < 2; c++)
+            for(int t = 0; t < 6; t++)
+                position[c][t] = pieces[c][t][index];
+    }
+};
+
+class ThreadPool
+{
+    vector<thread> workers;
+    deque<function<void()>> tasks;
+    mutex tasks_mutex;
+    condition_variable tasks_ready;
+    bool stopping = false;
+
+    public:
+    ThreadPool(int threads_count)
+    {
+        for(int i = 0; i < threads_count; i++)
+            workers.push_back(thread([this]()
             {
-                int x_i = (x - new_x < 0) ? 1 : -1;
-                int y_i = (y - new_y < 0) ? 1 : -1;
-                int rez = abs(x - new_x) - 1;
-                for(int i = 0; i <= rez; i++)
+                while(true)
                 {
-                    possible_blocker = this->is_hitted(this->get(x, y), color);
-                    if(
-                        possible_blocker != NULL
-                        && (this->check_king_dependency(possible_blocker, this->get(x, y)) == NULL)
-                    )
-                        return true;
-                    x += x_i;
-                    y += y_i;
+                    function<void()> task;
+                    {
+                        unique_lock<mutex> lock(tasks_mutex);
+                        tasks_ready.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                        if(tasks.empty()) return;
+                        task = move(tasks.front());
+                        tasks.pop_front();
+                    }
+                    task();
                 }
-            }
+            }));
+    }
+    int size() const { return workers.size(); }
+    template<class F> future<decltype(declval<F>()())> submit(F job)
+    {
+        auto task = make_shared<packaged_task<decltype(declval<F>()())()>>(move(job));
+        auto result = task->get_future();
+        {
+            lock_guard<mutex> lock(tasks_mutex);
+            tasks.push_back([task]() { (*task)(); });
         }
-        if((checker->get_type() == Rook) || (checker->get_type() == Queen))
+        tasks_ready.notify_one();
+        return result;
+    }
+    ~ThreadPool()
+    {
         {
-            if(x == new_x)
-            {
-                for(int i = min(y, new_y); i <= max(y, new_y); i++)
-                {
-                    possible_blocker = this->is_hitted(this->get(x, i), color);
-                    if(
-                        possible_blocker != NULL
-                        && (this->check_king_dependency(possible_blocker, this->get(x, i)) == NULL)
-                    )
-                        return true;
-                }
-            }
-            if(y == new_y)
+            lock_guard<mutex> lock(tasks_mutex);
+            stopping = true;
+        }
+        tasks_ready.notify_all();
+        for(auto& worker : workers)
+            worker.join();
+    }
+};
+
+//Same 16 byte entry as Polyglot books: move is to | from << 6 with squares as y * 8 + x.
+//Keys are the Zobrist keys of this program, entries are sorted by key and then by weight descending.
+struct BookEntry
+{
+    uint64_t key;
+    uint16_t move;
+    uint16_t weight;
+    uint32_t learn;
+};
+
+const int BOOK_MAX_PLY = 40;
+
+class OpeningBook
+{
+    const BookEntry* entries = NULL;
+    size_t count = 0;
+
+    public:
+    OpeningBook(const string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd == -1) return;
+        struct stat st;
+        if((fstat(fd, &st) == 0) && (st.st_size >= (off_t)sizeof(BookEntry)))
+        {
+            void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(data != MAP_FAILED)
             {
-                for(int i = min(x, new_x); i <= max(x, new_x); i++)
-                {
-                    possible_blocker = this->is_hitted(this->get(i, y), color);
-                    if(
-                        possible_blocker != NULL
-                        && (this->check_king_dependency(possible_blocker, this->get(i, y)) == NULL)
-                    )
-                        return true;
-                }
+                entries = (const BookEntry*)data;
+                count = st.st_size / sizeof(BookEntry);
             }
         }
-        return false;
+        close(fd);
     }
-    Object* check_chess_check(Color color)
+    bool is_open() const { return entries != NULL; }
+    //Returns the heaviest move for the position or -1
+    int probe(uint64_t key, int& weight) const
     {
-        return this->is_hitted((color == WHITE) ? this->get_white_king() : this->get_black_king());
+        const BookEntry* entry = lower_bound(entries, entries + count, key,
+            [](const BookEntry& e, uint64_t k) { return e.key < k; });
+        if((entry == entries + count) || (entry->key != key)) return -1;
+        weight = entry->weight;
+        return entry->move;
     }
-    bool check_mate(Color color)
+    ~OpeningBook()
     {
-        Object* checker = check_chess_check(color);
-        if(checker == NULL) return false;
-        Object* king = ((color == WHITE) ? this->get_white_king() : this->get_black_king());
-        int x = king->get_x();
-        int y = king->get_y();
-        if(double_check == false)
+        if(entries != NULL)
+            munmap((void*)entries, count * sizeof(BookEntry));
+    }
+};
+
+OpeningBook& opening_book()
+{
+    static OpeningBook book(getenv("CHESS_BOOK") != NULL ? getenv("CHESS_BOOK") : "book.bin");
+    return book;
+}
+
+//Bitbases keep one bit per position: 1 - the side with pieces wins, 0 - draw.
+//Only a strong side against a bare king is covered. Pawn endings are left out: the moves have no promotions,
+//so the search could not convert a won KPK.
+//The side with pieces is stored as white; first come white to move positions, then black to move.
+//Index is wk | bk << 6 | piece_1 << 12 | piece_2 << 18 with pieces ordered as in Obj.
+struct BitbaseMaterial
+{
+    const char* name;
+    int count;
+    Obj pieces[2];
+};
+
+constexpr BitbaseMaterial bitbase_materials[] = {
+    {"kqk", 1, {Queen}},
+    {"krk", 1, {Rook}},
+    {"kbnk", 2, {Bishop, Knight}},
+    {"kbbk", 2, {Bishop, Bishop}},
+};
+
+const double KNOWN_WIN = 100.0;
+
+class Board;
+
+class Bitbases
+{
+    struct Table
+    {
+        const uint8_t* bits;
+        size_t bytes;
+        size_t size;
+    };
+    map<string, Table> tables;
+
+    public:
+    Bitbases(const string& dir)
+    {
+        for(auto& material : bitbase_materials)
         {
-            if(this->check_king_overlap(king, checker))
-                return false;
+            string path = dir + "/" + material.name + ".bb";
+            int fd = open(path.c_str(), O_RDONLY);
+            if(fd == -1) continue;
+            struct stat st;
+            size_t size = (size_t)1 << (12 + 6 * material.count);
+            if((fstat(fd, &st) == 0) && ((size_t)st.st_size == size / 4))
+            {
+                void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if(data != MAP_FAILED)
+                    tables[material.name] = {(const uint8_t*)data, (size_t)st.st_size, size};
+            }
+            close(fd);
         }
-        double_check = false;
-        if(
-            king->is_legal(this->get(x, y+1), this)
-            || king->is_legal(this->get(x+1, y+1), this)
-            || king->is_legal(this->get(x+1, y), this)
-            || king->is_legal(this->get(x+1, y-1), this)
-            || king->is_legal(this->get(x, y-1), this)
-            || king->is_legal(this->get(x-1, y-1), this)
-            || king->is_legal(this->get(x-1, y), this)
-            || king->is_legal(this->get(x-1, y+1), this)
-        )   
+    }
+    bool is_empty() const { return tables.size() == 0; }
+    //Returns -1 if the position is not covered, 0 for a draw and 1 if strong side wins
+    int probe(Board* board, Color turn_color, Color& strong);
+    ~Bitbases()
+    {
+        for(auto& i : tables)
+            munmap((void*)i.second.bits, i.second.bytes);
+    }
+};
+
+Bitbases& bitbases()
+{
+    static Bitbases tables(getenv("CHESS_BITBASES") != NULL ? getenv("CHESS_BITBASES") : "bitbases");
+    return tables;
+}
+
+//Search counters are kept in debug builds; release builds (-DNDEBUG) compile them out
+#ifndef NDEBUG
+#define SEARCH_STATS
+#endif
+
+#ifdef SEARCH_STATS
+#define STAT(statement) statement
+#else
+#define STAT(statement)
+#endif
+
+#ifdef SEARCH_STATS
+//Heap allocations made by the current thread
+thread_local long allocation_count = 0;
+
+void* operator new(size_t size)
+{
+    allocation_count++;
+    void* pointer = malloc(size == 0 ? 1 : size);
+    if(pointer == NULL) throw bad_alloc();
+    return pointer;
+}
+void operator delete(void* pointer) noexcept { free(pointer); }
+void operator delete(void* pointer, size_t) noexcept { free(pointer); }
+
+//Adds the lifetime of the scope to a nanosecond counter
+struct StatTimer
+{
+    long& total;
+    chrono::steady_clock::time_point start;
+
+    StatTimer(long& _total) : total(_total), start(chrono::steady_clock::now()) {}
+    ~StatTimer() { total += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count(); }
+};
+#endif
+
+enum PerfCounter {PerfCycles, PerfInstructions, PerfCacheMisses, PerfBranchMisses, PerfTlbMisses, PERF_COUNTERS};
+
+const char* const perf_counter_names[PERF_COUNTERS] = {"cycles", "instructions", "cache_misses", "branch_misses", "dtlb_misses"};
+
+//Counter values; -1 where the counter could not be opened
+struct PerfSample
+{
+    long values[PERF_COUNTERS] = {-1, -1, -1, -1, -1};
+
+    bool available() const { return values[PerfCycles] >= 0; }
+    PerfSample operator-(const PerfSample& other) const
+    {
+        PerfSample result;
+        for(int i = 0; i < PERF_COUNTERS; i++)
+            if((values[i] >= 0) && (other.values[i] >= 0))
+                result.values[i] = values[i] - other.values[i];
+        return result;
+    }
+    PerfSample& operator+=(const PerfSample& other)
+    {
+        for(int i = 0; i < PERF_COUNTERS; i++)
+            if(other.values[i] >= 0)
+                values[i] = max(values[i], 0L) + other.values[i];
+        return *this;
+    }
+};
+
+//User-space hardware counters of the calling thread through perf_event_open. Counters the kernel or the
+//CPU refuses stay closed and read as -1, so machines without a PMU (or with perf_event_paranoid > 2) just get no numbers.
+class PerfCounters
+{
+    int fds[PERF_COUNTERS] = {-1, -1, -1, -1, -1};
+
+    public:
+    PerfCounters()
+    {
+#ifdef __linux__
+        if((getenv("CHESS_PERF") != NULL) && (string(getenv("CHESS_PERF")) == "off"))
+            return;
+        const uint32_t types[PERF_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+        const uint64_t configs[PERF_COUNTERS] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+            PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+        };
+        for(int i = 0; i < PERF_COUNTERS; i++)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+#endif
+    }
+    ~PerfCounters()
+    {
+        for(int fd : fds)
+            if(fd >= 0) close(fd);
+    }
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+    bool available() const { return fds[PerfCycles] >= 0; }
+    //Counts since the counters were opened, scaled up when the kernel multiplexed them
+    PerfSample read() const
+    {
+        PerfSample sample;
+        for(int i = 0; i < PERF_COUNTERS; i++)
+        {
+            uint64_t data[3];
+            if((fds[i] >= 0) && (::read(fds[i], data, sizeof(data)) == sizeof(data)))
+                sample.values[i] = (data[2] > 0) ? (long)(data[0] * ((double)data[1] / data[2])) : 0;
+        }
+        return sample;
+    }
+};
+
+//Per-node or per-call ratios of a sample for the reports
+string perf_summary(const PerfSample& sample, long ops, const char* unit)
+{
+    if(!sample.available())
+        return "hardware counters unavailable";
+    char buf[256];
+    const long* v = sample.values;
+    snprintf(buf, sizeof(buf), "IPC %.2f  cycles/%s %.0f", (v[PerfInstructions] >= 0) ? v[PerfInstructions] / max((double)v[PerfCycles], 1.0) : 0.0,
+        unit, v[PerfCycles] / max((double)ops, 1.0));
+    string summary = buf;
+    const char* labels[PERF_COUNTERS] = {"", "", "cache misses", "branch misses", "dTLB misses"};
+    for(int i = PerfCacheMisses; i < PERF_COUNTERS; i++)
+        if(v[i] >= 0)
+        {
+            snprintf(buf, sizeof(buf), "  %s/%s %.2f", labels[i], unit, v[i] / max((double)ops, 1.0));
+            summary += buf;
+        }
+    return summary;
+}
+
+//Qnodes are the horizon nodes, where the static evaluation is taken
+struct SearchStats
+{
+    long qnodes = 0;
+    int seldepth = 0;
+    long tt_probes = 0;
+    long tt_hits = 0;
+    long tt_cutoffs = 0;
+    long cutoffs = 0;
+    long first_move_cutoffs = 0;
+    long allocations = 0;
+    long movegen_ns = 0;
+    long eval_ns = 0;
+};
+
+struct SearchInfo
+{
+    Color color = WHITE;
+    int depth = 0;
+    double score = 0.0;
+    long nodes = 0;
+    long time = 0;
+    long pawn_probes = 0;
+    long pawn_hits = 0;
+    long eval_probes = 0;
+    long eval_hits = 0;
+    int from = -1;
+    int to = -1;
+    string pv;
+    //Nodes of this iteration over nodes of the previous one
+    double ebf = 0.0;
+    SearchStats stats;
+    //Hardware counters of the search so far, when the AI has them
+    PerfSample perf;
+
+    long nps() const { return nodes * 1000 / max(time, 1L); }
+};
+
+//UCI info for one iteration, scores from the side to move; counters without a UCI field go to an info string
+string uci_info(const SearchInfo& info)
+{
+    double score = (info.color == WHITE ? info.score : -info.score);
+    string line = "info depth " + to_string(info.depth);
+#ifdef SEARCH_STATS
+    line += " seldepth " + to_string(info.stats.seldepth);
+#endif
+    if(fabs(score) >= MATE_SCORE - MAX_PLY)
+        line += " score mate " + to_string((score > 0 ? 1 : -1) * (((int)lround(MATE_SCORE - fabs(score)) + 1) / 2));
+    else
+        line += " score cp " + to_string(lround(score * 100));
+    string pv = info.pv;
+    if(!pv.empty() && (pv.back() == ' ')) pv.pop_back();
+    line += " nodes " + to_string(info.nodes) + " nps " + to_string(info.nps()) + " time " + to_string(info.time) + " pv " + pv;
+#ifdef SEARCH_STATS
+    char buf[256];
+    const SearchStats& stats = info.stats;
+    snprintf(buf, sizeof(buf), "\ninfo string qnodes %ld ebf %.2f tthits %ld/%ld ttcutoffs %ld firstmovecutoffs %.1f%% allocs %ld movegen %.1fms eval %.1fms",
+        stats.qnodes, info.ebf, stats.tt_hits, stats.tt_probes, stats.tt_cutoffs,
+        100.0 * stats.first_move_cutoffs / max(stats.cutoffs, 1L), stats.allocations, stats.movegen_ns / 1e6, stats.eval_ns / 1e6);
+    line += buf;
+#endif
+    if(info.perf.available())
+        line += "\ninfo string " + perf_summary(info.perf, info.nodes, "node");
+    return line;
+}
+
+//Short lines for the side panel and the move analysis printout
+vector<string> search_stats_lines(const SearchInfo& info)
+{
+    vector<string> lines;
+    char buf[128];
+    snprintf(buf, sizeof(buf), "NPS %ld  EBF %.2f", info.nps(), info.ebf);
+    lines.push_back(buf);
+#ifdef SEARCH_STATS
+    const SearchStats& stats = info.stats;
+    snprintf(buf, sizeof(buf), "Seldepth %d  Qnodes %ld  Allocs %ld", stats.seldepth, stats.qnodes, stats.allocations);
+    lines.push_back(buf);
+    snprintf(buf, sizeof(buf), "TT hits %ld%%  TT cutoffs %ld  First move cutoffs %ld%%", 100 * stats.tt_hits / max(stats.tt_probes, 1L),
+        stats.tt_cutoffs, 100 * stats.first_move_cutoffs / max(stats.cutoffs, 1L));
+    lines.push_back(buf);
+    snprintf(buf, sizeof(buf), "Movegen %.1f ms  Eval %.1f ms", stats.movegen_ns / 1e6, stats.eval_ns / 1e6);
+    lines.push_back(buf);
+#endif
+    if(info.perf.available())
+        lines.push_back(perf_summary(info.perf, info.nodes, "node"));
+    return lines;
+}
+
+//One JSON object per iteration for the search log
+string search_info_json(const SearchInfo& info)
+{
+    char buf[512];
+    string pv = info.pv;
+    if(!pv.empty() && (pv.back() == ' ')) pv.pop_back();
+    snprintf(buf, sizeof(buf), "{\"depth\":%d,\"score\":%.2f,\"nodes\":%ld,\"time\":%ld,\"nps\":%ld,\"ebf\":%.3f",
+        info.depth, info.score, info.nodes, info.time, info.nps(), info.ebf);
+    string json = buf;
+#ifdef SEARCH_STATS
+    const SearchStats& stats = info.stats;
+    snprintf(buf, sizeof(buf), ",\"seldepth\":%d,\"qnodes\":%ld,\"tt_probes\":%ld,\"tt_hits\":%ld,\"tt_cutoffs\":%ld,"
+        "\"cutoffs\":%ld,\"first_move_cutoffs\":%ld,\"allocations\":%ld,\"movegen_ns\":%ld,\"eval_ns\":%ld",
+        stats.seldepth, stats.qnodes, stats.tt_probes, stats.tt_hits, stats.tt_cutoffs,
+        stats.cutoffs, stats.first_move_cutoffs, stats.allocations, stats.movegen_ns, stats.eval_ns);
+    json += buf;
+#endif
+    for(int i = 0; i < PERF_COUNTERS; i++)
+        if(info.perf.values[i] >= 0)
+            json += ",\"" + string(perf_counter_names[i]) + "\":" + to_string(info.perf.values[i]);
+    return json + ",\"pv\":\"" + pv + "\"}";
+}
+
+class Highlight
+{
+    int x, y;
+    char* cmd;
+
+    public:
+    Highlight(int _x, int _y, char* _cmd) : x(_x), y(_y), cmd(_cmd) {}
+    int get_x() const {return x; }
+    void set_x(int _x) { x = _x; }
+    int get_y() const {return y; }
+    void set_y(int _y) { y = _y; }
+    char* get_cmd() const {return cmd; }
+};
+
+class Board;
+
+class Object
+{
+    Color clr;
+    char* img;
+    int x, y;
+    int extra;
+    Obj type;
+    int links;
+
+    public:
+    Object(int _x, int _y, Color _clr = WHITE) : clr(_clr), x(_x), y(_y), extra(0), links(0) {}
+    Color   get_color()       const { return clr; }
+    void    set_color(Color _clr)   { clr = _clr; }
+    char*   get_img()         const { return img; }
+    void    set_img(char* _img)     { img = _img; }
+    int     get_x()           const { return x; }
+    void    set_x(int _x)           { x = _x; }
+    int     get_y()           const { return y; }
+    void    set_y(int _y)           { y = _y; }
+    int     get_extra()       const { return extra; }
+    void    inc_extra()             { extra++; }
+    void    dec_extra()             { extra--; }
+    void    set_extra(int _extra)   { extra = _extra; }
+    Obj     get_type()        const { return type; }
+    void    set_type(Obj _type)     { type = _type; }
+    int     get_links()       const { return links; }
+    void    inc_links()             { links++; }
+    void    dec_links()             { links--; }
+
+
+    virtual bool is_legal(Object* obj, Board* board) { return false; };
+    virtual ~Object() {}
+};
+
+class Square : public Object
+{
+    public:
+    Square(int _x, int _y, Color _clr) : Object(_x, _y, _clr) {
+        if(this -> get_color() == WHITE)
+            this -> set_img((char*)"\u25A1");
+        else
+            this -> set_img((char*)"\u25A0");
+        this->set_type(Obj::Square);
+    }
+    virtual bool is_legal(Object* obj, Board* board) 
+    {
+        return false;
+    }
+
+};
+
+class Turn
+{
+    Object* obj_from;
+    Object* obj_to;
+    Object* obj_replace;
+    int extra_index;
+    double ai_evaluation;
+    //Board's halfmove clock and en passant square before the move, restored when it is taken back
+    int halfmove_before = 0;
+    int en_passant_before = -1;
+
+    public:
+    Turn(Object* _from, Object* _to, int _castling_index = -1) : obj_from(_from), obj_to(_to), extra_index(_castling_index)
+    {
+        int x = obj_from->get_x();
+        int y = obj_from->get_y();
+        obj_replace = new class Square(x, y, (((x + y) % 2 == 1) ? WHITE : BLACK));
+    }
+    Object* get_from() const { return obj_from; }
+    Object* get_to() const { return obj_to; }
+    Object* get_replace() const { return obj_replace; }
+    int get_from_square() const { return obj_from->get_y() * 8 + obj_from->get_x(); }
+    int get_to_square() const { return obj_to->get_y() * 8 + obj_to->get_x(); }
+    void set_from(Object* _from)  { obj_from = _from; }
+    void set_to(Object* _to) { obj_to = _to; }
+    void set_replace(Object* _replace) { obj_replace = _replace; }
+    int get_extra_index()  const { return extra_index; }
+    void set_extra_index(int _extra_index)  { extra_index = _extra_index; }
+    double get_ai_evaluation()  const { return ai_evaluation; }
+    void set_ai_evaluation(double _ai_evaluation)  { ai_evaluation = _ai_evaluation; }
+    int get_halfmove_before() const { return halfmove_before; }
+    void set_halfmove_before(int _halfmove_before) { halfmove_before = _halfmove_before; }
+    int get_en_passant_before() const { return en_passant_before; }
+    void set_en_passant_before(int _en_passant_before) { en_passant_before = _en_passant_before; }
+};
+
+//Efficiently updatable network: 768 piece-square inputs seen from each side -> NNUE_HIDDEN -> 1.
+//File layout (little endian): 8 byte magic "CHSNNUE1", int32 hidden size, int16 feature weights [768][hidden],
+//int16 feature biases [hidden], int16 output weights [2][hidden] (white half first), int32 output bias.
+//Score is white-positive: (sum(clamp(acc, 0, QA) * w) + bias) * SCALE / (QA * QB) centipawns.
+const int NNUE_INPUTS = 768;
+const int NNUE_HIDDEN = 256;
+const int NNUE_QA = 255;
+const int NNUE_QB = 64;
+const int NNUE_SCALE = 400;
+const char NNUE_MAGIC[8] = {'C', 'H', 'S', 'N', 'N', 'U', 'E', '1'};
+
+struct NnueAccumulator
+{
+    alignas(32) int16_t values[2][NNUE_HIDDEN];
+};
+
+struct NnueWeights
+{
+    alignas(32) int16_t feature_weights[NNUE_INPUTS][NNUE_HIDDEN];
+    alignas(32) int16_t feature_bias[NNUE_HIDDEN];
+    alignas(32) int16_t output_weights[2][NNUE_HIDDEN];
+    int32_t output_bias;
+};
+
+void nnue_add_scalar(int16_t* acc, const int16_t* weights)
+{
+    for(int i = 0; i < NNUE_HIDDEN; i++)
+        acc[i] += weights[i];
+}
+void nnue_sub_scalar(int16_t* acc, const int16_t* weights)
+{
+    for(int i = 0; i < NNUE_HIDDEN; i++)
+        acc[i] -= weights[i];
+}
+int32_t nnue_output_scalar(const int16_t* acc, const int16_t* weights)
+{
+    int32_t sum = 0;
+    for(int i = 0; i < NNUE_HIDDEN; i++)
+        sum += min(max((int32_t)acc[i], 0), NNUE_QA) * weights[i];
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) void nnue_add_avx2(int16_t* acc, const int16_t* weights)
+{
+    for(int i = 0; i < NNUE_HIDDEN; i += 16)
+        _mm256_store_si256((__m256i*)(acc + i), _mm256_add_epi16(
+            _mm256_load_si256((const __m256i*)(acc + i)), _mm256_load_si256((const __m256i*)(weights + i))));
+}
+__attribute__((target("avx2"))) void nnue_sub_avx2(int16_t* acc, const int16_t* weights)
+{
+    for(int i = 0; i < NNUE_HIDDEN; i += 16)
+        _mm256_store_si256((__m256i*)(acc + i), _mm256_sub_epi16(
+            _mm256_load_si256((const __m256i*)(acc + i)), _mm256_load_si256((const __m256i*)(weights + i))));
+}
+__attribute__((target("avx2"))) int32_t nnue_output_avx2(const int16_t* acc, const int16_t* weights)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i qa = _mm256_set1_epi16(NNUE_QA);
+    __m256i sum = _mm256_setzero_si256();
+    for(int i = 0; i < NNUE_HIDDEN; i += 16)
+    {
+        __m256i a = _mm256_min_epi16(_mm256_max_epi16(_mm256_load_si256((const __m256i*)(acc + i)), zero), qa);
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(a, _mm256_load_si256((const __m256i*)(weights + i))));
+    }
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+    return _mm_cvtsi128_si32(half);
+}
+
+__attribute__((target("sse4.1"))) void nnue_add_sse4(int16_t* acc, const int16_t* weights)
+{
+    for(int i = 0; i < NNUE_HIDDEN; i += 8)
+        _mm_store_si128((__m128i*)(acc + i), _mm_add_epi16(
+            _mm_load_si128((const __m128i*)(acc + i)), _mm_load_si128((const __m128i*)(weights + i))));
+}
+__attribute__((target("sse4.1"))) void nnue_sub_sse4(int16_t* acc, const int16_t* weights)
+{
+    for(int i = 0; i < NNUE_HIDDEN; i += 8)
+        _mm_store_si128((__m128i*)(acc + i), _mm_sub_epi16(
+            _mm_load_si128((const __m128i*)(acc + i)), _mm_load_si128((const __m128i*)(weights + i))));
+}
+__attribute__((target("sse4.1"))) int32_t nnue_output_sse4(const int16_t* acc, const int16_t* weights)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i qa = _mm_set1_epi16(NNUE_QA);
+    __m128i sum = _mm_setzero_si128();
+    for(int i = 0; i < NNUE_HIDDEN; i += 8)
+    {
+        __m128i a = _mm_min_epi16(_mm_max_epi16(_mm_load_si128((const __m128i*)(acc + i)), zero), qa);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(a, _mm_load_si128((const __m128i*)(weights + i))));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+    return _mm_cvtsi128_si32(sum);
+}
+#endif
+
+class Nnue
+{
+    NnueWeights* weights = NULL;
+    //Hash of the weights, never zero once loaded
+    uint64_t id = 0;
+    void (*add_kernel)(int16_t*, const int16_t*) = nnue_add_scalar;
+    void (*sub_kernel)(int16_t*, const int16_t*) = nnue_sub_scalar;
+    int32_t (*output_kernel)(const int16_t*, const int16_t*) = nnue_output_scalar;
+    const char* kernel_name = "scalar";
+
+    static int feature(Color perspective, Color color, Obj type, int square)
+    {
+        if(perspective == BLACK)
+        {
+            color = reverse_color(color);
+            square ^= 56;
+        }
+        return (color * 6 + type) * 64 + square;
+    }
+
+    public:
+    Nnue(const string& path = "")
+    {
+        select_kernels(true);
+        if(path != "") load(path);
+    }
+    bool load(const string& path)
+    {
+        ifstream file(path, ios::binary);
+        if(!file.is_open()) return false;
+        char magic[8];
+        int32_t hidden = 0;
+        file.read(magic, 8);
+        file.read((char*)&hidden, sizeof(hidden));
+        if(!file || (memcmp(magic, NNUE_MAGIC, 8) != 0) || (hidden != NNUE_HIDDEN)) return false;
+        NnueWeights* loaded = new NnueWeights;
+        file.read((char*)loaded->feature_weights, sizeof(loaded->feature_weights));
+        file.read((char*)loaded->feature_bias, sizeof(loaded->feature_bias));
+        file.read((char*)loaded->output_weights, sizeof(loaded->output_weights));
+        file.read((char*)&loaded->output_bias, sizeof(loaded->output_bias));
+        if(!file)
+        {
+            delete loaded;
             return false;
+        }
+        delete weights;
+        weights = loaded;
+        id = 0;
+        const uint64_t* words = (const uint64_t*)loaded;
+        for(size_t i = 0; i < sizeof(NnueWeights) / sizeof(uint64_t); i++)
+        {
+            uint64_t state = id ^ words[i];
+            id = splitmix64(state);
+        }
+        id |= 1;
+        return true;
+    }
+    //Small random network, enough to exercise the update and output kernels
+    void randomize(uint64_t seed)
+    {
+        delete weights;
+        weights = new NnueWeights;
+        for(int i = 0; i < NNUE_INPUTS; i++)
+            for(int j = 0; j < NNUE_HIDDEN; j++)
+                weights->feature_weights[i][j] = (int16_t)(splitmix64(seed) % 65) - 32;
+        for(int j = 0; j < NNUE_HIDDEN; j++)
+        {
+            weights->feature_bias[j] = (int16_t)(splitmix64(seed) % 129);
+            weights->output_weights[0][j] = (int16_t)(splitmix64(seed) % 129) - 64;
+            weights->output_weights[1][j] = (int16_t)(splitmix64(seed) % 129) - 64;
+        }
+        weights->output_bias = 0;
+        id = splitmix64(seed) | 1;
+    }
+    bool is_loaded() const { return weights != NULL; }
+    uint64_t get_id() const { return id; }
+    const char* get_kernel_name() const { return kernel_name; }
+    void select_kernels(bool allow_simd)
+    {
+        add_kernel = nnue_add_scalar;
+        sub_kernel = nnue_sub_scalar;
+        output_kernel = nnue_output_scalar;
+        kernel_name = "scalar";
+        if(!allow_simd) return;
+#if defined(__x86_64__) || defined(__i386__)
+        if(__builtin_cpu_supports("avx2"))
+        {
+            add_kernel = nnue_add_avx2;
+            sub_kernel = nnue_sub_avx2;
+            output_kernel = nnue_output_avx2;
+            kernel_name = "avx2";
+        }
+        else if(__builtin_cpu_supports("sse4.1"))
+        {
+            add_kernel = nnue_add_sse4;
+            sub_kernel = nnue_sub_sse4;
+            output_kernel = nnue_output_sse4;
+            kernel_name = "sse4.1";
+        }
+#endif
+    }
+    void refresh(Object* const* squares, NnueAccumulator& acc) const
+    {
+        memcpy(acc.values[WHITE], weights->feature_bias, sizeof(weights->feature_bias));
+        memcpy(acc.values[BLACK], weights->feature_bias, sizeof(weights->feature_bias));
+        for(int i = 0; i < 64; i++)
+            if(squares[i]->get_type() != Square)
+                update(acc, squares[i]->get_color(), squares[i]->get_type(), i, true);
+    }
+    void update(NnueAccumulator& acc, Color color, Obj type, int square, bool add) const
+    {
+        for(int perspective = WHITE; perspective <= BLACK; perspective++)
+        {
+            const int16_t* column = weights->feature_weights[feature((Color)perspective, color, type, square)];
+            if(add)
+                add_kernel(acc.values[perspective], column);
+            else
+                sub_kernel(acc.values[perspective], column);
+        }
+    }
+    //White-positive score in centipawns
+    int evaluate(const NnueAccumulator& acc) const
+    {
+        int64_t sum = output_kernel(acc.values[WHITE], weights->output_weights[WHITE])
+            + output_kernel(acc.values[BLACK], weights->output_weights[BLACK]) + weights->output_bias;
+        return (int)(sum * NNUE_SCALE / (NNUE_QA * NNUE_QB));
+    }
+    ~Nnue() { delete weights; }
+};
+
+Nnue& nnue()
+{
+    static Nnue network(getenv("CHESS_NNUE") != NULL ? getenv("CHESS_NNUE") : "nnue.bin");
+    return network;
+}
+
+//Mixed into the keys of stored search results, so results of one evaluation never feed a search with another.
+//Zero for the compiled-in weights without a network, whose keys stay the plain position keys.
+uint64_t evaluator_key(const EvalParams& params, const Nnue* network)
+{
+    uint64_t key = (network != NULL) ? network->get_id() : 0;
+    for(int i = 0; i < EVAL_PARAMS_COUNT; i++)
+        if(params.values[i] != default_eval_params.values[i])
+        {
+            uint64_t state = ((uint64_t)i << 32) | (uint32_t)params.values[i];
+            key ^= splitmix64(state);
+        }
+    return key;
+}
+
+class AI
+{
+    TranspositionTable* tt = NULL;
+    AnalysisCache* cache = NULL;
+    //evaluator_key of the running search, mixed into table and cache keys so searches with other weights can share them
+    uint64_t evaluator = 0;
+    atomic<bool>* stop = NULL;
+    long nodes = 0;
+    ScoreCache pawn_cache{14};
+    ScoreCache eval_cache{16};
+    SearchStats stats;
+    PerfCounters* perf = NULL;
+    const EvalParams* params = &eval_params();
+    //Weights the pawn and evaluation caches were filled with
+    EvalParams cache_params = eval_params();
+    //Node and time limits apply from depth 2, so a search always has a move
+    long node_limit = 0;
+    long time_limit = 0;
+    chrono::steady_clock::time_point search_start;
+    int root_depth = 0;
+    bool limit_hit = false;
+    int pv_table[MAX_PLY][MAX_PLY];
+    int pv_length[MAX_PLY];
+    //Keys of the game positions before the root followed by those on the searched line
+    vector<uint64_t> keys;
+
+    public:
+    void set_tt(TranspositionTable* _tt) { tt = _tt; }
+    //Root results are read to seed the table and written after every iteration
+    void set_cache(AnalysisCache* _cache) { cache = _cache; }
+    void set_stop(atomic<bool>* _stop) { stop = _stop; }
+    //Counters must belong to the thread that runs the search
+    void set_perf(PerfCounters* _perf) { perf = _perf; }
+    void set_limits(long _node_limit, long _time_limit)
+    {
+        node_limit = _node_limit;
+        time_limit = _time_limit;
+    }
+    bool is_stopped() const { return limit_hit || ((stop != NULL) && stop->load(memory_order_relaxed)); }
+    void check_limits()
+    {
+        if((root_depth < 2) || limit_hit) return;
+        if((node_limit > 0) && (nodes >= node_limit))
+            limit_hit = true;
+        else if((time_limit > 0) && ((nodes & 1023) == 0)
+            && (chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - search_start).count() >= time_limit))
+            limit_hit = true;
+    }
+    //Cached scores of other weights are dropped, so engines sharing a thread don't see each other's evaluations
+    void check_cache_params()
+    {
+        if(memcmp(cache_params.values, params->values, sizeof(cache_params.values)) == 0) return;
+        cache_params = *params;
+        pawn_cache.clear();
+        eval_cache.clear();
+    }
+    void set_params(const EvalParams* _params)
+    {
+        params = _params;
+        check_cache_params();
+    }
+    bool check_passed_pawn(Color color, int square, uint64_t enemy_pawns);
+    void material(const uint64_t (&pieces)[2][6], EvalTerms& terms);
+    void pawn_structure(const uint64_t* pawns, EvalTerms& terms);
+    void piece_activity(const uint64_t (&pieces)[2][6], int flags, EvalTerms& terms);
+    void evaluate_terms(const uint64_t (&pieces)[2][6], int flags, EvalTerms& terms);
+    void evaluate_terms(Board* board, EvalTerms& terms);
+    void evaluate_terms(const Position& position, EvalTerms& terms) { evaluate_terms(position.pieces, position.eval_flags(), terms); }
+    void evaluate_batch(const PositionBatch& batch, size_t begin, size_t end, int32_t* scores);
+    double static_analyze(Board* board);
+    static bool compareTurnsForWhite(Turn* turn_1, Turn* turn_2)
+    {
+        return (turn_1->get_ai_evaluation() > turn_2->get_ai_evaluation());
+    }
+    static bool compareTurnsForBlack(Turn* turn_1, Turn* turn_2)
+    {
+        return (turn_1->get_ai_evaluation() < turn_2->get_ai_evaluation());
+    }
+    template<Color C> void generate_turns(Board* board, vector<Turn*>& possible_turns);
+    void generate_turns(Board* board, Color turn_color, vector<Turn*>& possible_turns);
+    void release_turns(Board* board, vector<Turn*>& possible_turns);
+    Turn* keep_turn(Board* board, vector<Turn*>& possible_turns, size_t index);
+    bool is_rule_draw(Board* board, uint64_t key);
+    double evaluate_best_answer(Board* board, Color turn_color, int depth);
+    Turn* analyze(Board* board, Color turn_color);
+    double alpha_beta(Board* board, Color turn_color, int depth, double alpha, double beta, int ply);
+    void seed_from_cache(Board* board, Color turn_color);
+    SearchInfo search(Board* board, Color turn_color, int max_depth, function<void(const SearchInfo&)> report = NULL);
+};
+
+template<Color C> Object* find_attacker(Board* board, int x, int y);
+
+enum MateResult {MateFound, NoMate, MateUnknown};
+
+//Depth-first proof-number search for forced mates, attacker's nodes are OR nodes.
+//Proof and disproof numbers live in a fixed size table keyed by position and remaining plies.
+class MateSolver
+{
+    struct Entry
+    {
+        uint64_t key;
+        uint32_t pn;
+        uint32_t dn;
+    };
+    static const uint32_t INF_PN = 100000000;
+    vector<Entry> table;
+    size_t mask;
+    AI ai;
+    Color attacker;
+    long nodes = 0;
+    long max_nodes;
+
+    uint64_t node_key(Board* board, Color side, int depth);
+    void lookup(uint64_t key, uint32_t& pn, uint32_t& dn) const
+    {
+        const Entry& entry = table[key & mask];
+        if(entry.key == key)
+        {
+            pn = entry.pn;
+            dn = entry.dn;
+        }
+        else
+            pn = dn = 1;
+    }
+    void store(uint64_t key, uint32_t pn, uint32_t dn) { table[key & mask] = {key, pn, dn}; }
+    void mid(Board* board, Color side, int depth, uint32_t thpn, uint32_t thdn, uint32_t& pn, uint32_t& dn);
+    bool extract_line(Board* board, Color side, int depth, string& line);
+
+    public:
+    MateSolver(long _max_nodes = 2000000, int bits = 20) : table((size_t)1 << bits), mask(((size_t)1 << bits) - 1), max_nodes(_max_nodes) {}
+    long get_nodes() const { return nodes; }
+    MateResult solve(Board* board, Color _attacker, int moves, int& mate_in, string& line);
+};
+
+class Board
+{
+    int width = 8;
+    int height = 8;
+
+    char* high_alphabet = (char*)"ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    char* low_alphabet = (char*)"abcdefghijklmnopqrstuvwxyz";
+    Object** board;
+    AI ai;
+    vector<Highlight*> hl_v;
+    Object* hit_field = NULL;
+    int inside_counter = 0;
+
+    Object* white_king;
+    bool white_castling;
+    Object* black_king;
+    bool black_castling;
+    bool double_check = false;
+    bool board_flipped = false;
+    string game_info[10];
+    bool skip = false;
+    vector<string> notation_turns;
+    int turn = -1;
+    vector<Turn*> turns;
+    vector<Turn*> extra_turns;
+    int free_extra_index;
+    Regime regime;
+    State cur_state;
+    bool AI_state;
+    int mate_moves = 0;
+    bool live_analysis = false;
+    //Side panel shows the position index statistics instead of the analysis
+    bool explorer = false;
+    int analysis_turn = -1;
+    thread analysis_thread;
+    atomic<bool> analysis_stop{false};
+    mutex analysis_mutex;
+    bool analysis_updated = false;
+    string side_panel[9];
+    TranspositionTable* tt = NULL;
+    //Network used by static_analyze; accumulators follow make/unmake once the first evaluation refreshes them
+    Nnue* network = NULL;
+    vector<NnueAccumulator> nnue_stack;
+    //Plies since the last capture or pawn move
+    int halfmove_clock = 0;
+    //The position on the squares: placement and its Zobrist keys follow every write to a square, side to move,
+    //castling, en passant and counters follow make/unmake from the last set_position or set_start_position
+    Position current_position;
+    uint64_t piece_key = 0;
+    //Keys of positions played before the first one on the board, oldest first
+    vector<uint64_t> history;
+
+    void nnue_update(Object* obj, int square, bool add)
+    {
+        if(obj->get_type() != Square)
+            network->update(nnue_stack.back(), obj->get_color(), obj->get_type(), square, add);
+    }
+    void track_square(int square, Object* old_obj, Object* new_obj)
+    {
+        if(old_obj->get_type() != Square)
+        {
+            current_position.pieces[old_obj->get_color()][old_obj->get_type()] &= ~(1ULL << square);
+            piece_key ^= zobrist.pieces[old_obj->get_color()][old_obj->get_type()][square];
+        }
+        if(new_obj->get_type() != Square)
+        {
+            current_position.pieces[new_obj->get_color()][new_obj->get_type()] |= 1ULL << square;
+            piece_key ^= zobrist.pieces[new_obj->get_color()][new_obj->get_type()][square];
+        }
+    }
+    //Castling rights, king flags, clock and key after the pieces or the side to move changed
+    void update_position_state()
+    {
+        current_position.castling = 0;
+        for(int i = 0; i < 4; i++)
+            if(has_castling_right((i < 2) ? WHITE : BLACK, (i % 2 == 0)))
+                current_position.castling |= 1 << i;
+        current_position.king_moved = ((white_king->get_links() != 0) ? 1 << WHITE : 0) | ((black_king->get_links() != 0) ? 1 << BLACK : 0);
+        current_position.castled = (white_castling ? 1 << WHITE : 0) | (black_castling ? 1 << BLACK : 0);
+        current_position.halfmove = min(halfmove_clock, 255);
+        current_position.key = hash((Color)current_position.side);
+    }
+
+    public:
+    Board()
+    {
+        board = new Object*[width * height];
+        for(int i = height - 1; i >= 0; i--)
+            for(int j = 0; j < width; j++)
+                if((i + j) % 2 == 1)
+                    board[i * width + j] = new class Square(j, i, WHITE);
+                else    
+                    board[i * width + j] = new class Square(j, i, BLACK);
+        memset(&current_position, 0, sizeof(current_position));
+        current_position.en_passant = -1;
+        current_position.fullmove = 1;
+        free_extra_index = 0;
+        white_castling = false;
+        black_castling = false;
+        AI_state = false;
+        if(nnue().is_loaded())
+            network = &nnue();
+    }
+    friend class AI;
+    friend class MateSolver;
+    friend class Bitbases;
+    int get_width() const { return width; }
+    int get_height() const { return height; }
+    void add(Object* obj)
+    {
+        track_square(obj->get_y() * width + obj->get_x(), board[obj->get_y() * width + obj->get_x()], obj);
+        delete board[obj->get_y() * width + obj->get_x()];
+        board[obj->get_y() * width + obj->get_x()] = obj;
+        if(obj->get_type() == King)
+        {
+            if(obj->get_color() == WHITE)
+                white_king = obj;
+            else    
+                black_king = obj;
+        }
+    }
+    void add_wd(Object* obj)
+    {
+        track_square(obj->get_y() * width + obj->get_x(), board[obj->get_y() * width + obj->get_x()], obj);
+        board[obj->get_y() * width + obj->get_x()] = obj;
+        if(obj->get_type() == King)
+        {
+            if(obj->get_color() == WHITE)
+                white_king = obj;
+            else    
+                black_king = obj;
+        }
+    }
+    Object* get(int x, int y)
+    {
+        if((x < 0) || (x >= width) || (y < 0) || (y >= height)) return NULL;
+        return board[y * width + x];
+    }
+    uint64_t hash(Color side)
+    {
+        uint64_t key = piece_key ^ (side == BLACK ? zobrist.side : 0);
+        for(int i = 0; i < 4; i++)
+            if(has_castling_right((i < 2) ? WHITE : BLACK, (i % 2 == 0)))
+                key ^= zobrist.castling[i];
+        return key;
+    }
+    bool has_castling_right(Color color, bool short_side)
+    {
+        int yy = (color == WHITE ? 0 : 7);
+        Object* king = this->get(4, yy);
+        Object* rook = this->get((short_side ? 7 : 0), yy);
+        return (king->get_type() == King) && (king->get_color() == color) && (king->get_links() == 0)
+            && (rook->get_type() == Rook) && (rook->get_color() == color) && (rook->get_links() == 0);
+    }
+    Position get_position(Color side);
+    void set_position(const Position& position);
+    bool set_fen(const string& fen, Color& side);
+    string get_fen(Color side);
+    //Bitboards indexed by [color][Obj]; returns the evaluation flags
+    int get_bitboards(uint64_t (&pieces)[2][6]) const
+    {
+        memcpy(pieces, current_position.pieces, sizeof(pieces));
+        int flags = 0;
+        if((white_king->get_links() != 0) && !white_castling) flags |= WHITE_KING_MOVED;
+        if((black_king->get_links() != 0) && !black_castling) flags |= BLACK_KING_MOVED;
+        return flags;
+    }
+    Nnue* get_network() const { return network; }
+    void set_network(Nnue* _network)
+    {
+        network = _network;
+        nnue_stack.clear();
+    }
+    //Centipawns from the incrementally updated accumulator
+    int nnue_evaluate()
+    {
+        if(nnue_stack.empty())
+        {
+            nnue_stack.reserve(2 * MAX_PLY);
+            nnue_stack.emplace_back();
+            network->refresh(board, nnue_stack.back());
+        }
+        return network->evaluate(nnue_stack.back());
+    }
+    //Compares the current accumulator with a full refresh and scores the refreshed one
+    bool nnue_matches_refresh(int& fresh_score)
+    {
+        NnueAccumulator fresh;
+        network->refresh(board, fresh);
+        fresh_score = network->evaluate(fresh);
+        return nnue_stack.empty() || (memcmp(&fresh, &nnue_stack.back(), sizeof(fresh)) == 0);
+    }
+    string info_line(int row)
+    {
+        string line = game_info[row];
+        lock_guard<mutex> lock(analysis_mutex);
+        if(side_panel[row] != "")
+        {
+            if((line.size() > 0) && (line.back() == '\n'))
+                line.insert(line.size() - 1, "\t\t" + side_panel[row]);
+            else
+                line += "\t\t" + side_panel[row];
+        }
+        return line;
+    }
+    void print_board(bool clear_screen = true)
+    {
+        if(board_flipped)
+        {
+            print_flipped_board(clear_screen);
+            return;
+        }
+        if(clear_screen)
+            system("clear");
+        for(int i = height - 1; i >= 0; i--)
+        {
+            cout << i + 1 << " ";
+            for(int j = 0; j < width; j++)
+            {
+                for(Highlight* k : hl_v)
+                    if(k -> get_x() == j && k -> get_y() == i)
+                        cout << k -> get_cmd();
+                cout << board[i * width + j]->get_img() << " ";
+                cout << "\x1b[0m";
+            }
+            cout << "\t" <<  info_line(height - i - 1);
+        }
+        cout << "  ";
+        for(int k = 0; k < width; k++)
+            cout << high_alphabet[k] << " ";
+        cout << "\t" <<  info_line(8);
+    }
+    void print_flipped_board(bool clear_screen = true)
+    {
+        if(clear_screen)
+            system("clear");
+        for(int i = 0; i < height; i++)
+        {
+            cout << i + 1 << " ";
+            for(int j = width - 1; j >= 0; j--)
+            {
+                for(Highlight* k : hl_v)
+                    if(k -> get_x() == j && k -> get_y() == i)
+                        cout << k -> get_cmd();
+                cout << board[i * width + j]->get_img() << " ";
+                cout << "\x1b[0m";
+            }
+            cout << "\t" <<  info_line(i);
+        }
+        cout << "  ";
+        for(int k = 0; k < width; k++)
+            cout << high_alphabet[k] << " ";
+        cout << "\t" <<  info_line(8);
+    }
+    void add_highliter(Highlight* hl) { hl_v.push_back(hl); }
+    void pop_last_highliter() { hl_v.pop_back(); }
+    Object* get_hit_field() const { return hit_field; }
+    void set_hit_field(Object* _hit_field) { hit_field = _hit_field; }
+    int get_turn() const {return turn; }
+    int  get_inside_counter() const { return inside_counter; }
+    void set_inside_counter(int _inside_counter) { inside_counter = _inside_counter; }
+    void dec_inside_counter() { inside_counter--; }
+    void set_cur_state(State _cur_state) { cur_state = _cur_state; }
+    void clear()
+    {
+        Object* obj;
+        nnue_stack.clear();
+        halfmove_clock = 0;
+        current_position.side = WHITE;
+        current_position.en_passant = -1;
+        current_position.fullmove = 1;
+        history.clear();
+        for(int y = 0; y < height; y++)
+        {
+            for(int x = 0; x < width; x++)
+            {
+                obj = this->get(x, y);
+                if(obj->get_type() != Square)
+                    this->add(new class Square(x, y, ((x + y) % 2 == 1) ? WHITE : BLACK));
+                
+            }
+        }
+    }
+    void set_start_position();
+    int get_halfmove_clock() const { return halfmove_clock; }
+    void set_history(const vector<uint64_t>& _history) { history = _history; }
+    void game_history(vector<uint64_t>& keys);
+    string rule_draw(Color side);
+    string cached_analysis(Color side);
+    bool get_board_flipped() { return board_flipped; }
+    Object* is_hitted(Object* obj, Color color = UNCOLORED, Obj type = Unknown, int x_hint = -1, int y_hint = -1)
+    {
+        int threats_count = 0;
+        Object* threat = NULL; 
+        for(int y = 0; y < height; y++)
+        {
+            for(int x = 0; x < width; x++)
+            {
+                if((color != UNCOLORED) && (this->get(x, y)->get_color() != color)) continue;
+                if((type != Unknown) && (this->get(x, y)->get_type() != type)) continue;
+                if((x_hint != -1) && (x != x_hint)) continue;
+                if((y_hint != -1) && (y != y_hint)) continue;
+                if(this->get(x, y)->is_legal(obj, this))
+                {
+                    threat = this->get(x, y);
+                    threats_count++;
+                }
+            }
+        }
+        if(threats_count > 1) double_check = true;
+        return threat;
+    }
+    Object* check_king_dependency(Object* figure, Object* next_stop)
+    {
+        Object* king = (figure->get_color() == WHITE ? this->get_white_king() : this->get_black_king());
+        int x = figure->get_x();
+        int y = figure->get_y();
+        int new_x = next_stop->get_x();
+        int new_y = next_stop->get_y();
+
+        Object* temp = this->get(new_x, new_y);
+        figure->set_x(new_x);
+        figure->set_y(new_y);
+        this->add_wd(figure);
+        this->add_wd(new class Square(x, y, (x + y) % 2 == 1 ? WHITE : BLACK)); 
+
+        Object* is_hitted;
+        if(king->get_color() == WHITE)
+            is_hitted = find_attacker<BLACK>(this, king->get_x(), king->get_y());
+        else
+            is_hitted = find_attacker<WHITE>(this, king->get_x(), king->get_y());
+
+        figure->set_x(x);
+        figure->set_y(y);
+        this->add(figure);
+        this->add_wd(temp);
+
+        return is_hitted;
+    }
+    bool check_king_overlap(Object* king, Object* checker)
+    {
+        int x = checker->get_x();
+        int y = checker->get_y();
+        int new_x = king->get_x();
+        int new_y = king->get_y();
+        Color color = king->get_color();
+        Object* possible_blocker;
+        if((checker->get_type() == Knight) || (checker->get_type() == Pawn))
+        {
+            possible_blocker = this->is_hitted(checker, color);
+            if(
+                possible_blocker != NULL
+                && (this->check_king_dependency(possible_blocker, this->get(x, y)) == NULL)
+            )
+                return true;
+        }
+        if((checker->get_type() == Bishop) || (checker->get_type() == Queen))
+        {
+            if(abs(x - new_x) == abs(y - new_y))
+            {
+                int x_i = (x - new_x < 0) ? 1 : -1;
+                int y_i = (y - new_y < 0) ? 1 : -1;
+                int rez = abs(x - new_x) - 1;
+                for(int i = 0; i <= rez; i++)
+                {
+                    possible_blocker = this->is_hitted(this->get(x, y), color);
+                    if(
+                        possible_blocker != NULL
+                        && (this->check_king_dependency(possible_blocker, this->get(x, y)) == NULL)
+                    )
+                        return true;
+                    x += x_i;
+                    y += y_i;
+                }
+            }
+        }
+        if((checker->get_type() == Rook) || (checker->get_type() == Queen))
+        {
+            if(x == new_x)
+            {
+                for(int i = min(y, new_y); i <= max(y, new_y); i++)
+                {
+                    possible_blocker = this->is_hitted(this->get(x, i), color);
+                    if(
+                        possible_blocker != NULL
+                        && (this->check_king_dependency(possible_blocker, this->get(x, i)) == NULL)
+                    )
+                        return true;
+                }
+            }
+            if(y == new_y)
+            {
+                for(int i = min(x, new_x); i <= max(x, new_x); i++)
+                {
+                    possible_blocker = this->is_hitted(this->get(i, y), color);
+                    if(
+                        possible_blocker != NULL
+                        && (this->check_king_dependency(possible_blocker, this->get(i, y)) == NULL)
+                    )
+                        return true;
+                }
+            }
+        }
+        return false;
+    }
+    Object* check_chess_check(Color color)
+    {
+        return this->is_hitted((color == WHITE) ? this->get_white_king() : this->get_black_king());
+    }
+    bool check_mate(Color color)
+    {
+        Object* checker = check_chess_check(color);
+        if(checker == NULL) return false;
+        Object* king = ((color == WHITE) ? this->get_white_king() : this->get_black_king());
+        int x = king->get_x();
+        int y = king->get_y();
+        if(double_check == false)
+        {
+            if(this->check_king_overlap(king, checker))
+                return false;
+        }
+        double_check = false;
+        if(
+            king->is_legal(this->get(x, y+1), this)
+            || king->is_legal(this->get(x+1, y+1), this)
+            || king->is_legal(this->get(x+1, y), this)
+            || king->is_legal(this->get(x+1, y-1), this)
+            || king->is_legal(this->get(x, y-1), this)
+            || king->is_legal(this->get(x-1, y-1), this)
+            || king->is_legal(this->get(x-1, y), this)
+            || king->is_legal(this->get(x-1, y+1), this)
+        )   
+            return false;
+
+        return true;
+    }
+    //Appends a legal move after the current one, dropping the moves after it; false if the move is illegal
+    bool play_move(Object* obj_from, Object* obj_to)
+    {
+        if(!obj_from->is_legal(obj_to, this) || (this->check_king_dependency(obj_from, obj_to) != NULL))
+        {
+            cur_state = Nothing;
+            return false;
+        }
+        string str = "";
+        if((cur_state != ShortCastling) && (cur_state != LongCastling))
+        {
+            if(obj_from->get_type() == King)
+                str += "K";
+            else if(obj_from->get_type() == Queen)
+                str += "Q";
+            else if(obj_from->get_type() == Knight)
+                str += "N";
+            else if(obj_from->get_type() == Bishop)
+                str += "B";
+            else if(obj_from->get_type() == Rook)
+                str += "R";
+            str += low_alphabet[obj_to->get_x()];
+            str += ('1' + obj_to->get_y());
+        }
+        int high_border = turns.size() - 1;
+        int low_border = turn;
+        for(int i = high_border; i > low_border; i--)
+        {
+            if(turns.at(i)->get_extra_index() != -1)
+            {
+                free_extra_index--;
+                delete extra_turns.at(free_extra_index)->get_replace();
+                delete extra_turns.at(free_extra_index);
+                extra_turns.pop_back();
+            }
+            delete turns.at(i)->get_replace();
+            delete turns.at(i);
+            turns.pop_back();
+            notation_turns.pop_back();
+        }
+        turns.push_back(new Turn(obj_from, obj_to));
+        turn++;
+        if(cur_state != Nothing)
+        {
+            if(cur_state == EnPassant)
+            {
+                extra_turns.push_back(
+                    new Turn(
+                        this->get(obj_to->get_x(), (obj_from->get_y())),
+                        this->get(obj_to->get_x(), (obj_from->get_y()))
+                    )
+                );
+            }
+            else
+            {
+                int yy = ((obj_from->get_color() == WHITE) ? 0 : 7);
+                extra_turns.push_back(
+                    new Turn(
+                        this->get(((cur_state == ShortCastling) ? 7 : 0), yy),
+                        this->get(((cur_state == ShortCastling) ? 5 : 3), yy)
+                    )
+                );
+                str += ((cur_state == ShortCastling) ? "O-O" : "O-O-O");
+            }
+            turns.at(turn)->set_extra_index(free_extra_index++);
+            cur_state = Nothing;
+        }
+        make_move_forward(turns.at(turn));
+        notation_turns.push_back(str);
+        return true;
+    }
+    bool is_in_check(Color color)
+    {
+        bool in_check = (check_chess_check(color) != NULL);
+        double_check = false;
+        return in_check;
+    }
+    Object* get_white_king() { return white_king; }
+    Object* get_black_king() { return black_king; }
+    void create_notation_turns_table()
+    {
+        int first_c;
+        int new_x, new_y;
+        Object* obj_from;
+        Object* obj_to;
+        Color color;
+        Obj type;
+        int pos;
+        int size;
+        int x_hint;
+        int y_hint;
+        bool extra = false;
+        for(int i = 0; i < notation_turns.size(); i++)
+        {
+            color = (i % 2 == 0 ? WHITE : BLACK);
+            if((notation_turns[i] == "O-O") || (notation_turns[i] == "O-O-O"))
+            {
+                int yy = (color == WHITE ? 0 : 7);
+                int xx = (notation_turns[i] == "O-O" ? 6 : 2);
+                obj_from = this->get(4, yy);
+                obj_to = this->get(xx, yy);
+                if((obj_from->get_type() == King) && (obj_from->get_color() == color))
+                {
+                    if(!obj_from->is_legal(obj_to, this))
+                        obj_from = NULL;
+                    else
+                    {
+                        extra = true;
+                        extra_turns.push_back(
+                            new Turn(
+                                this->get((notation_turns[i] == "O-O" ? 7 : 0), yy),
+                                this->get((notation_turns[i] == "O-O" ? 5 : 3), yy)
+                            )
+                        );
+                    }
+                }
+                else obj_from = NULL;
+            }
+            else
+            {
+                x_hint=y_hint=-1;
+                size = notation_turns[i].size();
+                pos = 0;
+                first_c = notation_turns[i].at(pos++);
+                if(first_c == 'R')
+                    type = Rook;
+                else if(first_c == 'N')
+                    type = Knight;
+                else if(first_c == 'B')
+                    type = Bishop;
+                else if(first_c == 'Q')
+                    type = Queen;
+                else if(first_c == 'K')
+                    type = King;
+                else
+                {
+                    type = Pawn;
+                    pos = 0;
+                }
+                if(size >= 4)
+                {
+                    if(isdigit(notation_turns[i].at(pos)))
+                        y_hint = notation_turns[i].at(pos++) - '0' - 1;
+                    else
+                        x_hint = is_in(notation_turns[i].at(pos++), low_alphabet);
+                }
+                if(notation_turns[i].at(pos) == 'x') pos++;
+                new_x = is_in(notation_turns[i].at(pos++), low_alphabet);
+                new_y = notation_turns[i].at(pos++) - '0' - 1;
+                obj_to = this->get(new_x, new_y);
+                obj_from = this->is_hitted(obj_to, color, type, x_hint, y_hint);
+            }
+            if(obj_from == NULL)
+            {
+                cout << "\nIncorrect Notation!" << "\n";
+                notation_turns.resize(i);
+                break;
+            }
+            turns.push_back(new Turn(obj_from, obj_to));
+            turn++;
+            if(extra || (cur_state == EnPassant))
+            {
+                if(cur_state == EnPassant)
+                {
+                    extra_turns.push_back(
+                        new Turn(
+                            this->get(obj_to->get_x(), (obj_from->get_y())),
+                            this->get(obj_to->get_x(), (obj_from->get_y()))
+                        )
+                    );
+                    cur_state = Nothing;
+                }
+                turns.at(turn)->set_extra_index(free_extra_index++);
+                extra = false;
+            }
+            cur_state = Nothing;
+            make_move_forward(turns.at(turn));
+        }
+        while(turn >= 0)
+        {    
+            make_move_backward(turns.at(turn));
+            turn--; 
+        }
+    }
+    void load_notation(const vector<string>& notation)
+    {
+        notation_turns = notation;
+        create_notation_turns_table();
+    }
+    //Packed moves are played as entered on the board, so the notation is the short one play_move writes
+    void load_moves(const vector<uint16_t>& moves)
+    {
+        for(auto move : moves)
+        {
+            int from = move & 63, to = (move >> 6) & 63;
+            if(!play_move(this->get(from % 8, from / 8), this->get(to % 8, to / 8)))
+            {
+                cout << "\nIncorrect move!" << "\n";
+                break;
+            }
+        }
+        while(turn >= 0)
+        {
+            make_move_backward(turns.at(turn));
+            turn--;
+        }
+    }
+    void load_game(const GameRecord& game)
+    {
+        if(game.moves.size() != 0)
+            load_moves(game.moves);
+        else
+            load_notation(game.notation);
+    }
+    GameRecord get_game_record();
+    void show_explorer();
+    //All moves of the game from | to << 6, whatever move is displayed
+    void get_packed_moves(vector<uint16_t>& moves)
+    {
+        int current = turn;
+        while(turn >= 0)
+        {
+            make_move_backward(turns.at(turn));
+            turn--;
+        }
+        moves.clear();
+        for(size_t i = 0; i < turns.size(); i++)
+        {
+            moves.push_back(turns[i]->get_from_square() | (turns[i]->get_to_square() << 6));
+            step_forward();
+        }
+        while(turn > current)
+        {
+            make_move_backward(turns.at(turn));
+            turn--;
+        }
+    }
+    int get_turns_count() const { return turns.size(); }
+    Turn* get_turn_at(int index) { return turns.at(index); }
+    void step_forward()
+    {
+        turn++;
+        make_move_forward(turns.at(turn));
+    }
+    void make_move_forward(Turn* cur_turn, bool extra = false)
+    {
+        Object* obj_from = cur_turn->get_from();
+        Object* obj_to = cur_turn->get_to();
+        int x = obj_from->get_x();
+        int y = obj_from->get_y();
+        int new_x = obj_to->get_x();
+        int new_y = obj_to->get_y();
+        if(!nnue_stack.empty())
+        {
+            if(!extra) nnue_stack.push_back(nnue_stack.back());
+            nnue_update(obj_from, y * 8 + x, false);
+            nnue_update(obj_to, new_y * 8 + new_x, false);
+            nnue_update(obj_from, new_y * 8 + new_x, true);
+            nnue_update(cur_turn->get_replace(), y * 8 + x, true);
+        }
+        if(!extra)
+        {
+            cur_turn->set_halfmove_before(halfmove_clock);
+            if((obj_from->get_type() == Pawn) || (obj_to->get_type() != Square))
+                halfmove_clock = 0;
+            else
+                halfmove_clock++;
+        }
+        obj_from->set_x(new_x);
+        obj_from->set_y(new_y);
+        obj_to->set_x(x);
+        obj_to->set_y(y);
+        this->add_wd(obj_from);
+        this->add_wd(cur_turn->get_replace());
+        obj_from->inc_links();
+        if(cur_turn->get_extra_index() != -1)
+        {
+            Turn* extra_turn = extra_turns.at(cur_turn->get_extra_index());
+            make_move_forward(extra_turn, true);
+            //En passant removes the captured pawn with an extra turn too; only the rook's one is castling
+            if(extra_turn->get_from()->get_type() == Rook)
+            {
+                if(obj_from->get_color() == WHITE)
+                    white_castling = true;
+                else
+                    black_castling = true;
+            }
+        }
+        if(!extra)
+        {
+            cur_turn->set_en_passant_before(current_position.en_passant);
+            current_position.en_passant = -1;
+            if((obj_from->get_type() == Pawn) && (abs(new_y - y) == 2))
+                current_position.en_passant = ((y + new_y) / 2) * 8 + x;
+            if(obj_from->get_color() == BLACK)
+                current_position.fullmove++;
+            current_position.side = reverse_color(obj_from->get_color());
+            update_position_state();
+        }
+    }
+    void make_move_backward(Turn* cur_turn, bool extra = false)
+    {
+        if(!extra && !nnue_stack.empty())
+            nnue_stack.pop_back();
+        if(!extra)
+            halfmove_clock = cur_turn->get_halfmove_before();
+        Object* obj_from = cur_turn->get_from();
+        Object* obj_to = cur_turn->get_to();
+        int x = obj_from->get_x();
+        int y = obj_from->get_y();
+        int new_x = obj_to->get_x();
+        int new_y = obj_to->get_y();
+        obj_from->set_x(new_x);
+        obj_from->set_y(new_y);
+        obj_to->set_x(x);
+        obj_to->set_y(y);
+        this->add_wd(obj_from);
+        this->add_wd(obj_to);
+        obj_from->dec_links();
+        if(cur_turn->get_extra_index() != -1)
+        {
+            Turn* extra_turn = extra_turns.at(cur_turn->get_extra_index());
+            make_move_backward(extra_turn, true);
+            if(extra_turn->get_from()->get_type() == Rook)
+            {
+                if(obj_from->get_color() == WHITE)
+                    white_castling = false;
+                else
+                    black_castling = false;
+            }
+        }
+        if(!extra)
+        {
+            current_position.en_passant = cur_turn->get_en_passant_before();
+            if(obj_from->get_color() == BLACK)
+                current_position.fullmove--;
+            current_position.side = obj_from->get_color();
+            update_position_state();
+        }
+    }
+    void set_menu()
+    {
+        game_info[0] = "Domz0t's chess\n";
+        game_info[1] = "\n";
+        game_info[2] = "\n";
+        game_info[3] = "Press \"c\" to play classic chess\n";
+        game_info[4] = "Press \"l\" to load game\n";
+        game_info[5] = "Press \"f\" to flip the board\n";
+        game_info[6] = "Press \"v\" in loaded game for live analysis\n";
+        game_info[7] = "Press \"x\" in loaded game for the opening explorer\n";
+        game_info[8] = "Press \"e\" to exit\n";
+    }
+    void set_classic_chess_menu()
+    {
+        game_info[0] = "Domz0t's chess\n";
+        game_info[1] = "\n";
+        game_info[2] = "\n";
+        game_info[3] = "Classic Chess\n";
+        game_info[4] = "\n";
+        game_info[5] = "\n";
+        game_info[6] = "Press \"p\" to save the game\n";
+        game_info[7] = "Press \"b\" to back menu\n";
+        game_info[8] = "Press \"e\" to exit\n";
+    }
+    void activate_start_loading()
+    {
+        Highlight hl(0, 0, (char*)"\x1b[47m");
+        Highlight hl_1(0, 0, (char*)"\x1b[42m");
+        Highlight hl_2(0, 0, (char*)"\x1b[43m");
+        Highlight hl_3(7, 0, (char*)"\x1b[44m");
+        Highlight hl_4(0, 7, (char*)"\x1b[45m");
+        Highlight hl_5(0, 0, (char*)"\x1b[46m");
+        Highlight hl_6(7, 7, (char*)"\x1b[41m");
+        Highlight hl_7(0, 0, (char*)"\x1b[40m");
+        this->add_highliter(&hl);
+        this->add_highliter(&hl_1);
+        this->add_highliter(&hl_2);
+        this->add_highliter(&hl_3);
+        this->add_highliter(&hl_4);
+        this->add_highliter(&hl_5);
+        this->add_highliter(&hl_6);
+        this->add_highliter(&hl_7);
+        for(int i = 0; i < height; i++)
+        {
+            hl.set_x(i);
+            hl.set_y(i);
+            hl_1.set_x(height-i-1);
+            hl_1.set_y(i);
+            hl_2.set_y(i);
+            hl_3.set_y(i);
+            hl_4.set_x(i);
+            hl_5.set_x(height-i-1);
+            hl_6.set_x(height-i-1);
+            hl_7.set_x(i);
+            this->print_board();
+            usleep(100000);
+        }
+        hl.set_y(0);
+        hl_1.set_y(1);
+        hl_2.set_y(2);
+        hl_3.set_y(3);
+        hl_4.set_y(4);
+        hl_5.set_y(5);
+        hl_6.set_y(6);
+        hl_7.set_y(7);
+        for(int i = 0; i < height; i++)
+        {
+            hl.set_x(i);
+            hl_1.set_x(i);
+            hl_2.set_x(i);
+            hl_3.set_x(i);
+            hl_4.set_x(i);
+            hl_5.set_x(i);
+            hl_6.set_x(i);
+            hl_7.set_x(i);
+            this->print_board();
+            usleep(50000);
+        }
+        this->pop_last_highliter();
+        this->pop_last_highliter();
+        this->pop_last_highliter();
+        this->pop_last_highliter();
+        this->pop_last_highliter();
+        this->pop_last_highliter();
+        this->pop_last_highliter();
+        this->pop_last_highliter();
+    }
+    void clear_game_info()
+    {
+        while(turn >= 0)
+        {    
+            make_move_backward(turns.at(turn));
+            turn--; 
+        }
+        for(auto i : turns)
+        {
+            delete i->get_replace();
+            delete i;
+        }
+        for(auto i : extra_turns)
+        {
+            delete i->get_replace();
+            delete i;
+        }
+        turns.clear();
+        extra_turns.clear();
+        notation_turns.clear();
+        hl_v.clear();
+        free_extra_index = 0;
+        cur_state = Nothing;
+        white_castling = false;
+        black_castling = false;
+    }
+    void start_live_analysis()
+    {
+        stop_live_analysis();
+        if(tt == NULL)
+            tt = new TranspositionTable();
+        Color color = (((turn + 1) % 2 == 0) ? WHITE : BLACK);
+        //The thread searches its own board rebuilt from a copy, the UI keeps this one
+        Position position = get_position(color);
+        vector<uint64_t> position_history;
+        game_history(position_history);
+        Nnue* position_network = network;
+        analysis_turn = turn;
+        {
+            lock_guard<mutex> lock(analysis_mutex);
+            for(auto& line : side_panel)
+                line = "";
+            side_panel[0] = "Live analysis...";
+            side_panel[1] = cached_analysis(color);
+            analysis_updated = true;
+        }
+        analysis_stop = false;
+        analysis_thread = thread([this, position, position_history, position_network, color]()
+        {
+            Board board;
+            board.set_position(position);
+            board.set_history(position_history);
+            board.set_network(position_network);
+            AI worker;
+            PerfCounters counters;
+            worker.set_tt(tt);
+            worker.set_cache(&analysis_cache());
+            worker.set_stop(&analysis_stop);
+            worker.set_perf(&counters);
+            worker.search(&board, color, MAX_PLY - 1, [this](const SearchInfo& info)
+            {
+                lock_guard<mutex> lock(analysis_mutex);
+                side_panel[0] = "Depth " + to_string(info.depth) + "  " + score_to_string(info.score);
+                side_panel[1] = "Nodes " + to_string(info.nodes) + "  " + to_string(info.time) + " ms";
+                side_panel[2] = "PV " + info.pv;
+                side_panel[3] = "Pawn hash " + to_string(100 * info.pawn_hits / max(info.pawn_probes, 1L))
+                    + "%  Eval cache " + to_string(100 * info.eval_hits / max(info.eval_probes, 1L)) + "%";
+                vector<string> lines = search_stats_lines(info);
+                for(size_t i = 0; (i < lines.size()) && (i + 4 < sizeof(side_panel) / sizeof(side_panel[0])); i++)
+                    side_panel[i + 4] = lines[i];
+                analysis_updated = true;
+            });
+        });
+    }
+    void stop_live_analysis()
+    {
+        if(analysis_thread.joinable())
+        {
+            analysis_stop = true;
+            analysis_thread.join();
+        }
+    }
+    void close_live_analysis()
+    {
+        stop_live_analysis();
+        live_analysis = false;
+        lock_guard<mutex> lock(analysis_mutex);
+        for(auto& line : side_panel)
+            line = "";
+    }
+    void print_game()
+    {
+        this->print_board(); 
+        for(int i = 0; i < turns.size(); i++)
+        {
+            if((i) % 12 == 0) cout << "\n";
+            if(i % 2 == 0)
+                cout << i/2 + 1 << ".";
+            if(i == (turn))
+                cout << "\x1b[47m";
+            cout << notation_turns.at(i) << " ";
+            cout << "\x1b[0m";
+        }
+        cout << "\n";
+        if(this->check_mate(WHITE)) cout << "White king is mated!" << "\n";
+        else if(this->check_chess_check(WHITE)) cout << "White king is checked!" << "\n";
+        else if(this->check_mate(BLACK)) cout << "Black king is mated!" << "\n";
+        else if(this->check_chess_check(BLACK)) cout << "Black king is checked!" << "\n";
+        string draw = this->rule_draw(((turn + 1) % 2 == 0) ? WHITE : BLACK);
+        if(!draw.empty()) cout << "Draw by " << draw << "!" << "\n";
+        string cached = (regime == Menu) ? "" : this->cached_analysis(((turn + 1) % 2 == 0) ? WHITE : BLACK);
+        if(!cached.empty()) cout << cached << "\n";
+    }
+    void start()
+    {
+        regime = Menu;
+        cur_state = Nothing;
+        int temp;
+        int x = 4, y = 1;
+        int temp_x, temp_y;
+        set_input_mode();
+
+        set_menu();
+        activate_start_loading();
+
+        Highlight hl1(-1, -1, (char*)"\x1b[47m");
+        Highlight hl2(-1, -1, (char*)"\x1b[42m");
+
+        this->print_board(); 
+        cout << "\n";
+
+        bool enter_firstly_pressed = false;
+        Object* obj_from;
+        Object* obj_to;
+
+        while(true)
+        {
+            if(live_analysis && !wait_for_input(20))
+            {
+                bool updated;
+                {
+                    lock_guard<mutex> lock(analysis_mutex);
+                    updated = analysis_updated;
+                    analysis_updated = false;
+                }
+                if(updated)
+                    print_game();
+                continue;
+            }
+            while(-1 == read(STDIN_FILENO, &temp, 1));
+            if((temp == 'w') && (regime == Classic))
+                if(board_flipped)
+                    y--;
+                else
+                    y++;
+            else if((temp == 's') && (regime == Classic))
+                if(board_flipped)
+                    y++;
+                else
+                    y--;
+            else if((temp == 'd') && (regime == Classic))
+                if(board_flipped)
+                    x--;
+                else
+                    x++;
+            else if((temp == 'a') && (regime == Classic))
+                if(board_flipped)
+                    x++;
+                else
+                    x--;
+            else if(temp == 'f')
+                board_flipped = !board_flipped;
+            else if(temp == 'b')
+            {
+                if(regime != Menu)
+                {
+                    close_live_analysis();
+                    explorer = false;
+                    clear_game_info();
+                    regime = Menu;
+                    set_menu();
+                }
+            }
+            else if(temp == 'e')
+            {
+                return;
+            }
+            else if(temp == 65)
+            {
+                if(turns.size() != 0)
+                {
+                    int size = turns.size() - 1;
+                    while(turn < size)
+                    {
+                        turn++;
+                        make_move_forward(turns.at(turn));
+                    }
+                    hl1.set_x(turns.at(turn)->get_from()->get_x());
+                    hl1.set_y(turns.at(turn)->get_from()->get_y());
+                    hl2.set_x(turns.at(turn)->get_to()->get_x());
+                    hl2.set_y(turns.at(turn)->get_to()->get_y());
+                }
+            }
+            else if(temp == 66)
+            {
+                while(turn > 0)
+                {
+                    make_move_backward(turns.at(turn));
+                    turn--;
+                }
+                if(turn != -1)
+                {
+                    hl1.set_x(turns.at(turn)->get_from()->get_x());
+                    hl1.set_y(turns.at(turn)->get_from()->get_y());
+                    hl2.set_x(turns.at(turn)->get_to()->get_x());
+                    hl2.set_y(turns.at(turn)->get_to()->get_y());
+                }
+            }
+            else if(temp == 67)
+            {
+                if(turns.size() != 0)
+                {
+                    turn++;
+                    if(turn > notation_turns.size()-1)
+                        turn = range(turn, -1, notation_turns.size()-1);
+                    else
+                    {
+                        make_move_forward(turns.at(turn));
+                        hl1.set_x(turns.at(turn)->get_from()->get_x());
+                        hl1.set_y(turns.at(turn)->get_from()->get_y());
+                        hl2.set_x(turns.at(turn)->get_to()->get_x());
+                        hl2.set_y(turns.at(turn)->get_to()->get_y());
+                    }
+                }
+            }
+            else if(temp == 68)
+            {
+                if(turn < 0)
+                    turn = range(turn, -1, notation_turns.size()-1);
+                else
+                {
+                    make_move_backward(turns.at(turn));
+                    hl1.set_x(turns.at(turn)->get_from()->get_x());
+                    hl1.set_y(turns.at(turn)->get_from()->get_y());
+                    hl2.set_x(turns.at(turn)->get_to()->get_x());
+                    hl2.set_y(turns.at(turn)->get_to()->get_y());
+                    turn--;
+                }
+            }
+            else if((temp == 'v') && (regime == View))
+            {
+                if(live_analysis)
+                    close_live_analysis();
+                else
+                {
+                    explorer = false;
+                    live_analysis = true;
+                    start_live_analysis();
+                }
+            }
+            else if((temp == 'x') && (regime == View))
+            {
+                close_live_analysis();
+                explorer = !explorer;
+            }
+            else if(temp == 'l')
+            {
+                close_live_analysis();
+                reset_input_mode();
+                string str;
+                cout << "Enter path to game: " << "\n";
+                cin >> str;
+                //Collections open at their first game, the rest isn't read
+                vector<GameRecord> games;
+                if(read_game_collection(str, games, 1))
+                {
+                    GameRecord game = games.empty() ? GameRecord() : games.front();
+                    clear_game_info();
+                    for(int pos = 0; pos < 10; pos++)
+                    {
+                        game_info[pos] = game.info[pos];
+                        if(pos == 8)
+                            game_info[pos] += "\t\tPress \"b\" to back menu";
+                        game_info[pos] += "\n";
+                    }
+                    if(games.empty())
+                    {
+                        cout << "\nIncorrect File!" << "\n";
+                        skip = true;
+                    }
+                    else
+                    {
+                        load_game(game);
+                        this->add_highliter(&hl1);
+                        this->add_highliter(&hl2);
+                        regime = View;
+                    }
+                }
+                else
+                {
+                    skip = true;
+                    cout << "\nFile doesn't exist!" << "\n";
+                }  
+                cin.clear(); 
+                cin.ignore(numeric_limits<streamsize>::max(), '\n');   
+                set_input_mode();
+            }
+            else if((temp == 10) && (regime == Classic))
+            {
+                if(enter_firstly_pressed == false)
+                {
+                    if((this->get(x, y)->get_color() == (((turn + 1) % 2 == 0) ? WHITE : BLACK)) && (this->get(x, y)->get_type() != Obj::Square))
+                    {
+                        hl2.set_x(x);
+                        hl2.set_y(y);
+                        this->add_highliter(&hl2);
+                        enter_firstly_pressed = true;
+                        temp_x = x;
+                        temp_y = y;
+                    }
+                }
+                else
+                {
+                    bool tumbler = false;
+                    Turn* answer;
+
+                    obj_from = this->get(temp_x, temp_y);
+                    obj_to = this->get(x, y);
+                    l1:
+                    // if(tumbler == false)
+                    // {
+                    //     obj_from = answer->get_from();
+                    //     obj_to = answer->get_to();
+                    // }
+                    if(play_move(obj_from, obj_to))
+                    {
+                        if(tumbler)
+                        {
+                            ai.analyze(this, (((turn + 1) % 2 == 0) ? WHITE : BLACK));
+                            tumbler = false;
+                            goto l1;
+                        }
+
+                    }
+                    else
+                    {
+                        x = temp_x;
+                        y = temp_y;
+                    }
+                    this->pop_last_highliter();
+                    enter_firstly_pressed = false;
+                }
+            }
+            else if(temp == 'c')
+            {
+                close_live_analysis();
+                clear_game_info();
+                set_classic_chess_menu();
+                x = 4;
+                y = 1;
+                this->add_highliter(&hl1);
+                enter_firstly_pressed = false;
+                regime = Classic;
+            }
+            else if((temp == 'p') && (regime == Classic))
+            {
+                reset_input_mode();
+                string str;
+                cout << "Enter path to save game: " << "\n";
+                cin >> str;
+                if(!has_extension(str, ".cgb"))
+                    str += ".cgb";
+                if(append_packed_game(str, get_game_record()))
+                    cout << "\nSaved to " << str << "\n";
+                else
+                    cout << "\nCan't write " << str << "\n";
+                skip = true;
+                cin.clear(); 
+                cin.ignore(numeric_limits<streamsize>::max(), '\n');   
+                set_input_mode();
+            }
+            else if(temp == 'i')
+                AI_state = true;
+            else if((temp == 'm') && (regime != Menu))
+            {
+                reset_input_mode();
+                cout << "Mate in: " << "\n";
+                cin >> mate_moves;
+                if(!cin)
+                    mate_moves = 0;
+                cin.clear(); 
+                cin.ignore(numeric_limits<streamsize>::max(), '\n');   
+                set_input_mode();
+            }
+            if(regime == Classic)
+            {   
+                x = range(x, 0, 7);
+                y = range(y, 0, 7);
+                hl1.set_x(x);
+                hl1.set_y(y);
+            }
+
+            if(skip)
+            {
+                skip = false;
+                continue;
+            }
+
+            if(live_analysis && (turn != analysis_turn))
+                start_live_analysis();
+            if(explorer)
+                show_explorer();
+            print_game();
+            if(AI_state)
+            {
+                ai.analyze(this, (((turn + 1) % 2 == 0) ? WHITE : BLACK));
+                AI_state = false;
+            }
+            if(mate_moves > 0)
+            {
+                MateSolver solver;
+                int mate_in;
+                string line;
+                cout << "Searching mate..." << endl;
+                MateResult result = solver.solve(this, (((turn + 1) % 2 == 0) ? WHITE : BLACK), mate_moves, mate_in, line);
+                cout << "\033[F";
+                if(result == MateFound)
+                    cout << "Mate in " << mate_in << ": " << line << "\n";
+                else if(result == NoMate)
+                    cout << "No mate in " << mate_moves << "\n";
+                else
+                    cout << "Mate search stopped after " << solver.get_nodes() << " nodes" << "\n";
+                mate_moves = 0;
+            }
+        }
+    }
+    ~Board()
+    {
+        stop_live_analysis();
+        delete tt;
+        clear_game_info();
+        for(int i = 0; i < height* width; i++)
+            delete board[i];
+        delete [] board;
+    }
+};
+
+//Move rules resolved at compile time: Rules<C, T>::attacks is pure geometry with the path check,
+//Rules<C, T>::is_legal is the full rule for a piece of color C and type T on this board.
+template<Color C, Obj T> struct Rules;
+
+inline bool path_is_free(Board* board, int x, int y, int new_x, int new_y)
+{
+    int x_i = (new_x > x) - (new_x < x);
+    int y_i = (new_y > y) - (new_y < y);
+    x += x_i;
+    y += y_i;
+    while((x != new_x) || (y != new_y))
+    {
+        if(board->get(x, y)->get_type() != Square)
+            return false;
+        x += x_i;
+        y += y_i;
+    }
+    return true;
+}
+
+inline bool is_own_or_same(Object* piece, Object* obj)
+{
+    if((piece->get_x() == obj->get_x()) && (piece->get_y() == obj->get_y())) return true;
+    return (obj->get_type() != Square) && (obj->get_color() == piece->get_color());
+}
+
+template<Color C> struct Rules<C, Knight>
+{
+    static bool attacks(Board* board, int x, int y, int new_x, int new_y)
+    {
+        return (board_tables.knight_attacks[y * 8 + x] >> (new_y * 8 + new_x)) & 1;
+    }
+    static bool is_legal(Object* piece, Object* obj, Board* board)
+    {
+        if(is_own_or_same(piece, obj)) return false;
+        return attacks(board, piece->get_x(), piece->get_y(), obj->get_x(), obj->get_y());
+    }
+};
+
+template<Color C> struct Rules<C, Bishop>
+{
+    static bool attacks(Board* board, int x, int y, int new_x, int new_y)
+    {
+        return (x != new_x) && (abs(x - new_x) == abs(y - new_y)) && path_is_free(board, x, y, new_x, new_y);
+    }
+    static bool is_legal(Object* piece, Object* obj, Board* board)
+    {
+        if(is_own_or_same(piece, obj)) return false;
+        return attacks(board, piece->get_x(), piece->get_y(), obj->get_x(), obj->get_y());
+    }
+};
+
+template<Color C> struct Rules<C, Rook>
+{
+    static bool attacks(Board* board, int x, int y, int new_x, int new_y)
+    {
+        return ((x == new_x) != (y == new_y)) && path_is_free(board, x, y, new_x, new_y);
+    }
+    static bool is_legal(Object* piece, Object* obj, Board* board)
+    {
+        if(is_own_or_same(piece, obj)) return false;
+        return attacks(board, piece->get_x(), piece->get_y(), obj->get_x(), obj->get_y());
+    }
+};
+
+template<Color C> struct Rules<C, Queen>
+{
+    static bool attacks(Board* board, int x, int y, int new_x, int new_y)
+    {
+        return Rules<C, Rook>::attacks(board, x, y, new_x, new_y) || Rules<C, Bishop>::attacks(board, x, y, new_x, new_y);
+    }
+    static bool is_legal(Object* piece, Object* obj, Board* board)
+    {
+        if(is_own_or_same(piece, obj)) return false;
+        return attacks(board, piece->get_x(), piece->get_y(), obj->get_x(), obj->get_y());
+    }
+};
+
+template<Color C> struct Rules<C, Pawn>
+{
+    static constexpr int forward = (C == WHITE ? 1 : -1);
+    static constexpr int start_rank = (C == WHITE ? 1 : 6);
+
+    static bool attacks(Board* board, int x, int y, int new_x, int new_y)
+    {
+        return (board_tables.pawn_attacks[C][y * 8 + x] >> (new_y * 8 + new_x)) & 1;
+    }
+    static bool is_legal(Object* piece, Object* obj, Board* board)
+    {
+        if(is_own_or_same(piece, obj)) return false;
+        int x = piece->get_x();
+        int y = piece->get_y();
+        int new_x = obj->get_x();
+        int new_y = obj->get_y();
+        if(new_x == x)
+        {
+            if(new_y == y + forward)
+                return (obj->get_type() == Square);
+            if((y == start_rank) && (new_y == y + 2 * forward) && (obj->get_type() == Square)
+                && (board->get(x, y + forward)->get_type() == Square))
+            {
+                board->set_hit_field(board->get(x, y + forward));
+                board->get(x, y + forward)->set_extra(board->get_turn());
+                return true;
+            }
+        }
+        else if(attacks(board, x, y, new_x, new_y))
+        {
+            if(obj->get_type() != Square)
+                return true;
+            if(
+                (board->get_hit_field() != NULL) &&
+                (new_x == board->get_hit_field()->get_x()) &&
+                (new_y == board->get_hit_field()->get_y()) &&
+                (board->get_turn() == (board->get_hit_field()->get_extra() + 1))
+            )
+            {
+                board->set_cur_state(EnPassant);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+template<Color C> struct Rules<C, King>
+{
+    static constexpr int yy = (C == WHITE ? 0 : 7);
+    static constexpr Color enemy = (C == WHITE ? BLACK : WHITE);
+
+    static bool attacks(Board* board, int x, int y, int new_x, int new_y)
+    {
+        return board_tables.distance[y * 8 + x][new_y * 8 + new_x] == 1;
+    }
+    static bool is_legal(Object* piece, Object* obj, Board* board)
+    {
+        if(obj == NULL) return false;
+        if(is_own_or_same(piece, obj)) return false;
+        int x = piece->get_x();
+        int y = piece->get_y();
+        int new_x = obj->get_x();
+        int new_y = obj->get_y();
+        if(attacks(board, x, y, new_x, new_y))
+        {
+            if(board->check_king_dependency(piece, obj) == NULL)
+                return true;
+        }
+        //King and Rook
+        if(x == 4 && y == yy && (piece->get_links() == 0))
+        {
+            Object* right_rook = board->get(7, yy);
+            Object* left_rook = board->get(0, yy);
+            if(
+                (new_x == 6 && new_y == yy) && (board->get(5, yy)->get_type() == Square) 
+                && (board->get(6, yy)->get_type() == Square) && (right_rook->get_type() == Rook) 
+                && (right_rook->get_color() == C) && (right_rook->get_links() == 0)
+                && (board->is_hitted(piece, enemy) == NULL)
+                && (board->is_hitted(board->get(5, yy), enemy) == NULL)
+                && (board->is_hitted(board->get(6, yy), enemy) == NULL)
+            )
+            {
+                board->set_cur_state(ShortCastling);
+                return true;
+            }
+            if( 
+                (new_x == 2 && new_y == yy) && (board->get(1, yy)->get_type() == Square) 
+                && (board->get(2, yy)->get_type() == Square) && (board->get(3, yy)->get_type() == Square)
+                && (left_rook->get_type() == Rook) 
+                && (left_rook->get_color() == C) && (left_rook->get_links() == 0)
+                && !board->is_hitted(piece, enemy)
+                && (board->is_hitted(board->get(3, yy), enemy) == NULL)
+                && (board->is_hitted(board->get(2, yy), enemy) == NULL)
+            )
+            {
+                board->set_cur_state(LongCastling);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+template<Color C>
+bool is_legal_kernel(Object* piece, Object* obj, Board* board)
+{
+    switch(piece->get_type())
+    {
+        case King:   return Rules<C, King>::is_legal(piece, obj, board);
+        case Queen:  return Rules<C, Queen>::is_legal(piece, obj, board);
+        case Rook:   return Rules<C, Rook>::is_legal(piece, obj, board);
+        case Bishop: return Rules<C, Bishop>::is_legal(piece, obj, board);
+        case Knight: return Rules<C, Knight>::is_legal(piece, obj, board);
+        case Pawn:   return Rules<C, Pawn>::is_legal(piece, obj, board);
+        default:     return false;
+    }
+}
+
+//Returns a piece of color C that attacks (x, y)
+template<Color C>
+Object* find_attacker(Board* board, int x, int y)
+{
+    Object* obj;
+    for(int sq = 0; sq < 64; sq++)
+    {
+        obj = board->get(sq % 8, sq / 8);
+        if((obj->get_type() == Square) || (obj->get_color() != C)) continue;
+        bool hit;
+        switch(obj->get_type())
+        {
+            case King:   hit = Rules<C, King>::attacks(board, sq % 8, sq / 8, x, y); break;
+            case Queen:  hit = Rules<C, Queen>::attacks(board, sq % 8, sq / 8, x, y); break;
+            case Rook:   hit = Rules<C, Rook>::attacks(board, sq % 8, sq / 8, x, y); break;
+            case Bishop: hit = Rules<C, Bishop>::attacks(board, sq % 8, sq / 8, x, y); break;
+            case Knight: hit = Rules<C, Knight>::attacks(board, sq % 8, sq / 8, x, y); break;
+            default:     hit = Rules<C, Pawn>::attacks(board, sq % 8, sq / 8, x, y); break;
+        }
+        if(hit) return obj;
+    }
+    return NULL;
+}
+
+class Pawn : public Object
+{
+    public:
+    Pawn(int _x, int _y, Color _clr) : Object(_x, _y, _clr)
+    {
+        if(this->get_color() == WHITE)
+            this->set_img((char*)"\u2659");
+        else
+            this->set_img((char*)"\u265F");
+        this->set_type(Obj::Pawn);
+    }
+    virtual bool is_legal(Object* obj, Board* board) 
+    {
+        if(this->get_color() == WHITE)
+            return Rules<WHITE, Obj::Pawn>::is_legal(this, obj, board);
+        return Rules<BLACK, Obj::Pawn>::is_legal(this, obj, board);
+    }
+
+};
+
+class Rook : public Object
+{
+    public:
+    Rook(int _x, int _y, Color _clr) : Object(_x, _y, _clr)
+    {
+        if(this->get_color() == WHITE)
+            this->set_img((char*)"\u2656");
+        else
+            this->set_img((char*)"\u265C");
+        this->set_type(Obj::Rook);
+    }
+    virtual bool is_legal(Object* obj, Board* board) 
+    {
+        if(this->get_color() == WHITE)
+            return Rules<WHITE, Obj::Rook>::is_legal(this, obj, board);
+        return Rules<BLACK, Obj::Rook>::is_legal(this, obj, board);
+    }
+
+};
+
+class Bishop : public Object
+{
+    public:
+    Bishop(int _x, int _y, Color _clr) : Object(_x, _y, _clr)
+    {
+        if(this->get_color() == WHITE)
+            this->set_img((char*)"\u2657");
+        else
+            this->set_img((char*)"\u265D");
+        this->set_type(Obj::Bishop);
+    }
+    virtual bool is_legal(Object* obj, Board* board) 
+    {
+        if(this->get_color() == WHITE)
+            return Rules<WHITE, Obj::Bishop>::is_legal(this, obj, board);
+        return Rules<BLACK, Obj::Bishop>::is_legal(this, obj, board);
+    }
+
+};
+
+class Knight : public Object
+{
+    public:
+    Knight(int _x, int _y, Color _clr) : Object(_x, _y, _clr)
+    {
+        if(this->get_color() == WHITE)
+            this->set_img((char*)"\u2658");
+        else
+            this->set_img((char*)"\u265E");
+        this->set_type(Obj::Knight);
+    }
+    virtual bool is_legal(Object* obj, Board* board) 
+    {
+        if(this->get_color() == WHITE)
+            return Rules<WHITE, Obj::Knight>::is_legal(this, obj, board);
+        return Rules<BLACK, Obj::Knight>::is_legal(this, obj, board);
+    }
+
+};
+
+class Queen : public Object
+{
+    public:
+    Queen(int _x, int _y, Color _clr) : Object(_x, _y, _clr)
+    {
+        if(this->get_color() == WHITE)
+            this->set_img((char*)"\u2655");
+        else
+            this->set_img((char*)"\u265B");
+        this->set_type(Obj::Queen);
+    }
+    virtual bool is_legal(Object* obj, Board* board) 
+    {
+        if(this->get_color() == WHITE)
+            return Rules<WHITE, Obj::Queen>::is_legal(this, obj, board);
+        return Rules<BLACK, Obj::Queen>::is_legal(this, obj, board);
+    }
+
+};
+
+class King : public Object
+{
+    public:
+    King(int _x, int _y, Color _clr) : Object(_x, _y, _clr)
+    {
+        if(this->get_color() == WHITE)
+            this->set_img((char*)"\u2654");
+        else
+            this->set_img((char*)"\u265A");
+        this->set_type(Obj::King);
+    }
+    virtual bool is_legal(Object* obj, Board* board) 
+    {
+        if(this->get_color() == WHITE)
+            return Rules<WHITE, Obj::King>::is_legal(this, obj, board);
+        return Rules<BLACK, Obj::King>::is_legal(this, obj, board);
+    }
+
+};
+
+void Board::set_start_position()
+{
+    this->clear();
+    this->add(new class Rook(0, 0, WHITE));
+    this->add(new class Rook(0, 7, BLACK));
+    this->add(new class Knight(1, 0, WHITE));
+    this->add(new class Knight(1, 7, BLACK));
+    this->add(new class Bishop(2, 0, WHITE));
+    this->add(new class Bishop(2, 7, BLACK));
+    this->add(new class Queen(3, 0, WHITE));
+    this->add(new class Queen(3, 7, BLACK));
+    this->add(new class King(4, 0, WHITE));
+    this->add(new class King(4, 7, BLACK));
+    this->add(new class Bishop(5, 0, WHITE));
+    this->add(new class Bishop(5, 7, BLACK));
+    this->add(new class Knight(6, 0, WHITE));
+    this->add(new class Knight(6, 7, BLACK));
+    this->add(new class Rook(7, 0, WHITE));
+    this->add(new class Rook(7, 7, BLACK));
+    for(int i = 0; i < 8; i++)
+    {
+        this->add(new class Pawn(i, 1, WHITE));
+        this->add(new class Pawn(i, 6, BLACK));
+    }
+    update_position_state();
+}
+
+Object* create_object(Obj type, int x, int y, Color color)
+{
+    switch(type)
+    {
+        case King:   return new class King(x, y, color);
+        case Queen:  return new class Queen(x, y, color);
+        case Rook:   return new class Rook(x, y, color);
+        case Bishop: return new class Bishop(x, y, color);
+        case Knight: return new class Knight(x, y, color);
+        case Pawn:   return new class Pawn(x, y, color);
+        default:     return new class Square(x, y, ((x + y) % 2 == 1) ? WHITE : BLACK);
+    }
+}
+
+const char fen_pieces[2][7] = {"KQRBNP", "kqrbnp"};
+
+//Same key as Board::hash gives for the position's side to move
+uint64_t position_key(const Position& position)
+{
+    uint64_t key = (position.side == BLACK ? zobrist.side : 0);
+    for(int color = WHITE; color <= BLACK; color++)
+        for(int type = King; type <= Pawn; type++)
+            for(uint64_t bits = position.pieces[color][type]; bits != 0; bits &= bits - 1)
+                key ^= zobrist.pieces[color][type][__builtin_ctzll(bits)];
+    for(int i = 0; i < 4; i++)
+        if(position.castling & (1 << i))
+            key ^= zobrist.castling[i];
+    return key;
+}
+
+//Position from FEN (EPD positions without the move counters work too). A king without castling rights
+//counts as moved, and for the evaluation as castled on the b, c, g or h file of its home rank.
+bool parse_fen(const string& fen, Position& position)
+{
+    stringstream fields(fen);
+    string placement, side_field, castling = "-", en_passant = "-";
+    int halfmove = 0, fullmove = 1;
+    if(!(fields >> placement >> side_field) || ((side_field != "w") && (side_field != "b")))
+        return false;
+    fields >> castling >> en_passant >> halfmove >> fullmove;
+    memset(&position, 0, sizeof(position));
+    int x = 0, y = 7;
+    for(char c : placement)
+    {
+        if(c == '/')
+        {
+            if(x != 8) return false;
+            x = 0;
+            y--;
+        }
+        else if((c >= '1') && (c <= '8'))
+            x += c - '0';
+        else
+        {
+            const char* found = NULL;
+            int color = WHITE;
+            for(; color <= BLACK; color++)
+                if((found = strchr(fen_pieces[color], c)) != NULL) break;
+            if((found == NULL) || (x >= 8) || (y < 0)) return false;
+            Obj type = (Obj)(found - fen_pieces[color]);
+            if((type == Pawn) && ((y == 0) || (y == 7))) return false;
+            position.pieces[color][type] |= 1ULL << (y * 8 + x);
+            x++;
+        }
+        if(x > 8) return false;
+    }
+    if((x != 8) || (y != 0) || (__builtin_popcountll(position.pieces[WHITE][King]) != 1)
+        || (__builtin_popcountll(position.pieces[BLACK][King]) != 1))
+        return false;
+    position.side = (side_field == "w" ? WHITE : BLACK);
+    //The side not to move can't be in check, its king could be captured
+    Color mover = (Color)position.side;
+    int waiting_king = __builtin_ctzll(position.pieces[reverse_color(mover)][King]);
+    uint64_t occupied = 0;
+    for(int type = King; type <= Pawn; type++)
+        occupied |= position.pieces[WHITE][type] | position.pieces[BLACK][type];
+    if(pawns_attacks(mover, position.pieces[mover][Pawn]) & (1ULL << waiting_king))
+        return false;
+    for(int type = King; type < Pawn; type++)
+        if(piece_attacks((Obj)type, waiting_king, occupied) & position.pieces[mover][type])
+            return false;
+    for(int color = WHITE; color <= BLACK; color++)
+    {
+        int yy = (color == WHITE ? 0 : 7);
+        int king = __builtin_ctzll(position.pieces[color][King]);
+        for(int i = 0; i < 2; i++)
+        {
+            int rook = yy * 8 + (i == 0 ? 7 : 0);
+            if((castling.find(fen_pieces[color][i]) != string::npos) && (king == yy * 8 + 4)
+                && ((position.pieces[color][Rook] >> rook) & 1))
+                position.castling |= 1 << (color * 2 + i);
+        }
+        if((position.castling & (3 << (color * 2))) == 0)
+        {
+            position.king_moved |= 1 << color;
+            int file = king % 8;
+            if((king / 8 == yy) && ((file == 1) || (file == 2) || (file == 6) || (file == 7)))
+                position.castled |= 1 << color;
+        }
+    }
+    position.en_passant = -1;
+    if((en_passant.size() == 2) && (en_passant[0] >= 'a') && (en_passant[0] <= 'h')
+        && (en_passant[1] == (position.side == WHITE ? '6' : '3')))
+        position.en_passant = (en_passant[1] - '1') * 8 + (en_passant[0] - 'a');
+    position.halfmove = min(max(halfmove, 0), 255);
+    position.fullmove = min(max(fullmove, 1), 65535);
+    position.key = position_key(position);
+    return true;
+}
+
+const char START_FEN[] = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+
+//Plays a packed move of a binary collection on the bitboards, without legality checks, so whole
+//collections replay without building boards. The key stays equal to Board::hash after the same move.
+void apply_packed_move(Position& position, uint16_t move)
+{
+    int from = move & 63, to = (move >> 6) & 63;
+    int color = position.side, enemy = color ^ 1;
+    uint64_t from_bit = 1ULL << from, to_bit = 1ULL << to;
+    int type = King;
+    while((type < Pawn) && !(position.pieces[color][type] & from_bit))
+        type++;
+    bool capture = false;
+    for(int captured = King; captured <= Pawn; captured++)
+        if(position.pieces[enemy][captured] & to_bit)
+        {
+            position.pieces[enemy][captured] ^= to_bit;
+            position.key ^= zobrist.pieces[enemy][captured][to];
+            capture = true;
+            break;
+        }
+    position.pieces[color][type] ^= from_bit | to_bit;
+    position.key ^= zobrist.pieces[color][type][from] ^ zobrist.pieces[color][type][to];
+    if((type == Pawn) && !capture && ((from ^ to) & 7))
+    {
+        int square = (from & ~7) | (to & 7);
+        position.pieces[enemy][Pawn] ^= 1ULL << square;
+        position.key ^= zobrist.pieces[enemy][Pawn][square];
+        capture = true;
+    }
+    uint8_t castling = position.castling;
+    if(type == King)
+    {
+        castling &= ~(3 << (color * 2));
+        position.king_moved |= 1 << color;
+        if(abs(to - from) == 2)
+        {
+            int rook_from = (to > from) ? from + 3 : from - 4;
+            int rook_to = (to > from) ? from + 1 : from - 1;
+            position.pieces[color][Rook] ^= (1ULL << rook_from) | (1ULL << rook_to);
+            position.key ^= zobrist.pieces[color][Rook][rook_from] ^ zobrist.pieces[color][Rook][rook_to];
+            position.castled |= 1 << color;
+        }
+    }
+    //A rook leaving its corner or captured there takes the right with it
+    for(int i = 0; i < 4; i++)
+    {
+        int corner = ((i < 2) ? 0 : 56) + ((i % 2 == 0) ? 7 : 0);
+        if((from == corner) || (to == corner))
+            castling &= ~(1 << i);
+    }
+    for(int i = 0; i < 4; i++)
+        if((castling ^ position.castling) & (1 << i))
+            position.key ^= zobrist.castling[i];
+    position.castling = castling;
+    position.en_passant = ((type == Pawn) && (abs(to - from) == 16)) ? (from + to) / 2 : -1;
+    position.halfmove = ((type == Pawn) || capture) ? 0 : min(position.halfmove + 1, 255);
+    if(color == BLACK)
+        position.fullmove++;
+    position.side = enemy;
+    position.key ^= zobrist.side;
+}
+
+string format_fen(const Position& position)
+{
+    string fen;
+    for(int y = 7; y >= 0; y--)
+    {
+        int empty = 0;
+        for(int x = 0; x < 8; x++)
+        {
+            int color, type;
+            if(!position.piece_at(y * 8 + x, color, type))
+            {
+                empty++;
+                continue;
+            }
+            if(empty > 0) fen += (char)('0' + empty);
+            empty = 0;
+            fen += fen_pieces[color][type];
+        }
+        if(empty > 0) fen += (char)('0' + empty);
+        if(y > 0) fen += '/';
+    }
+    fen += (position.side == WHITE ? " w " : " b ");
+    string castling;
+    for(int i = 0; i < 4; i++)
+        if(position.castling & (1 << i))
+            castling += fen_pieces[i / 2][i % 2];
+    fen += (castling == "" ? "-" : castling);
+    fen += " " + ((position.en_passant < 0) ? string("-") : square_name(position.en_passant));
+    return fen + " " + to_string(position.halfmove) + " " + to_string(position.fullmove);
+}
+
+const Position& start_position()
+{
+    static Position position = []()
+    {
+        Position start;
+        parse_fen(START_FEN, start);
+        return start;
+    }();
+    return position;
+}
+
+//Binary collection: 8 byte magic "CHSGAME2", then games. Each game is a varint byte count and the record:
+//result byte (0 - black won, 1 - draw, 2 - white won, 3 - unknown), the info table, a varint move count
+//and one varint move code per move, played from the initial position. The info table is a varint mask of
+//the non-empty info lines, then per line a tag byte (1 + index in PACKED_INFO_TAGS for a "Tag: value"
+//line, 0 for any other line) and the value (or line) as varint length and bytes.
+const char PACKED_GAMES_MAGIC[8] = {'C', 'H', 'S', 'G', 'A', 'M', 'E', '2'};
+const char* const PACKED_INFO_TAGS[] = {"Event", "Site", "Date", "Round", "White", "Black", "Result",
+    "WhiteElo", "BlackElo", "ECO", "TimeControl", "Termination"};
+const int PACKED_INFO_TAGS_COUNT = sizeof(PACKED_INFO_TAGS) / sizeof(PACKED_INFO_TAGS[0]);
+
+void put_varint(string& out, uint64_t value)
+{
+    while(value >= 0x80)
+    {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+bool get_varint(const uint8_t*& data, const uint8_t* end, uint64_t& value)
+{
+    value = 0;
+    for(int shift = 0; (data < end) && (shift < 64); shift += 7)
+    {
+        uint8_t byte = *data++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if(!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+//Move codes count the moves before the move in a fixed order: pieces of the side to move by type and then
+//square, each with its targets by square. Targets are pseudo-legal (attacked squares without own pieces, pawn pushes,
+//en passant and the castling king steps), so coding needs no legality check and real games stay below 128,
+//one byte per move.
+uint64_t move_targets(const Position& position, int type, int square, uint64_t own, uint64_t occupied)
+{
+    int color = position.side;
+    if(type != Pawn)
+    {
+        uint64_t targets = piece_attacks((Obj)type, square, occupied) & ~own;
+        if(type == King)
+            for(int i = 0; i < 2; i++)
+                if(position.castling & (1 << (color * 2 + i)))
+                    targets |= 1ULL << (square + ((i == 0) ? 2 : -2));
+        return targets;
+    }
+    uint64_t enemy = occupied & ~own;
+    if(position.en_passant >= 0)
+        enemy |= 1ULL << position.en_passant;
+    uint64_t targets = board_tables.pawn_attacks[color][square] & enemy;
+    int forward = (color == WHITE) ? 8 : -8;
+    int step = square + forward;
+    if((step >= 0) && (step < 64) && !((occupied >> step) & 1))
+    {
+        targets |= 1ULL << step;
+        if((square / 8 == ((color == WHITE) ? 1 : 6)) && !((occupied >> (step + forward)) & 1))
+            targets |= 1ULL << (step + forward);
+    }
+    return targets;
+}
+
+//Code of the move from | to << 6, or -1 if it isn't among the targets
+int encode_move(const Position& position, uint16_t move)
+{
+    int from = move & 63, to = (move >> 6) & 63;
+    uint64_t own = 0, occupied = 0;
+    for(int type = King; type <= Pawn; type++)
+    {
+        own |= position.pieces[position.side][type];
+        occupied |= position.pieces[position.side ^ 1][type];
+    }
+    occupied |= own;
+    int code = 0;
+    for(int type = King; type <= Pawn; type++)
+        for(uint64_t pieces = position.pieces[position.side][type]; pieces != 0; pieces &= pieces - 1)
+        {
+            int square = __builtin_ctzll(pieces);
+            uint64_t targets = move_targets(position, type, square, own, occupied);
+            if(square != from)
+            {
+                code += __builtin_popcountll(targets);
+                continue;
+            }
+            if(!((targets >> to) & 1)) return -1;
+            return code + __builtin_popcountll(targets & ((1ULL << to) - 1));
+        }
+    return -1;
+}
+
+//Move from | to << 6 with the code, or -1
+int decode_move(const Position& position, uint64_t code)
+{
+    uint64_t own = 0, occupied = 0;
+    for(int type = King; type <= Pawn; type++)
+    {
+        own |= position.pieces[position.side][type];
+        occupied |= position.pieces[position.side ^ 1][type];
+    }
+    occupied |= own;
+    for(int type = King; type <= Pawn; type++)
+        for(uint64_t pieces = position.pieces[position.side][type]; pieces != 0; pieces &= pieces - 1)
+        {
+            int square = __builtin_ctzll(pieces);
+            uint64_t targets = move_targets(position, type, square, own, occupied);
+            uint64_t count = __builtin_popcountll(targets);
+            if(code < count)
+            {
+                for(; code > 0; code--)
+                    targets &= targets - 1;
+                return square | (__builtin_ctzll(targets) << 6);
+            }
+            code -= count;
+        }
+    return -1;
+}
+
+//Move count and codes; false if a move isn't among the targets of its position
+bool pack_moves(const vector<uint16_t>& moves, string& packed)
+{
+    Position position = start_position();
+    packed.clear();
+    put_varint(packed, moves.size());
+    for(auto move : moves)
+    {
+        int code = encode_move(position, move);
+        if(code < 0) return false;
+        put_varint(packed, code);
+        apply_packed_move(position, move);
+    }
+    return true;
+}
+
+//The framed record of the game; false if its moves can't be coded
+bool pack_game(const GameRecord& game, string& framed)
+{
+    string moves;
+    if(!pack_moves(game.moves, moves)) return false;
+    string record;
+    record += (char)((game.result < 0) ? 3 : (int)lround(game.result * 2));
+    uint64_t mask = 0;
+    for(int i = 0; i < 10; i++)
+        if(!game.info[i].empty())
+            mask |= 1 << i;
+    put_varint(record, mask);
+    for(auto& line : game.info)
+    {
+        if(line.empty()) continue;
+        int tag = 0;
+        for(int i = 0; (i < PACKED_INFO_TAGS_COUNT) && (tag == 0); i++)
+        {
+            size_t length = strlen(PACKED_INFO_TAGS[i]);
+            if((line.compare(0, length, PACKED_INFO_TAGS[i]) == 0) && (line.compare(length, 2, ": ") == 0))
+                tag = i + 1;
+        }
+        size_t skip = (tag == 0) ? 0 : strlen(PACKED_INFO_TAGS[tag - 1]) + 2;
+        record += (char)tag;
+        put_varint(record, line.size() - skip);
+        record.append(line, skip, string::npos);
+    }
+    record += moves;
+    framed.clear();
+    put_varint(framed, record.size());
+    framed += record;
+    return true;
+}
+
+//Writes the magic first if the file is new or empty, and doesn't append to a file of another format
+//or a game whose moves can't be coded
+bool append_packed_game(const string& path, const GameRecord& game)
+{
+    string record;
+    if(!pack_game(game, record)) return false;
+    ofstream f(path, ios::binary | ios::app);
+    if(!f.is_open()) return false;
+    if(f.tellp() == 0)
+        f.write(PACKED_GAMES_MAGIC, sizeof(PACKED_GAMES_MAGIC));
+    else
+    {
+        char magic[sizeof(PACKED_GAMES_MAGIC)] = {};
+        ifstream existing(path, ios::binary);
+        existing.read(magic, sizeof(magic));
+        if(memcmp(magic, PACKED_GAMES_MAGIC, sizeof(magic)) != 0)
+            return false;
+    }
+    f.write(record.data(), record.size());
+    return f.good();
+}
+
+struct PackedGame
+{
+    uint8_t result;
+    const uint8_t* info;
+    const uint8_t* moves;
+    const uint8_t* end;
+    size_t count;
+};
+
+//Plays the next move of a packed game on the position; false at a code without a move
+bool replay_packed_move(Position& position, const uint8_t*& cur, const uint8_t* end, uint16_t& move)
+{
+    uint64_t code;
+    if(!get_varint(cur, end, code)) return false;
+    int decoded = decode_move(position, code);
+    if(decoded < 0) return false;
+    move = decoded;
+    apply_packed_move(position, move);
+    return true;
+}
+
+//Read-only mapping of a binary collection; opening only walks the length prefixes,
+//so games are reached without copying or parsing them
+class PackedGames
+{
+    const uint8_t* data = NULL;
+    size_t bytes = 0;
+    vector<size_t> offsets;
+
+    public:
+    PackedGames() = default;
+    PackedGames(const PackedGames&) = delete;
+    PackedGames& operator=(const PackedGames&) = delete;
+    bool open(const string& path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd == -1) return false;
+        struct stat st;
+        if((fstat(fd, &st) == 0) && (st.st_size >= (off_t)sizeof(PACKED_GAMES_MAGIC)))
+        {
+            void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(mapped != MAP_FAILED)
+            {
+                data = (const uint8_t*)mapped;
+                bytes = st.st_size;
+            }
+        }
+        close(fd);
+        if((data == NULL) || (memcmp(data, PACKED_GAMES_MAGIC, sizeof(PACKED_GAMES_MAGIC)) != 0))
+            return false;
+        const uint8_t* cur = data + sizeof(PACKED_GAMES_MAGIC);
+        const uint8_t* end = data + bytes;
+        uint64_t size;
+        //A record cut short by an interrupted append is left out
+        while((cur < end) && get_varint(cur, end, size) && (size <= (uint64_t)(end - cur)))
+        {
+            offsets.push_back(cur - data);
+            cur += size;
+            offsets.push_back(cur - data);
+        }
+        return true;
+    }
+    size_t size() const { return offsets.size() / 2; }
+    size_t get_bytes() const { return bytes; }
+    bool get(size_t index, PackedGame& game) const
+    {
+        const uint8_t* cur = data + offsets[2 * index];
+        const uint8_t* end = data + offsets[2 * index + 1];
+        uint64_t value;
+        if(cur == end) return false;
+        game.result = *cur++;
+        game.info = cur;
+        uint64_t mask;
+        if(!get_varint(cur, end, mask)) return false;
+        for(int i = 0; i < 10; i++)
+        {
+            if(!(mask & (1 << i))) continue;
+            if((cur == end) || (*cur++ > PACKED_INFO_TAGS_COUNT)) return false;
+            if(!get_varint(cur, end, value) || (value > (uint64_t)(end - cur))) return false;
+            cur += value;
+        }
+        if(!get_varint(cur, end, value)) return false;
+        game.count = value;
+        game.moves = cur;
+        game.end = end;
+        return true;
+    }
+    //Moves after a corrupt code are dropped
+    bool get(size_t index, GameRecord& record) const
+    {
+        PackedGame game;
+        if(!get(index, game)) return false;
+        record.result = (game.result == 3) ? -1.0 : game.result / 2.0;
+        const uint8_t* cur = game.info;
+        uint64_t mask, length;
+        get_varint(cur, game.moves, mask);
+        for(int i = 0; i < 10; i++)
+        {
+            record.info[i] = "";
+            if(!(mask & (1 << i))) continue;
+            int tag = *cur++;
+            get_varint(cur, game.moves, length);
+            if(tag != 0)
+                record.info[i] = string(PACKED_INFO_TAGS[tag - 1]) + ": ";
+            record.info[i].append((const char*)cur, length);
+            cur += length;
+        }
+        record.moves.clear();
+        Position position = start_position();
+        uint16_t move;
+        cur = game.moves;
+        for(size_t i = 0; (i < game.count) && replay_packed_move(position, cur, game.end, move); i++)
+            record.moves.push_back(move);
+        return true;
+    }
+    ~PackedGames()
+    {
+        if(data != NULL)
+            munmap((void*)data, bytes);
+    }
+};
+
+bool read_packed_games(const string& path, vector<GameRecord>& games, size_t limit)
+{
+    PackedGames packed;
+    if(!packed.open(path)) return false;
+    GameRecord game;
+    for(size_t i = 0; (i < packed.size()) && (games.size() < limit); i++)
+        if(packed.get(i, game) && (game.moves.size() != 0))
+            games.push_back(game);
+    return true;
+}
+
+//Snapshot of the current position; the en passant square comes from the last double pawn push
+Position Board::get_position(Color side)
+{
+    Position position = current_position;
+    if(side != position.side)
+    {
+        position.side = side;
+        position.key = hash(side);
+    }
+    return position;
+}
+
+//Replaces the game with the position. Kings and rooks without castling rights count as moved,
+//so the castling rules, the hash and the evaluation read the same state as on the original board.
+void Board::set_position(const Position& position)
+{
+    clear_game_info();
+    clear();
+    for(int sq = 0; sq < 64; sq++)
+    {
+        int color, type;
+        if(position.piece_at(sq, color, type))
+            this->add(create_object((Obj)type, sq % 8, sq / 8, (Color)color));
+    }
+    for(int color = WHITE; color <= BLACK; color++)
+    {
+        int yy = (color == WHITE ? 0 : 7);
+        if(position.king_moved & (1 << color))
+            (color == WHITE ? white_king : black_king)->inc_links();
+        for(int i = 0; i < 2; i++)
+        {
+            Object* rook = this->get((i == 0) ? 7 : 0, yy);
+            if((rook->get_type() == Rook) && (rook->get_color() == color) && !(position.castling & (1 << (color * 2 + i))))
+                rook->inc_links();
+        }
+    }
+    white_castling = (position.castled & (1 << WHITE)) != 0;
+    black_castling = (position.castled & (1 << BLACK)) != 0;
+    hit_field = NULL;
+    cur_state = Nothing;
+    if(position.en_passant >= 0)
+    {
+        //Pawn rules allow the capture when the turn counter is one past the square's mark
+        hit_field = this->get(position.en_passant % 8, position.en_passant / 8);
+        hit_field->set_extra(turn - 1);
+    }
+    halfmove_clock = position.halfmove;
+    current_position.side = position.side;
+    current_position.en_passant = position.en_passant;
+    current_position.fullmove = position.fullmove;
+    update_position_state();
+}
+
+//Game with its moves and the result reached after the last move, in the 10 line info layout of game files
+GameRecord Board::get_game_record()
+{
+    GameRecord game;
+    get_packed_moves(game.moves);
+    int current = turn;
+    while(turn + 1 < (int)turns.size())
+        step_forward();
+    Color color = ((turn + 1) % 2 == 0) ? WHITE : BLACK;
+    if(check_mate(color))
+        game.result = (color == WHITE) ? 0.0 : 1.0;
+    else if(!rule_draw(color).empty())
+        game.result = 0.5;
+    while(turn > current)
+    {
+        make_move_backward(turns.at(turn));
+        turn--;
+    }
+    char date[16];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y.%m.%d", localtime(&now));
+    game.info[0] = "Event: Classic game";
+    game.info[3] = string("Date: ") + date;
+    game.info[8] = string("Result: ") + ((game.result < 0) ? "*" : (game.result == 0.5) ? "1/2-1/2" : (game.result == 1.0) ? "1-0" : "0-1");
+    return game;
+}
+
+//Keys of the earlier positions inside the reversible window, oldest first, without the current one
+void Board::game_history(vector<uint64_t>& keys)
+{
+    int moves = min(halfmove_clock, turn + 1);
+    int earlier = min(halfmove_clock - moves, (int)history.size());
+    keys.assign(history.end() - earlier, history.end());
+    for(int i = 0; i < moves; i++)
+        make_move_backward(turns.at(turn - i));
+    for(int i = moves - 1; i >= 0; i--)
+    {
+        Turn* cur_turn = turns.at(turn - i);
+        keys.push_back(hash(cur_turn->get_from()->get_color()));
+        make_move_forward(cur_turn);
+    }
+}
+
+//Empty unless the game is drawn by the fifty-move rule or threefold repetition
+string Board::rule_draw(Color side)
+{
+    if(halfmove_clock >= 100)
+        return "50-move rule";
+    vector<uint64_t> keys;
+    game_history(keys);
+    uint64_t key = hash(side);
+    int repeats = 1;
+    for(int i = (int)keys.size() - 4; i >= 0; i -= 2)
+        if(keys[i] == key)
+            repeats++;
+    return (repeats >= 3) ? "repetition" : "";
+}
+
+bool Board::set_fen(const string& fen, Color& side)
+{
+    Position position;
+    if(!parse_fen(fen, position))
+        return false;
+    set_position(position);
+    side = (Color)position.side;
+    return true;
+}
+
+string Board::get_fen(Color side)
+{
+    return format_fen(get_position(side));
+}
+
+//EPD: four FEN fields, optional move counters, then "opcode operand;" operations
+bool parse_epd(const string& line, string& fen, vector<pair<string, string>>& operations)
+{
+    stringstream fields(line);
+    string field;
+    fen = "";
+    for(int i = 0; i < 4; i++)
+    {
+        if(!(fields >> field)) return false;
+        fen += (i > 0 ? " " : "") + field;
+    }
+    string rest;
+    getline(fields, rest);
+    //FEN move counters
+    stringstream counters(rest);
+    int halfmove, fullmove;
+    if((counters >> halfmove >> fullmove))
+    {
+        fen += " " + to_string(halfmove) + " " + to_string(fullmove);
+        //Nothing after the counters leaves getline failing at the end, not clearing rest
+        rest.clear();
+        getline(counters, rest);
+    }
+    operations.clear();
+    stringstream ops(rest);
+    string op;
+    while(getline(ops, op, ';'))
+    {
+        size_t begin = op.find_first_not_of(" \t\r");
+        if(begin == string::npos) continue;
+        op = op.substr(begin);
+        size_t space = op.find(' ');
+        string operand = (space == string::npos) ? "" : op.substr(op.find_first_not_of(' ', space));
+        while(!operand.empty() && ((operand.back() == ' ') || (operand.back() == '\r'))) operand.pop_back();
+        if((operand.size() >= 2) && (operand.front() == '"') && (operand.back() == '"'))
+            operand = operand.substr(1, operand.size() - 2);
+        operations.push_back({op.substr(0, space), operand});
+    }
+    return true;
+}
+
+int Bitbases::probe(Board* board, Color turn_color, Color& strong)
+{
+    //Runs at every node, so positions with more men are turned away on the bitboards alone
+    const uint64_t (&pieces)[2][6] = board->current_position.pieces;
+    uint64_t men[2] = {0, 0};
+    for(int type = Queen; type <= Pawn; type++)
+    {
+        men[WHITE] |= pieces[WHITE][type];
+        men[BLACK] |= pieces[BLACK][type];
+    }
+    strong = UNCOLORED;
+    if((men[WHITE] != 0) && (men[BLACK] != 0)) return -1;
+    if((pieces[WHITE][King] == 0) || (pieces[BLACK][King] == 0)) return -1;
+    int count = __builtin_popcountll(men[WHITE] | men[BLACK]);
+    if(count > 2) return -1;
+    //Bare kings can't mate
+    if(count == 0) return 0;
+    strong = (men[WHITE] != 0) ? WHITE : BLACK;
+    //Pieces in Obj order, the same type by square
+    int squares[2];
+    Obj types[2];
+    int found = 0;
+    for(int type = Queen; type <= Pawn; type++)
+        for(uint64_t rest = pieces[strong][type]; rest != 0; rest &= rest - 1)
+        {
+            squares[found] = __builtin_ctzll(rest);
+            types[found++] = (Obj)type;
+        }
+    //A single minor piece can't mate
+    if((count == 1) && ((types[0] == Bishop) || (types[0] == Knight))) return 0;
+    string name = "k";
+    for(int i = 0; i < count; i++)
+        name += "kqrbnp"[types[i]];
+    name += "k";
+    auto table = tables.find(name);
+    if(table == tables.end()) return -1;
+
+    //Flip the ranks when black is the side with pieces
+    int flip = (strong == WHITE ? 0 : 56);
+    size_t index = (__builtin_ctzll(pieces[strong][King]) ^ flip) | ((__builtin_ctzll(pieces[reverse_color(strong)][King]) ^ flip) << 6);
+    for(int i = 0; i < count; i++)
+        index |= (size_t)(squares[i] ^ flip) << (12 + 6 * i);
+    if(turn_color != strong)
+        index += table->second.size;
+    return (table->second.bits[index / 8] >> (index % 8)) & 1;
+}
+
+bool AI::check_passed_pawn(Color color, int square, uint64_t enemy_pawns)
+{
+    return (board_tables.passed_pawn_mask[color][square] & enemy_pawns) == 0;
+}
+void AI::material(const uint64_t (&pieces)[2][6], EvalTerms& terms)
+{
+    for(int type = Queen; type <= Pawn; type++)
+        terms.add(QueenValue + (type - Queen), __builtin_popcountll(pieces[WHITE][type]) - __builtin_popcountll(pieces[BLACK][type]));
+    terms.add(BishopPair, (__builtin_popcountll(pieces[WHITE][Bishop]) == 2) - (__builtin_popcountll(pieces[BLACK][Bishop]) == 2));
+}
+//Chain, passed, doubled and isolated pawn terms; they depend on pawns only
+void AI::pawn_structure(const uint64_t* pawns, EvalTerms& terms)
+{
+    for(int c = WHITE; c <= BLACK; c++)
+    {
+        Color color = (Color)c;
+        int sign = (color == WHITE ? 1 : -1);
+        uint64_t own = pawns[color];
+        uint64_t enemy = pawns[reverse_color(color)];
+        for(uint64_t rest = own; rest != 0; rest &= rest - 1)
+        {
+            int sq = __builtin_ctzll(rest);
+            int rank = (color == WHITE ? sq / 8 : 7 - sq / 8);
+            //Chain bonus for every own pawn defending this one
+            terms.add(PawnChain, sign * __builtin_popcountll(board_tables.pawn_attacks[reverse_color(color)][sq] & own));
+            terms.add((check_passed_pawn(color, sq, enemy) ? PassedPawnReward : PawnReward) + rank, sign);
+            if((board_tables.adjacent_files_mask[sq % 8] & own) == 0)
+                terms.add(IsolatedPawn, sign);
+        }
+        for(int x = 0; x < 8; x++)
+        {
+            int pawns_on_vert = __builtin_popcountll(own & board_tables.file_mask[x]);
+            if(pawns_on_vert != 0)
+                terms.add(DoubledPawn, sign * (pawns_on_vert - 1));
+        }
+    }
+}
+void AI::generate_turns(Board* board, Color turn_color, vector<Turn*>& possible_turns)
+{
+    if(turn_color == WHITE)
+        generate_turns<WHITE>(board, possible_turns);
+    else
+        generate_turns<BLACK>(board, possible_turns);
+}
+template<Color C>
+void AI::generate_turns(Board* board, vector<Turn*>& possible_turns)
+{
+    Object* obj_from;
+    Object* obj_to;
+    Turn* temp_turn;
+    for(int i = 0; i < 64; i++)
+    {
+        obj_from = board->board[i];
+        if(obj_from->get_type() == Square) continue;
+        if(obj_from->get_color() != C) continue;
+        for(int j = 0; j < 64; j++)
+        {
+            obj_to = board->board[j];
+            //A castling or en passant rejected by check_king_dependency must not leak into the next move
+            board->cur_state = Nothing;
+            if(is_legal_kernel<C>(obj_from, obj_to, board)
+            && (board->check_king_dependency(obj_from, obj_to) == NULL))
+            {
+                temp_turn = new Turn(obj_from, obj_to);
+                if(board->cur_state != Nothing)
+                {
+                    if(board->cur_state == EnPassant)
+                    {
+                        board->extra_turns.push_back(
+                            new Turn(
+                                board->get(obj_to->get_x(), (obj_from->get_y())),
+                                board->get(obj_to->get_x(), (obj_from->get_y()))
+                            )
+                        );
+                    }
+                    else
+                    {
+                        int yy = ((obj_from->get_color() == WHITE) ? 0 : 7);
+                        board->extra_turns.push_back(
+                            new Turn(
+                                board->get(((board->cur_state == ShortCastling) ? 7 : 0), yy),
+                                board->get(((board->cur_state == ShortCastling) ? 5 : 3), yy)
+                            )
+                        );
+                    }
+                    temp_turn->set_extra_index(board->free_extra_index++);
+                    board->cur_state = Nothing;
+                }
+                possible_turns.push_back(temp_turn);
+            }
+        }
+    }
+}
+void AI::release_turns(Board* board, vector<Turn*>& possible_turns)
+{
+    for(auto turn : possible_turns)
+    {
+        if(turn->get_extra_index() != -1)
+        {
+            board->free_extra_index--;
+            delete board->extra_turns.at(board->free_extra_index)->get_replace();
+            delete board->extra_turns.at(board->free_extra_index);
+            board->extra_turns.pop_back();
+        }
+        delete turn->get_replace();
+        delete turn;
+    }
+    possible_turns.clear();
+}
+//Takes one turn out and releases the others. The release pops one extra turn off the top of the stack for every
+//released turn that has one, so the kept turn's extra turn is moved below those of the list first
+Turn* AI::keep_turn(Board* board, vector<Turn*>& possible_turns, size_t index)
+{
+    Turn* kept = possible_turns.at(index);
+    possible_turns.erase(possible_turns.begin() + index);
+    if(kept->get_extra_index() != -1)
+    {
+        int bottom = board->free_extra_index - 1;
+        for(auto turn : possible_turns)
+            if(turn->get_extra_index() != -1)
+                bottom--;
+        swap(board->extra_turns.at(kept->get_extra_index()), board->extra_turns.at(bottom));
+        for(auto turn : possible_turns)
+            if(turn->get_extra_index() == bottom)
+                turn->set_extra_index(kept->get_extra_index());
+        kept->set_extra_index(bottom);
+    }
+    release_turns(board, possible_turns);
+    return kept;
+}
+//Fifty-move rule, or the key seen before inside the reversible window with the same side to move
+bool AI::is_rule_draw(Board* board, uint64_t key)
+{
+    int clock = board->get_halfmove_clock();
+    if(clock >= 100) return true;
+    int oldest = max((int)keys.size() - clock, 0);
+    for(int i = (int)keys.size() - 4; i >= oldest; i -= 2)
+        if(keys[i] == key)
+            return true;
+    return false;
+}
+double AI::evaluate_best_answer(Board* board, Color turn_color, int depth)
+{
+    vector<Turn*> possible_turns;
+    double evaluation;
+    {
+        STAT(StatTimer timer(stats.movegen_ns));
+        generate_turns(board, turn_color, possible_turns);
+    }
+    keys.push_back(board->hash(turn_color));
+    for(auto temp_turn : possible_turns)
+    {
+        board->make_move_forward(temp_turn);
+        nodes++;
+        if((board->get_halfmove_clock() >= 4) && is_rule_draw(board, board->hash(reverse_color(turn_color))))
+            temp_turn->set_ai_evaluation(0.0);
+        else if(depth > 0)
+            temp_turn->set_ai_evaluation(evaluate_best_answer(board, reverse_color(turn_color), depth-1));
+        else
+        {
+            STAT(stats.qnodes++);
+            STAT(StatTimer timer(stats.eval_ns));
+            temp_turn->set_ai_evaluation(static_analyze(board));
+        }
+        board->make_move_backward(temp_turn);
+    }
+    keys.pop_back();
+    if(turn_color == WHITE)
+        sort(possible_turns.begin(), possible_turns.end(), compareTurnsForWhite);
+    else
+        sort(possible_turns.begin(), possible_turns.end(), compareTurnsForBlack);   
+    evaluation = possible_turns.at(0)->get_ai_evaluation();
+    release_turns(board, possible_turns);
+    return evaluation;
+}
+Turn* AI::analyze(Board* board, Color turn_color)
+{
+    vector<Turn*> possible_turns;
+    Turn* result;   
+    generate_turns(board, turn_color, possible_turns);
+    int book_weight;
+    int book_move = opening_book().probe(board->hash(turn_color), book_weight);
+    if(book_move != -1)
+    {
+        auto book_turn = find_if(possible_turns.begin(), possible_turns.end(), [&](Turn* turn)
+        {
+            return (turn->get_from_square() == ((book_move >> 6) & 63)) && (turn->get_to_square() == (book_move & 63));
+        });
+        if(book_turn != possible_turns.end())
+        {
+            result = keep_turn(board, possible_turns, book_turn - possible_turns.begin());
+            cout << "Book: " << square_name(result->get_from_square()) << " -> " << square_name(result->get_to_square())
+                << " weight " << book_weight << "\n";
+            return result;
+        }
+    }
+    auto start_time = chrono::steady_clock::now();
+    nodes = 0;
+    stats = SearchStats();
+    STAT(long start_allocations = allocation_count);
+    board->game_history(keys);
+    keys.push_back(board->hash(turn_color));
+    cout << "Analyzing" << endl;
+    for(int i = 0; i < possible_turns.size(); i++)
+    {
+        Turn* temp_turn = possible_turns.at(i);
+        board->make_move_forward(temp_turn);
+        if((board->get_halfmove_clock() >= 4) && is_rule_draw(board, board->hash(reverse_color(turn_color))))
+            temp_turn->set_ai_evaluation(0.0);
+        else
+            temp_turn->set_ai_evaluation(evaluate_best_answer(board, reverse_color(turn_color), 1));
+        board->make_move_backward(temp_turn);
+        if((i + 1) % 7 == 0)
+        {
+            cout << "\033[F";
+            cout << "Analyzing";
+            for(int k = 0; k < (i + 1) / 7; k++)
+                cout << ".";
+            cout << endl;
+        }
+    }
+    if(turn_color == WHITE)
+        sort(possible_turns.begin(), possible_turns.end(), compareTurnsForWhite);
+    else
+        sort(possible_turns.begin(), possible_turns.end(), compareTurnsForBlack);
+
+    int border = min(5, (int)possible_turns.size());
+    cout << "\033[F";
+    for(int i = 0; i < border; i++)
+        cout << "Top " << i + 1 << ": " 
+        << board->low_alphabet[possible_turns.at(i)->get_from()->get_x()] << possible_turns.at(i)->get_from()->get_y() + 1 
+        << " -> "
+        << board->low_alphabet[possible_turns.at(i)->get_to()->get_x()] << possible_turns.at(i)->get_to()->get_y() + 1
+        <<  " " << possible_turns.at(i)->get_ai_evaluation() << "\n";
+    SearchInfo info;
+    info.nodes = nodes;
+    info.time = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time).count();
+    STAT(stats.allocations = allocation_count - start_allocations);
+    info.stats = stats;
+    cout << "Nodes " << info.nodes << "  " << info.time << " ms";
+    for(auto& line : search_stats_lines(info))
+        cout << "  " << line;
+    cout << "\n";
+    if(possible_turns.size() == 0) return NULL;
+    return keep_turn(board, possible_turns, 0);
+}
+//Mate scores are stored relative to the node, so a mate found through a transposition keeps its distance
+int score_to_tt(double score, int ply)
+{
+    if(score >= MATE_SCORE - MAX_PLY) score += ply;
+    else if(score <= -(MATE_SCORE - MAX_PLY)) score -= ply;
+    return (int)lround(score * 100);
+}
+double score_from_tt(int score, int ply)
+{
+    double result = score / 100.0;
+    if(result >= MATE_SCORE - MAX_PLY) result -= ply;
+    else if(result <= -(MATE_SCORE - MAX_PLY)) result += ply;
+    return result;
+}
+//One line about the stored analysis of the position, empty if there is none
+string Board::cached_analysis(Color side)
+{
+    TTData data;
+    if(!analysis_cache().probe(hash(side) ^ evaluator_key(eval_params(), network), data) || (data.from == -1))
+        return "";
+    return "Cached: depth " + to_string(data.depth) + "  " + score_to_string(score_from_tt(data.score, 0))
+        + "  " + square_name(data.from) + square_name(data.to);
+}
+double AI::alpha_beta(Board* board, Color turn_color, int depth, double alpha, double beta, int ply)
+{
+    nodes++;
+    STAT(stats.seldepth = max(stats.seldepth, ply));
+    pv_length[ply] = 0;
+    check_limits();
+    if((ply > 0) && is_stopped()) return 0.0;
+    //Repetitions need four reversible plies, so the key is only computed early when one is possible
+    uint64_t key = 0;
+    bool keyed = false;
+    if((ply > 0) && (board->halfmove_clock >= 4))
+    {
+        key = board->hash(turn_color);
+        keyed = true;
+        if(is_rule_draw(board, key)) return 0.0;
+    }
+    //Drawn endings are cut at once, won ones are still searched so that mates are found
+    bool known_win = false;
+    Color strong;
+    if((ply > 0) && !bitbases().is_empty())
+    {
+        int bitbase_result = bitbases().probe(board, turn_color, strong);
+        if(bitbase_result == 0) return 0.0;
+        known_win = (bitbase_result == 1);
+    }
+    if((depth <= 0) || (ply >= MAX_PLY - 1))
+    {
+        STAT(stats.qnodes++);
+        STAT(StatTimer timer(stats.eval_ns));
+        if(known_win)
+            return (strong == WHITE ? 1 : -1) * KNOWN_WIN + static_analyze(board);
+        return static_analyze(board);
+    }
+
+    if(!keyed)
+        key = board->hash(turn_color);
+    int hash_from = -1, hash_to = -1;
+    TTData data;
+    STAT(if(tt != NULL) stats.tt_probes++);
+    if((tt != NULL) && tt->probe(key ^ evaluator, data))
+    {
+        STAT(stats.tt_hits++);
+        hash_from = data.from;
+        hash_to = data.to;
+        double score = score_from_tt(data.score, ply);
+        if((ply > 0) && (data.depth >= depth) && (
+            (data.bound == ExactBound)
+            || ((data.bound == LowerBound) && (score >= beta))
+            || ((data.bound == UpperBound) && (score <= alpha))
+        ))
+        {
+            STAT(stats.tt_cutoffs++);
+            return score;
+        }
+    }
+
+    vector<Turn*> possible_turns;
+    {
+        STAT(StatTimer timer(stats.movegen_ns));
+        generate_turns(board, turn_color, possible_turns);
+    }
+    if(possible_turns.size() == 0)
+    {
+        bool in_check = (board->check_chess_check(turn_color) != NULL);
+        board->double_check = false;
+        if(in_check)
+            return (turn_color == WHITE ? -1 : 1) * (MATE_SCORE - ply);
+        return 0.0;
+    }
+    //Hash move first, then captures
+    stable_partition(possible_turns.begin(), possible_turns.end(), [](Turn* turn) { return turn->get_to()->get_type() != Square; });
+    auto hash_turn = find_if(possible_turns.begin(), possible_turns.end(), [&](Turn* turn)
+    {
+        return (turn->get_from_square() == hash_from) && (turn->get_to_square() == hash_to);
+    });
+    if(hash_turn != possible_turns.end())
+        rotate(possible_turns.begin(), hash_turn, hash_turn + 1);
+
+    double alpha_orig = alpha;
+    double beta_orig = beta;
+    double best = (turn_color == WHITE ? -INF_SCORE : INF_SCORE);
+    int best_from = -1, best_to = -1;
+    keys.push_back(key);
+    for(auto turn : possible_turns)
+    {
+        int from = turn->get_from_square();
+        int to = turn->get_to_square();
+        board->make_move_forward(turn);
+        double score = alpha_beta(board, reverse_color(turn_color), depth - 1, alpha, beta, ply + 1);
+        board->make_move_backward(turn);
+        if(is_stopped()) break;
+        if((turn_color == WHITE) ? (score > best) : (score < best))
+        {
+            best = score;
+            best_from = from;
+            best_to = to;
+            pv_table[ply][0] = from * 64 + to;
+            for(int i = 0; i < pv_length[ply + 1]; i++)
+                pv_table[ply][i + 1] = pv_table[ply + 1][i];
+            pv_length[ply] = pv_length[ply + 1] + 1;
+            if(turn_color == WHITE)
+                alpha = max(alpha, score);
+            else
+                beta = min(beta, score);
+        }
+        if(alpha >= beta)
+        {
+            STAT(stats.cutoffs++);
+            STAT(if(turn == possible_turns.front()) stats.first_move_cutoffs++);
+            break;
+        }
+    }
+    keys.pop_back();
+    release_turns(board, possible_turns);
+    if((tt != NULL) && !is_stopped())
+    {
+        Bound bound = ExactBound;
+        if((turn_color == WHITE) ? (best <= alpha_orig) : (best >= beta_orig))
+            bound = (turn_color == WHITE ? UpperBound : LowerBound);
+        else if((turn_color == WHITE) ? (best >= beta) : (best <= alpha))
+            bound = (turn_color == WHITE ? LowerBound : UpperBound);
+        tt->store(key ^ evaluator, depth, score_to_tt(best, ply), bound, best_from, best_to);
+    }
+    return best;
+}
+//Cached analyses of the root and of every position one move away go into the table,
+//so a reopened game picks up the work done on its neighbouring plies
+void AI::seed_from_cache(Board* board, Color turn_color)
+{
+    TTData data;
+    uint64_t key = board->hash(turn_color);
+    if(cache->probe(key ^ evaluator, data))
+        tt->store(key ^ evaluator, data.depth, data.score, data.bound, data.from, data.to);
+    vector<Turn*> possible_turns;
+    generate_turns(board, turn_color, possible_turns);
+    for(auto turn : possible_turns)
+    {
+        board->make_move_forward(turn);
+        key = board->hash(reverse_color(turn_color));
+        if(cache->probe(key ^ evaluator, data))
+            tt->store(key ^ evaluator, data.depth, data.score, data.bound, data.from, data.to);
+        board->make_move_backward(turn);
+    }
+    release_turns(board, possible_turns);
+}
+SearchInfo AI::search(Board* board, Color turn_color, int max_depth, function<void(const SearchInfo&)> report)
+{
+    SearchInfo info;
+    info.color = turn_color;
+    auto start_time = chrono::steady_clock::now();
+    search_start = start_time;
+    limit_hit = false;
+    nodes = 0;
+    long last_iteration_nodes = 0;
+    check_cache_params();
+    pawn_cache.reset_stats();
+    eval_cache.reset_stats();
+    stats = SearchStats();
+    STAT(long start_allocations = allocation_count);
+    board->game_history(keys);
+    uint64_t root_key = board->hash(turn_color);
+    evaluator = evaluator_key(*params, board->get_network());
+    if((cache != NULL) && (tt != NULL))
+        seed_from_cache(board, turn_color);
+    PerfSample perf_start;
+    if(perf != NULL) perf_start = perf->read();
+    for(int depth = 1; depth <= max_depth; depth++)
+    {
+        root_depth = depth;
+        long start_nodes = nodes;
+        double score = alpha_beta(board, turn_color, depth, -INF_SCORE, INF_SCORE, 0);
+        if(is_stopped()) break;
+        info.depth = depth;
+        info.score = score;
+        info.nodes = nodes;
+        info.ebf = (last_iteration_nodes > 0) ? (double)(nodes - start_nodes) / last_iteration_nodes : 0.0;
+        last_iteration_nodes = nodes - start_nodes;
+        STAT(stats.allocations = allocation_count - start_allocations);
+        info.stats = stats;
+        if(perf != NULL) info.perf = perf->read() - perf_start;
+        info.pawn_probes = pawn_cache.probes;
+        info.pawn_hits = pawn_cache.hits;
+        info.eval_probes = eval_cache.probes;
+        info.eval_hits = eval_cache.hits;
+        info.time = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time).count();
+        info.pv = "";
+        for(int i = 0; i < pv_length[0]; i++)
+            info.pv += square_name(pv_table[0][i] / 64) + square_name(pv_table[0][i] % 64) + " ";
+        if(pv_length[0] > 0)
+        {
+            info.from = pv_table[0][0] / 64;
+            info.to = pv_table[0][0] % 64;
+            if(cache != NULL)
+                cache->store(root_key ^ evaluator, depth, score_to_tt(score, 0), ExactBound, info.from, info.to);
+        }
+        if(report) report(info);
+        if((pv_length[0] == 0) || (fabs(score) >= MATE_SCORE - MAX_PLY)) break;
+    }
+    return info;
+}
+double AI::static_analyze(Board* board)
+{
+    if(board->network != NULL)
+        return board->nnue_evaluate() / 100.0;
+    //Castling rights in the hash don't tell whether a king has moved, the evaluation does
+    uint64_t eval_key = board->hash(WHITE);
+    if(board->get_white_king()->get_links() != 0) eval_key ^= zobrist.king_moved[WHITE];
+    if(board->get_black_king()->get_links() != 0) eval_key ^= zobrist.king_moved[BLACK];
+    int cached_score;
+    if(eval_cache.probe(eval_key, cached_score))
+        return cached_score / 100.0;
+    EvalTerms terms{params->values};
+    evaluate_terms(board, terms);
+    eval_cache.store(eval_key, terms.score);
+    return terms.score / 100.0;
+}
+//Mobility over squares that are neither own nor covered by enemy pawns, attacks on the enemy king zone
+//and the moved king penalty
+void AI::piece_activity(const uint64_t (&pieces)[2][6], int flags, EvalTerms& terms)
+{
+    uint64_t all[2] = {0, 0};
+    for(int type = King; type <= Pawn; type++)
+    {
+        all[WHITE] |= pieces[WHITE][type];
+        all[BLACK] |= pieces[BLACK][type];
+    }
+    uint64_t occupied = all[WHITE] | all[BLACK];
+    uint64_t safe[2] = {
+        ~all[WHITE] & ~pawns_attacks(BLACK, pieces[BLACK][Pawn]),
+        ~all[BLACK] & ~pawns_attacks(WHITE, pieces[WHITE][Pawn])
+    };
+    uint64_t king_zone[2];
+    for(int c = WHITE; c <= BLACK; c++)
+        king_zone[c] = (pieces[c][King] == 0) ? 0
+            : board_tables.king_attacks[__builtin_ctzll(pieces[c][King])] | pieces[c][King];
+    for(int c = WHITE; c <= BLACK; c++)
+    {
+        Color color = (Color)c;
+        int sign = (color == WHITE ? 1 : -1);
+        for(int type = Queen; type <= Knight; type++)
+            for(uint64_t rest = pieces[color][type]; rest != 0; rest &= rest - 1)
+            {
+                uint64_t attacks = piece_attacks((Obj)type, __builtin_ctzll(rest), occupied);
+                terms.add(QueenMobility + (type - Queen), sign * __builtin_popcountll(attacks & safe[color]));
+                terms.add(QueenZoneAttack + (type - Queen), sign * __builtin_popcountll(attacks & king_zone[reverse_color(color)]));
+            }
+    }
+    terms.add(KingMovedUncastled, ((flags & WHITE_KING_MOVED) != 0) - ((flags & BLACK_KING_MOVED) != 0));
+}
+//Handwritten evaluation; the pawn cache is bypassed when terms record coefficients
+void AI::evaluate_terms(Board* board, EvalTerms& terms)
+{
+    uint64_t pieces[2][6];
+    int flags = board->get_bitboards(pieces);
+    evaluate_terms(pieces, flags, terms);
+}
+void AI::evaluate_terms(const uint64_t (&pieces)[2][6], int flags, EvalTerms& terms)
+{
+    material(pieces, terms);
+    uint64_t pawns[2] = {pieces[WHITE][Pawn], pieces[BLACK][Pawn]};
+    uint64_t pawn_key = 0;
+    for(int c = WHITE; c <= BLACK; c++)
+        for(uint64_t rest = pawns[c]; rest != 0; rest &= rest - 1)
+            pawn_key ^= zobrist.pieces[c][Pawn][__builtin_ctzll(rest)];
+    int pawn_score;
+    if(terms.coefficients != NULL)
+        pawn_structure(pawns, terms);
+    else if(pawn_cache.probe(pawn_key, pawn_score))
+        terms.score += pawn_score;
+    else
+    {
+        EvalTerms pawn_terms{terms.weights};
+        pawn_structure(pawns, pawn_terms);
+        pawn_cache.store(pawn_key, pawn_terms.score);
+        terms.score += pawn_terms.score;
+    }
+    piece_activity(pieces, flags, terms);
+}
+//Same terms as evaluate_terms for batch positions [begin, end): material runs as flat loops over
+//the arrays, the rest per position; scores are centipawns
+void AI::evaluate_batch(const PositionBatch& batch, size_t begin, size_t end, int32_t* scores)
+{
+    size_t count = end - begin;
+    for(size_t i = 0; i < count; i++)
+        scores[i] = 0;
+    for(int type = Queen; type <= Pawn; type++)
+    {
+        int weight = params->values[QueenValue + (type - Queen)];
+        const uint64_t* white = batch.pieces[WHITE][type].data() + begin;
+        const uint64_t* black = batch.pieces[BLACK][type].data() + begin;
+        for(size_t i = 0; i < count; i++)
+            scores[i] += weight * (__builtin_popcountll(white[i]) - __builtin_popcountll(black[i]));
+    }
+    int bishop_pair = params->values[BishopPair];
+    const uint64_t* white_bishops = batch.pieces[WHITE][Bishop].data() + begin;
+    const uint64_t* black_bishops = batch.pieces[BLACK][Bishop].data() + begin;
+    for(size_t i = 0; i < count; i++)
+        scores[i] += bishop_pair * ((__builtin_popcountll(white_bishops[i]) == 2) - (__builtin_popcountll(black_bishops[i]) == 2));
+    uint64_t pieces[2][6];
+    for(size_t i = 0; i < count; i++)
+    {
+        EvalTerms terms{params->values};
+        batch.get(begin + i, pieces);
+        uint64_t pawns[2] = {pieces[WHITE][Pawn], pieces[BLACK][Pawn]};
+        pawn_structure(pawns, terms);
+        piece_activity(pieces, batch.flags[begin + i], terms);
+        scores[i] += terms.score;
+    }
+}
+
+
+uint64_t MateSolver::node_key(Board* board, Color side, int depth)
+{
+    return board->hash(side) ^ (0x9E3779B97F4A7C15ULL * (depth + 1));
+}
+//depth is the number of plies left; the defender has to be mated when it reaches 0
+void MateSolver::mid(Board* board, Color side, int depth, uint32_t thpn, uint32_t thdn, uint32_t& pn, uint32_t& dn)
+{
+    nodes++;
+    uint64_t key = node_key(board, side, depth);
+    bool or_node = (side == attacker);
+    vector<Turn*> possible_turns;
+    ai.generate_turns(board, side, possible_turns);
+    if((possible_turns.size() == 0) || (depth == 0))
+    {
+        bool mated = false;
+        if(possible_turns.size() == 0)
+        {
+            mated = !or_node && (board->check_chess_check(side) != NULL);
+            board->double_check = false;
+        }
+        pn = (mated ? 0 : INF_PN);
+        dn = (mated ? INF_PN : 0);
+        store(key, pn, dn);
+        ai.release_turns(board, possible_turns);
+        return;
+    }
+    vector<uint64_t> keys;
+    for(auto turn : possible_turns)
+    {
+        board->make_move_forward(turn);
+        keys.push_back(node_key(board, reverse_color(side), depth - 1));
+        board->make_move_backward(turn);
+    }
+    while(true)
+    {
+        //OR node: pn is the minimum and dn the sum over children, AND node the other way round
+        uint32_t best = INF_PN, second = INF_PN, best_other = 0;
+        uint64_t sum = 0;
+        int best_index = 0;
+        for(int i = 0; i < (int)keys.size(); i++)
+        {
+            uint32_t child_pn, child_dn;
+            lookup(keys[i], child_pn, child_dn);
+            uint32_t value = (or_node ? child_pn : child_dn);
+            uint32_t other = (or_node ? child_dn : child_pn);
+            sum = min<uint64_t>(INF_PN, sum + other);
+            if(value < best)
+            {
+                second = best;
+                best = value;
+                best_other = other;
+                best_index = i;
+            }
+            else if(value < second)
+                second = value;
+        }
+        pn = (or_node ? best : (uint32_t)sum);
+        dn = (or_node ? (uint32_t)sum : best);
+        if((pn >= thpn) || (dn >= thdn) || (nodes >= max_nodes))
+            break;
+        uint32_t child_thpn, child_thdn;
+        if(or_node)
+        {
+            child_thpn = min(thpn, second + 1);
+            child_thdn = (uint32_t)min<uint64_t>(INF_PN, (uint64_t)thdn - dn + best_other);
+        }
+        else
+        {
+            child_thdn = min(thdn, second + 1);
+            child_thpn = (uint32_t)min<uint64_t>(INF_PN, (uint64_t)thpn - pn + best_other);
+        }
+        uint32_t child_pn, child_dn;
+        board->make_move_forward(possible_turns[best_index]);
+        mid(board, reverse_color(side), depth - 1, child_thpn, child_thdn, child_pn, child_dn);
+        board->make_move_backward(possible_turns[best_index]);
+    }
+    store(key, pn, dn);
+    ai.release_turns(board, possible_turns);
+}
+//Follows proven children; entries pushed out of the table are proven again
+bool MateSolver::extract_line(Board* board, Color side, int depth, string& line)
+{
+    vector<Turn*> possible_turns;
+    ai.generate_turns(board, side, possible_turns);
+    bool found = (possible_turns.size() == 0);
+    for(auto turn : possible_turns)
+    {
+        string name = square_name(turn->get_from_square()) + square_name(turn->get_to_square()) + " ";
+        board->make_move_forward(turn);
+        uint32_t pn, dn;
+        lookup(node_key(board, reverse_color(side), depth - 1), pn, dn);
+        if(pn != 0)
+            mid(board, reverse_color(side), depth - 1, INF_PN, INF_PN, pn, dn);
+        if(pn == 0)
+        {
+            line += name;
+            found = extract_line(board, reverse_color(side), depth - 1, line);
+        }
+        board->make_move_backward(turn);
+        if((pn == 0) || (nodes >= max_nodes)) break;
+    }
+    ai.release_turns(board, possible_turns);
+    return found;
+}
+MateResult MateSolver::solve(Board* board, Color _attacker, int moves, int& mate_in, string& line)
+{
+    attacker = _attacker;
+    nodes = 0;
+    uint32_t pn, dn;
+    for(mate_in = 1; mate_in <= moves; mate_in++)
+    {
+        mid(board, attacker, 2 * mate_in - 1, INF_PN, INF_PN, pn, dn);
+        if(pn == 0)
+        {
+            line = "";
+            return (extract_line(board, attacker, 2 * mate_in - 1, line) ? MateFound : MateUnknown);
+        }
+        if(dn != 0) return MateUnknown;
+    }
+    return NoMate;
+}
+//Retrograde bitbase generation on plain square indices, positions are described in the Bitbases comment
+class BitbaseGenerator
+{
+    enum Result {Unknown, Win, Invalid};
+
+    struct Position
+    {
+        int wk;
+        int bk;
+        int pieces[2];
+    };
+
+    vector<Obj> pieces;
+    size_t size;
+    vector<atomic<uint8_t>> result[2];
+    int threads_count;
+
+    Position decode(size_t index) const
+    {
+        Position pos;
+        pos.wk = index & 63;
+        pos.bk = (index >> 6) & 63;
+        for(int i = 0; i < (int)pieces.size(); i++)
+            pos.pieces[i] = (index >> (12 + 6 * i)) & 63;
+        return pos;
+    }
+    size_t encode(const Position& pos) const
+    {
+        size_t index = pos.wk | (pos.bk << 6);
+        for(int i = 0; i < (int)pieces.size(); i++)
+            index |= (size_t)pos.pieces[i] << (12 + 6 * i);
+        return index;
+    }
+    uint64_t occupancy(const Position& pos) const
+    {
+        uint64_t occupied = (1ULL << pos.wk) | (1ULL << pos.bk);
+        for(int i = 0; i < (int)pieces.size(); i++)
+            occupied |= 1ULL << pos.pieces[i];
+        return occupied;
+    }
+    static bool is_near(int a, int b)
+    {
+        return board_tables.distance[a][b] <= 1;
+    }
+    //Squares reachable by a piece; occupied squares end a ray and are included
+    static int targets(Obj type, int from, uint64_t occupied, int* squares)
+    {
+        static const int king_d[8][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}, {1, 1}, {1, -1}, {-1, 1}, {-1, -1}};
+        static const int knight_d[8][2] = {{1, 2}, {2, 1}, {2, -1}, {1, -2}, {-1, -2}, {-2, -1}, {-2, 1}, {-1, 2}};
+        int count = 0;
+        int x = from % 8;
+        int y = from / 8;
+        if((type == King) || (type == Knight))
+        {
+            const int (*d)[2] = (type == King ? king_d : knight_d);
+            for(int i = 0; i < 8; i++)
+                if((x + d[i][0] >= 0) && (x + d[i][0] < 8) && (y + d[i][1] >= 0) && (y + d[i][1] < 8))
+                    squares[count++] = (y + d[i][1]) * 8 + x + d[i][0];
+            return count;
+        }
+        int first = (type == Bishop ? 4 : 0);
+        int last = (type == Rook ? 4 : 8);
+        for(int i = first; i < last; i++)
+        {
+            int nx = x + king_d[i][0];
+            int ny = y + king_d[i][1];
+            while((nx >= 0) && (nx < 8) && (ny >= 0) && (ny < 8))
+            {
+                squares[count++] = ny * 8 + nx;
+                if(occupied & (1ULL << (ny * 8 + nx))) break;
+                nx += king_d[i][0];
+                ny += king_d[i][1];
+            }
+        }
+        return count;
+    }
+    bool attacks(Obj type, int from, int to, uint64_t occupied) const
+    {
+        int squares[28];
+        int count = targets(type, from, occupied, squares);
+        for(int i = 0; i < count; i++)
+            if(squares[i] == to) return true;
+        return false;
+    }
+    //Attacks of white pieces on sq, the piece standing on skip (if any) is being captured
+    bool white_attacks(const Position& pos, int sq, uint64_t occupied, int skip = -1) const
+    {
+        if(is_near(pos.wk, sq)) return true;
+        for(int i = 0; i < (int)pieces.size(); i++)
+            if((pos.pieces[i] != skip) && attacks(pieces[i], pos.pieces[i], sq, occupied))
+                return true;
+        return false;
+    }
+    bool is_valid(const Position& pos, int side) const
+    {
+        if(is_near(pos.wk, pos.bk)) return false;
+        uint64_t occupied = (1ULL << pos.wk) | (1ULL << pos.bk);
+        for(int i = 0; i < (int)pieces.size(); i++)
+        {
+            if(occupied & (1ULL << pos.pieces[i])) return false;
+            occupied |= 1ULL << pos.pieces[i];
+        }
+        //Black king can't stay in check with white to move
+        return (side == BLACK) || !white_attacks(pos, pos.bk, occupied);
+    }
+    //Black to move loses if every king move leads to a won position; an undefended piece can be taken for a draw
+    bool black_loses(const Position& pos) const
+    {
+        uint64_t occupied = occupancy(pos) & ~(1ULL << pos.bk);
+        int squares[8];
+        int count = targets(King, pos.bk, occupied, squares);
+        bool has_move = false;
+        for(int i = 0; i < count; i++)
+        {
+            int sq = squares[i];
+            if(is_near(pos.wk, sq)) continue;
+            if(occupied & (1ULL << sq))
+            {
+                if(!white_attacks(pos, sq, occupied, sq)) return false;
+                continue;
+            }
+            if(white_attacks(pos, sq, occupied)) continue;
+            has_move = true;
+            Position child = pos;
+            child.bk = sq;
+            if(result[WHITE][encode(child)].load(memory_order_relaxed) != Win) return false;
+        }
+        if(!has_move)
+            return white_attacks(pos, pos.bk, occupied);
+        return true;
+    }
+    bool mark_win(int side, size_t index)
+    {
+        uint8_t expected = Unknown;
+        return result[side][index].compare_exchange_strong(expected, Win, memory_order_relaxed);
+    }
+    //Positions one white move before a won black to move position are won
+    void retract_white(const Position& pos, vector<size_t>& next)
+    {
+        uint64_t occupied = occupancy(pos);
+        int squares[28];
+        for(int unit = -1; unit < (int)pieces.size(); unit++)
+        {
+            Obj type = (unit == -1 ? King : pieces[unit]);
+            int from = (unit == -1 ? pos.wk : pos.pieces[unit]);
+            int count = targets(type, from, occupied, squares);
+            for(int i = 0; i < count; i++)
+            {
+                if(occupied & (1ULL << squares[i])) continue;
+                Position pred = pos;
+                if(unit == -1)
+                    pred.wk = squares[i];
+                else
+                    pred.pieces[unit] = squares[i];
+                if(!is_valid(pred, WHITE)) continue;
+                size_t index = encode(pred);
+                if(mark_win(WHITE, index))
+                    next.push_back(index * 2 + WHITE);
+            }
+        }
+    }
+    //Positions one black king move before a won white to move position have to be checked completely
+    void retract_black(const Position& pos, vector<size_t>& next)
+    {
+        uint64_t occupied = occupancy(pos);
+        int squares[8];
+        int count = targets(King, pos.bk, occupied, squares);
+        for(int i = 0; i < count; i++)
+        {
+            if(occupied & (1ULL << squares[i])) continue;
+            Position pred = pos;
+            pred.bk = squares[i];
+            if(!is_valid(pred, BLACK)) continue;
+            size_t index = encode(pred);
+            if((result[BLACK][index].load(memory_order_relaxed) == Unknown) && black_loses(pred) && mark_win(BLACK, index))
+                next.push_back(index * 2 + BLACK);
+        }
+    }
+    template<class F>
+    void parallel_for(size_t count, F job)
+    {
+        vector<thread> workers;
+        size_t chunk = (count + threads_count - 1) / threads_count;
+        for(int t = 0; t < threads_count; t++)
+        {
+            size_t begin = min(count, t * chunk);
+            size_t end = min(count, begin + chunk);
+            workers.push_back(thread([=]() { job(t, begin, end); }));
+        }
+        for(auto& worker : workers)
+            worker.join();
+    }
+
+    public:
+    BitbaseGenerator(const vector<Obj>& _pieces, int _threads_count)
+        : pieces(_pieces), size((size_t)1 << (12 + 6 * _pieces.size())), threads_count(_threads_count)
+    {
+        result[WHITE] = vector<atomic<uint8_t>>(size);
+        result[BLACK] = vector<atomic<uint8_t>>(size);
+    }
+    //Returns the number of won positions
+    size_t generate()
+    {
+        vector<vector<size_t>> frontiers(threads_count);
+        parallel_for(size, [&](int t, size_t begin, size_t end)
+        {
+            for(size_t index = begin; index < end; index++)
+            {
+                Position pos = decode(index);
+                for(int side = WHITE; side <= BLACK; side++)
+                {
+                    if(!is_valid(pos, side))
+                        result[side][index].store(Invalid, memory_order_relaxed);
+                    else if((side == BLACK) && black_loses(pos))
+                    {
+                        result[side][index].store(Win, memory_order_relaxed);
+                        frontiers[t].push_back(index * 2 + side);
+                    }
+                    else
+                        result[side][index].store(Unknown, memory_order_relaxed);
+                }
+            }
+        });
+        vector<size_t> frontier;
+        size_t wins = 0;
+        while(true)
+        {
+            frontier.clear();
+            for(auto& part : frontiers)
+            {
+                frontier.insert(frontier.end(), part.begin(), part.end());
+                part.clear();
+            }
+            if(frontier.size() == 0) break;
+            wins += frontier.size();
+            parallel_for(frontier.size(), [&](int t, size_t begin, size_t end)
+            {
+                for(size_t i = begin; i < end; i++)
+                {
+                    Position pos = decode(frontier[i] / 2);
+                    if(frontier[i] % 2 == BLACK)
+                        retract_white(pos, frontiers[t]);
+                    else
+                        retract_black(pos, frontiers[t]);
+                }
+            });
+        }
+        return wins;
+    }
+    bool write(const string& path) const
+    {
+        vector<uint8_t> bits(size / 4, 0);
+        for(int side = WHITE; side <= BLACK; side++)
+            for(size_t index = 0; index < size; index++)
+                if(result[side][index].load(memory_order_relaxed) == Win)
+                    bits[(side * size + index) / 8] |= 1 << ((side * size + index) % 8);
+        ofstream f(path, ios::binary);
+        if(!f.is_open()) return false;
+        f.write((const char*)bits.data(), bits.size());
+        return true;
+    }
+};
+
+int generate_bitbases(const string& dir)
+{
+    mkdir(dir.c_str(), 0755);
+    int threads_count = max(1u, thread::hardware_concurrency());
+    int status = 0;
+    for(auto& material : bitbase_materials)
+    {
+        auto start_time = chrono::steady_clock::now();
+        BitbaseGenerator generator(vector<Obj>(material.pieces, material.pieces + material.count), threads_count);
+        size_t wins = generator.generate();
+        string path = dir + "/" + material.name + ".bb";
+        if(!generator.write(path))
+        {
+            cerr << "Can't write " << path << "\n";
+            status = 1;
+        }
+        cout << material.name << ": " << wins << " won positions, "
+            << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time).count() << " ms\n";
+    }
+    return status;
+}
+
+int build_book(const string& out_path, const vector<string>& paths)
+{
+    map<pair<uint64_t, uint16_t>, int> weights;
+    long games_count = 0;
+    for(auto& path : paths)
+    {
+        vector<GameRecord> games;
+        if(!read_game_collection(path, games))
+        {
+            cerr << "Can't open " << path << "\n";
+            continue;
+        }
+        for(auto& game : games)
+        {
+            Board board;
+            board.set_start_position();
+            board.load_game(game);
+            for(int i = 0; (i < board.get_turns_count()) && (i < BOOK_MAX_PLY); i++)
+            {
+                Color color = (i % 2 == 0 ? WHITE : BLACK);
+                Turn* turn = board.get_turn_at(i);
+                uint16_t move = turn->get_to_square() | (turn->get_from_square() << 6);
+                //Polyglot weighting: 2 for a win of the side to move, 1 for a draw or unknown result
+                int weight = 1;
+                if(game.result != -1.0)
+                    weight = (int)lround(2 * (color == WHITE ? game.result : 1.0 - game.result));
+                weights[{board.hash(color), move}] += weight;
+                board.step_forward();
+            }
+            games_count++;
+        }
+    }
+    vector<BookEntry> entries;
+    for(auto& i : weights)
+        if(i.second > 0)
+            entries.push_back({i.first.first, i.first.second, (uint16_t)min(i.second, 65535), 0});
+    sort(entries.begin(), entries.end(), [](const BookEntry& a, const BookEntry& b)
+    {
+        return (a.key != b.key) ? (a.key < b.key) : (a.weight > b.weight);
+    });
+    ofstream f(out_path, ios::binary);
+    if(!f.is_open())
+    {
+        cerr << "Can't write " << out_path << "\n";
+        return 1;
+    }
+    f.write((const char*)entries.data(), entries.size() * sizeof(BookEntry));
+    cout << games_count << " games, " << entries.size() << " book entries written to " << out_path << "\n";
+    return 0;
+}
+
+//Converts game files and PGN collections to a binary collection, then times a bitboard replay of it
+int pack_games(const string& out_path, const vector<string>& paths)
+{
+    ofstream out(out_path, ios::binary | ios::trunc);
+    if(!out.is_open())
+    {
+        cerr << "Can't write " << out_path << "\n";
+        return 1;
+    }
+    out.write(PACKED_GAMES_MAGIC, sizeof(PACKED_GAMES_MAGIC));
+    long text_bytes = 0, games_count = 0, truncated = 0, skipped = 0;
+    //SAN of the moves with one separator each, without move numbers, against the count and codes of the moves
+    long san_bytes = 0, code_bytes = 0;
+    for(auto& path : paths)
+    {
+        vector<GameRecord> games;
+        struct stat st;
+        if(!read_game_collection(path, games) || (stat(path.c_str(), &st) != 0))
+        {
+            cerr << "Can't open " << path << "\n";
+            continue;
+        }
+        text_bytes += st.st_size;
+        for(auto& game : games)
+        {
+            Board board;
+            board.set_network(NULL);
+            board.set_start_position();
+            board.load_game(game);
+            GameRecord packed;
+            for(int i = 0; i < 10; i++)
+                packed.info[i] = game.info[i];
+            packed.result = game.result;
+            board.get_packed_moves(packed.moves);
+            string record, codes;
+            if(!pack_game(packed, record) || !pack_moves(packed.moves, codes))
+            {
+                skipped++;
+                continue;
+            }
+            if(game.moves.empty() && (packed.moves.size() != game.notation.size()))
+                truncated++;
+            for(auto& move : game.notation)
+                san_bytes += move.size() + 1;
+            code_bytes += codes.size();
+            out.write(record.data(), record.size());
+            games_count++;
+        }
+    }
+    out.close();
+    if(!out)
+    {
+        cerr << "Can't write " << out_path << "\n";
+        return 1;
+    }
+    PackedGames packed;
+    if(!packed.open(out_path))
+    {
+        cerr << "Can't open " << out_path << "\n";
+        return 1;
+    }
+    long plies = 0;
+    uint64_t checksum = 0;
+    auto start_time = chrono::steady_clock::now();
+    for(size_t i = 0; i < packed.size(); i++)
+    {
+        PackedGame game;
+        if(!packed.get(i, game)) continue;
+        Position position = start_position();
+        const uint8_t* cur = game.moves;
+        uint16_t move;
+        for(size_t m = 0; (m < game.count) && replay_packed_move(position, cur, game.end, move); m++)
+        {
+            checksum ^= position.key;
+            plies++;
+        }
+    }
+    double seconds = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start_time).count() / 1e6;
+    printf("%ld games, %ld plies: %ld text bytes -> %zu bytes (%.1fx smaller, %.1f bytes per game)\n", games_count, plies,
+        text_bytes, packed.get_bytes(), (double)text_bytes / max(packed.get_bytes(), (size_t)1), (double)packed.get_bytes() / max(games_count, 1L));
+    printf("Moves only: %ld SAN bytes -> %ld bytes (%.1fx smaller, %.2f bytes per ply)\n", san_bytes, code_bytes,
+        (double)san_bytes / max(code_bytes, 1L), (double)code_bytes / max(plies, 1L));
+    printf("Replay: %.0f plies/s, key checksum %016llx\n", plies / max(seconds, 1e-9), (unsigned long long)checksum);
+    if(truncated > 0)
+        printf("%ld games stopped at a move that could not be read\n", truncated);
+    if(skipped > 0)
+        printf("%ld games skipped: a move could not be coded\n", skipped);
+    return 0;
+}
+
+//Position index: which games reached a position and what was played there. File layout (little endian):
+//IndexHeader, the source table (uint32 games, uint32 path length and the path per collection), then the
+//postings sorted by key, game and ply, then the move statistics sorted by key and move. Game ids count
+//the games of all sources in order.
+const char POSITION_INDEX_MAGIC[8] = {'C', 'H', 'S', 'I', 'N', 'D', 'X', '1'};
+const int INDEX_NO_MOVE = 4095;
+const size_t INDEX_CHUNK = 1024;
+//Postings read at a time from each sorted run while merging
+const size_t INDEX_RUN_BUFFER = 4096;
+
+struct IndexHeader
+{
+    char magic[8];
+    uint64_t postings;
+    uint64_t stats;
+    uint64_t postings_offset;
+    uint64_t stats_offset;
+    uint32_t sources;
+    uint32_t games;
+};
+
+struct IndexPosting
+{
+    uint64_t key;
+    uint32_t game;
+    uint16_t ply;
+    //Move played from the position as from | to << 6 (INDEX_NO_MOVE after the last one) | result << 12
+    uint16_t move;
+};
+
+//Games that played the move from the position, each counted once; results use the binary collection codes
+struct IndexMoveStats
+{
+    uint64_t key;
+    uint16_t move;
+    uint16_t reserved;
+    uint32_t games;
+    uint32_t results[4];
+};
+static_assert((sizeof(IndexPosting) == 16) && (sizeof(IndexMoveStats) == 32), "Index records are written as they are");
+
+class PositionIndex
+{
+    const uint8_t* data = NULL;
+    size_t bytes = 0;
+    const IndexPosting* postings = NULL;
+    const IndexMoveStats* stats = NULL;
+    size_t postings_count = 0;
+    size_t stats_count = 0;
+    vector<pair<string, uint32_t>> sources;
+
+    public:
+    PositionIndex(const string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd == -1) return;
+        struct stat st;
+        if((fstat(fd, &st) == 0) && (st.st_size >= (off_t)sizeof(IndexHeader)))
+        {
+            void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(mapped != MAP_FAILED)
+            {
+                data = (const uint8_t*)mapped;
+                bytes = st.st_size;
+            }
+        }
+        close(fd);
+        if(data == NULL) return;
+        const IndexHeader* header = (const IndexHeader*)data;
+        if((memcmp(header->magic, POSITION_INDEX_MAGIC, sizeof(header->magic)) != 0)
+            || (header->postings_offset + header->postings * sizeof(IndexPosting) > bytes)
+            || (header->stats_offset + header->stats * sizeof(IndexMoveStats) > bytes))
+            return;
+        const uint8_t* cur = data + sizeof(IndexHeader);
+        for(uint32_t i = 0; i < header->sources; i++)
+        {
+            uint32_t games, length;
+            if(cur + 8 > data + header->postings_offset) return;
+            memcpy(&games, cur, 4);
+            memcpy(&length, cur + 4, 4);
+            cur += 8;
+            if(cur + length > data + header->postings_offset) return;
+            sources.push_back({string((const char*)cur, length), games});
+            cur += length;
+        }
+        postings = (const IndexPosting*)(data + header->postings_offset);
+        stats = (const IndexMoveStats*)(data + header->stats_offset);
+        postings_count = header->postings;
+        stats_count = header->stats;
+    }
+    bool is_open() const { return postings != NULL; }
+    //Postings of the position, sorted by game and ply
+    pair<const IndexPosting*, const IndexPosting*> find(uint64_t key) const
+    {
+        const IndexPosting* begin = lower_bound(postings, postings + postings_count, key,
+            [](const IndexPosting& p, uint64_t k) { return p.key < k; });
+        const IndexPosting* end = begin;
+        while((end != postings + postings_count) && (end->key == key))
+            end++;
+        return {begin, end};
+    }
+    pair<const IndexMoveStats*, const IndexMoveStats*> move_stats(uint64_t key) const
+    {
+        const IndexMoveStats* begin = lower_bound(stats, stats + stats_count, key,
+            [](const IndexMoveStats& s, uint64_t k) { return s.key < k; });
+        const IndexMoveStats* end = begin;
+        while((end != stats + stats_count) && (end->key == key))
+            end++;
+        return {begin, end};
+    }
+    //Collection of the game id and the game's number in it, from 1
+    string game_source(uint32_t game, uint32_t& number) const
+    {
+        for(auto& source : sources)
+        {
+            if(game < source.second)
+            {
+                number = game + 1;
+                return source.first;
+            }
+            game -= source.second;
+        }
+        number = 0;
+        return "";
+    }
+    ~PositionIndex()
+    {
+        if(data != NULL)
+            munmap((void*)data, bytes);
+    }
+};
+
+PositionIndex& position_index()
+{
+    static PositionIndex index(getenv("CHESS_INDEX") != NULL ? getenv("CHESS_INDEX") : "games.idx");
+    return index;
+}
+
+//Explorer rows: how many games reached the position, then the most played moves with their results
+vector<string> explorer_lines(const PositionIndex& index, uint64_t key, size_t max_moves)
+{
+    vector<string> lines;
+    if(!index.is_open())
+    {
+        lines.push_back("No position index");
+        return lines;
+    }
+    auto found = index.find(key);
+    long games = 0;
+    for(const IndexPosting* p = found.first; p != found.second; p++)
+        if((p == found.first) || (p->game != (p - 1)->game))
+            games++;
+    lines.push_back("Explorer: " + to_string(games) + " games");
+    auto range = index.move_stats(key);
+    vector<const IndexMoveStats*> moves;
+    for(const IndexMoveStats* s = range.first; s != range.second; s++)
+        moves.push_back(s);
+    sort(moves.begin(), moves.end(), [](const IndexMoveStats* a, const IndexMoveStats* b) { return a->games > b->games; });
+    for(size_t i = 0; (i < moves.size()) && (i < max_moves); i++)
+    {
+        const IndexMoveStats* s = moves[i];
+        char buf[96];
+        snprintf(buf, sizeof(buf), "%s%s %6u  1-0 %3.0f%%  = %3.0f%%  0-1 %3.0f%%", square_name(s->move & 63).c_str(),
+            square_name(s->move >> 6).c_str(), s->games, 100.0 * s->results[2] / s->games,
+            100.0 * s->results[1] / s->games, 100.0 * s->results[0] / s->games);
+        lines.push_back(buf);
+    }
+    return lines;
+}
+
+//Fills the side panel from the index for the displayed position
+void Board::show_explorer()
+{
+    vector<string> lines = explorer_lines(position_index(), hash(((turn + 1) % 2 == 0) ? WHITE : BLACK), 8);
+    lock_guard<mutex> lock(analysis_mutex);
+    for(size_t i = 0; i < sizeof(side_panel) / sizeof(side_panel[0]); i++)
+        side_panel[i] = (i < lines.size()) ? lines[i] : "";
+}
+
+bool index_posting_less(const IndexPosting& x, const IndexPosting& y)
+{
+    return (x.key != y.key) ? (x.key < y.key) : (x.game != y.game) ? (x.game < y.game) : (x.ply < y.ply);
+}
 
-        return true;
-    }
-    Object* get_white_king() { return white_king; }
-    Object* get_black_king() { return black_king; }
-    void create_notation_turns_table()
+//Postings of a chunk of games, in game order
+vector<IndexPosting> index_postings(const PackedGames* packed, const vector<GameRecord>* records, size_t begin, size_t end, uint32_t first)
+{
+    vector<IndexPosting> postings;
+    vector<uint16_t> moves;
+    for(size_t i = begin; i < end; i++)
     {
-        int first_c;
-        int new_x, new_y;
-        Object* obj_from;
-        Object* obj_to;
-        Color color;
-        Obj type;
-        int pos;
-        int size;
-        int x_hint;
-        int y_hint;
-        bool extra;
-        for(int i = 0; i < notation_turns.size(); i++)
+        uint32_t game = first + (i - begin);
+        Position position = start_position();
+        int result;
+        uint16_t ply = 0;
+        if(packed != NULL)
         {
-            color = (i % 2 == 0 ? WHITE : BLACK);
-            if((notation_turns[i] == "O-O") || (notation_turns[i] == "O-O-O"))
+            PackedGame packed_game;
+            if(!packed->get(i, packed_game)) continue;
+            result = packed_game.result;
+            const uint8_t* cur = packed_game.moves;
+            uint16_t move;
+            for(size_t m = 0; m < packed_game.count; m++, ply++)
             {
-                int yy = (color == WHITE ? 0 : 7);
-                int xx = (notation_turns[i] == "O-O" ? 6 : 2);
-                obj_from = this->get(4, yy);
-                obj_to = this->get(xx, yy);
-                if((obj_from->get_type() == King) && (obj_from->get_color() == color))
-                {
-                    if(!obj_from->is_legal(obj_to, this))
-                        obj_from = NULL;
-                    else
-                    {
-                        extra = true;
-                        extra_turns.push_back(
-                            new Turn(
-                                this->get((notation_turns[i] == "O-O" ? 7 : 0), yy),
-                                this->get((notation_turns[i] == "O-O" ? 5 : 3), yy)
-                            )
-                        );
-                    }
-                }
-                else obj_from = NULL;
+                uint64_t key = position.key;
+                if(!replay_packed_move(position, cur, packed_game.end, move)) break;
+                postings.push_back({key, game, ply, (uint16_t)(move | (result << 12))});
             }
-            else
+        }
+        else
+        {
+            const GameRecord& record = (*records)[i];
+            result = (record.result < 0) ? 3 : (int)lround(record.result * 2);
+            Board board;
+            board.set_network(NULL);
+            board.set_start_position();
+            board.load_game(record);
+            board.get_packed_moves(moves);
+            for(auto move : moves)
             {
-                x_hint=y_hint=-1;
-                size = notation_turns[i].size();
-                pos = 0;
-                first_c = notation_turns[i].at(pos++);
-                if(first_c == 'R')
-                    type = Rook;
-                else if(first_c == 'N')
-                    type = Knight;
-                else if(first_c == 'B')
-                    type = Bishop;
-                else if(first_c == 'Q')
-                    type = Queen;
-                else if(first_c == 'K')
-                    type = King;
-                else
-                {
-                    type = Pawn;
-                    pos = 0;
-                }
-                if(size >= 4)
-                {
-                    if(isdigit(notation_turns[i].at(pos)))
-                        y_hint = notation_turns[i].at(pos++) - '0' - 1;
-                    else
-                        x_hint = is_in(notation_turns[i].at(pos++), low_alphabet);
-                }
-                if(notation_turns[i].at(pos) == 'x') pos++;
-                new_x = is_in(notation_turns[i].at(pos++), low_alphabet);
-                new_y = notation_turns[i].at(pos++) - '0' - 1;
-                obj_to = this->get(new_x, new_y);
-                obj_from = this->is_hitted(obj_to, color, type, x_hint, y_hint);
+                postings.push_back({position.key, game, ply++, (uint16_t)(move | (result << 12))});
+                apply_packed_move(position, move);
             }
-            if(obj_from == NULL)
+        }
+        postings.push_back({position.key, game, ply, (uint16_t)(INDEX_NO_MOVE | (result << 12))});
+    }
+    return postings;
+}
+
+bool write_all(int fd, const void* data, size_t bytes, uint64_t offset)
+{
+    const char* cur = (const char*)data;
+    while(bytes > 0)
+    {
+        ssize_t count = pwrite(fd, cur, bytes, offset);
+        if(count <= 0)
+            return false;
+        cur += count;
+        bytes -= count;
+        offset += count;
+    }
+    return true;
+}
+
+//Replays every game of the collections on a thread pool and writes the sorted postings and move statistics.
+//Text collections are read a chunk of games at a time, and each chunk's postings go sorted to a temporary
+//file next to the index as a run, so memory holds only the chunks in flight and a buffer per run while the
+//runs are merged into the index.
+int build_position_index(const string& out_path, const vector<string>& paths)
+{
+    struct Source
+    {
+        string path;
+        PackedGames packed;
+        uint32_t games = 0;
+    };
+    //Place in the run file and postings left to merge
+    struct Run
+    {
+        uint64_t offset;
+        uint64_t count;
+        vector<IndexPosting> buffer;
+        size_t pos;
+    };
+    auto start_time = chrono::steady_clock::now();
+    string runs_path = out_path + ".runs.XXXXXX";
+    int runs_fd = mkstemp(&runs_path[0]);
+    if(runs_fd == -1)
+    {
+        cerr << "Can't write " << runs_path << "\n";
+        return 1;
+    }
+    //The runs disappear with the process, whatever way it ends
+    unlink(runs_path.c_str());
+    ThreadPool pool(max(1u, thread::hardware_concurrency()));
+    size_t window = pool.size() * 2;
+    deque<Source> sources;
+    vector<Run> runs;
+    deque<future<Run>> chunks;
+    atomic<uint64_t> runs_end{0};
+    atomic<bool> failed{false};
+    uint32_t games_count = 0;
+    auto submit = [&](const PackedGames* packed, shared_ptr<vector<GameRecord>> records, size_t begin, size_t end)
+    {
+        while(chunks.size() >= window)
+        {
+            runs.push_back(chunks.front().get());
+            chunks.pop_front();
+        }
+        uint32_t first = games_count;
+        games_count += end - begin;
+        chunks.push_back(pool.submit([&runs_end, &failed, runs_fd, packed, records, begin, end, first]()
+        {
+            vector<IndexPosting> postings = index_postings(packed, records.get(), begin, end, first);
+            sort(postings.begin(), postings.end(), index_posting_less);
+            uint64_t bytes = postings.size() * sizeof(IndexPosting);
+            uint64_t offset = runs_end.fetch_add(bytes);
+            if(!write_all(runs_fd, postings.data(), bytes, offset))
+                failed = true;
+            return Run{offset, postings.size(), {}, 0};
+        }));
+    };
+    for(auto& path : paths)
+    {
+        sources.emplace_back();
+        Source& source = sources.back();
+        source.path = path;
+        if(has_extension(path, ".cgb"))
+        {
+            if(!source.packed.open(path))
             {
-                cout << "\nIncorrect Notation!" << "\n";
-                return;
+                cerr << "Can't open " << path << "\n";
+                sources.pop_back();
+                continue;
             }
-            turns.push_back(new Turn(obj_from, obj_to));
-            turn++;
-            if(extra)
+            source.games = source.packed.size();
+            for(size_t begin = 0; begin < source.packed.size(); begin += INDEX_CHUNK)
+                submit(&source.packed, NULL, begin, min(begin + INDEX_CHUNK, source.packed.size()));
+            continue;
+        }
+        GameReader reader(path);
+        if(!reader.is_open())
+        {
+            cerr << "Can't open " << path << "\n";
+            sources.pop_back();
+            continue;
+        }
+        bool more = true;
+        while(more)
+        {
+            auto records = make_shared<vector<GameRecord>>();
+            GameRecord game;
+            while((records->size() < INDEX_CHUNK) && (more = reader.next(game)))
+                records->push_back(move(game));
+            source.games += records->size();
+            if(!records->empty())
+                submit(NULL, records, 0, records->size());
+        }
+    }
+    for(auto& chunk : chunks)
+        runs.push_back(chunk.get());
+    chunks.clear();
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, POSITION_INDEX_MAGIC, sizeof(header.magic));
+    string table;
+    for(auto& source : sources)
+    {
+        uint32_t length = source.path.size();
+        table.append((const char*)&source.games, 4);
+        table.append((const char*)&length, 4);
+        table += source.path;
+    }
+    table.resize((table.size() + 7) & ~(size_t)7, '\0');
+    for(auto& run : runs)
+        header.postings += run.count;
+    header.postings_offset = sizeof(header) + table.size();
+    header.stats_offset = header.postings_offset + header.postings * sizeof(IndexPosting);
+    header.sources = sources.size();
+    header.games = games_count;
+    int fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(failed || (fd == -1) || !write_all(fd, table.data(), table.size(), sizeof(header)))
+    {
+        cerr << "Can't write " << (failed ? runs_path : out_path) << "\n";
+        if(fd != -1) close(fd);
+        close(runs_fd);
+        return 1;
+    }
+
+    //k-way merge: a heap of the runs by their next posting
+    auto next_posting = [&](Run& run) -> bool
+    {
+        if(run.pos == run.buffer.size())
+        {
+            if(run.count == 0)
+                return false;
+            run.buffer.resize(min<uint64_t>(run.count, INDEX_RUN_BUFFER));
+            if(pread(runs_fd, run.buffer.data(), run.buffer.size() * sizeof(IndexPosting), run.offset) != (ssize_t)(run.buffer.size() * sizeof(IndexPosting)))
             {
-                if(cur_state == EnPassant)
-                {
-                    extra_turns.push_back(
-                        new Turn(
-                            this->get(obj_to->get_x(), (obj_from->get_y())),
-                            this->get(obj_to->get_x(), (obj_from->get_y()))
-                        )
-                    );
-                    cur_state = Nothing;
-                }
-                turns.at(turn)->set_extra_index(free_extra_index++);
-                extra = false;
+                failed = true;
+                return false;
             }
-            make_move_forward(turns.at(turn));
+            run.offset += run.buffer.size() * sizeof(IndexPosting);
+            run.count -= run.buffer.size();
+            run.pos = 0;
         }
-        while(turn >= 0)
-        {    
-            make_move_backward(turns.at(turn));
-            turn--; 
+        return true;
+    };
+    auto heap_order = [&](size_t a, size_t b) { return index_posting_less(runs[b].buffer[runs[b].pos], runs[a].buffer[runs[a].pos]); };
+    vector<size_t> heap;
+    for(size_t r = 0; r < runs.size(); r++)
+        if(next_posting(runs[r]))
+            heap.push_back(r);
+    make_heap(heap.begin(), heap.end(), heap_order);
+    vector<IndexPosting> out_postings;
+    vector<IndexMoveStats> out_stats;
+    uint64_t postings_offset = header.postings_offset, stats_offset = header.stats_offset;
+    auto flush = [&](bool all)
+    {
+        if(all || (out_postings.size() >= INDEX_RUN_BUFFER))
+        {
+            if(!write_all(fd, out_postings.data(), out_postings.size() * sizeof(IndexPosting), postings_offset))
+                failed = true;
+            postings_offset += out_postings.size() * sizeof(IndexPosting);
+            out_postings.clear();
+        }
+        if(all || (out_stats.size() >= INDEX_RUN_BUFFER))
+        {
+            if(!write_all(fd, out_stats.data(), out_stats.size() * sizeof(IndexMoveStats), stats_offset))
+                failed = true;
+            stats_offset += out_stats.size() * sizeof(IndexMoveStats);
+            header.stats += out_stats.size();
+            out_stats.clear();
+        }
+    };
+    //Move << 2 | result -> games of the position being merged; moves the current game already played from it
+    map<uint16_t, uint32_t> played;
+    vector<uint16_t> game_moves;
+    IndexPosting last = {0, 0, 0, 0};
+    bool merged = false;
+    auto add_stats = [&](uint64_t key)
+    {
+        for(auto& move : played)
+        {
+            if(out_stats.empty() || (out_stats.back().key != key) || (out_stats.back().move != (move.first >> 2)))
+                out_stats.push_back({key, (uint16_t)(move.first >> 2), 0, 0, {0, 0, 0, 0}});
+            out_stats.back().games += move.second;
+            out_stats.back().results[move.first & 3] += move.second;
         }
+        played.clear();
+        flush(false);
+    };
+    while(!heap.empty() && !failed)
+    {
+        pop_heap(heap.begin(), heap.end(), heap_order);
+        Run& run = runs[heap.back()];
+        IndexPosting posting = run.buffer[run.pos++];
+        if(next_posting(run))
+            push_heap(heap.begin(), heap.end(), heap_order);
+        else
+            heap.pop_back();
+        if(merged && (last.key != posting.key))
+            add_stats(last.key);
+        if(!merged || (last.key != posting.key) || (last.game != posting.game))
+            game_moves.clear();
+        //A game that came back to the position with the same move counts once
+        uint16_t move = ((posting.move & INDEX_NO_MOVE) << 2) | (posting.move >> 12);
+        if(((posting.move & INDEX_NO_MOVE) != INDEX_NO_MOVE) && (find(game_moves.begin(), game_moves.end(), move) == game_moves.end()))
+        {
+            game_moves.push_back(move);
+            played[move]++;
+        }
+        out_postings.push_back(posting);
+        flush(false);
+        last = posting;
+        merged = true;
     }
-    void make_move_forward(Turn* cur_turn)
+    if(merged)
+        add_stats(last.key);
+    flush(true);
+    close(runs_fd);
+    if(!failed && !write_all(fd, &header, sizeof(header), 0))
+        failed = true;
+    if((close(fd) != 0) || failed)
     {
-        Object* obj_from = cur_turn->get_from();
-        Object* obj_to = cur_turn->get_to();
-        int x = obj_from->get_x();
-        int y = obj_from->get_y();
-        int new_x = obj_to->get_x();
-        int new_y = obj_to->get_y();
-        obj_from->set_x(new_x);
-        obj_from->set_y(new_y);
-        obj_to->set_x(x);
-        obj_to->set_y(y);
-        this->add_wd(obj_from);
-        this->add_wd(cur_turn->get_replace());
-        obj_from->inc_links();
-        if(cur_turn->get_extra_index() != -1)
+        cerr << "Can't write " << out_path << "\n";
+        return 1;
+    }
+    double seconds = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time).count() / 1000.0;
+    printf("%u games, %llu postings, %llu move entries in %.1f s on %d threads\n", games_count,
+        (unsigned long long)header.postings, (unsigned long long)header.stats, seconds, pool.size());
+    return 0;
+}
+
+//Explorer rows and the first games that reached the position given as FEN
+int explore_position(const string& index_path, const string& fen)
+{
+    PositionIndex index(index_path);
+    Position position;
+    if(!index.is_open())
+    {
+        cerr << "Can't open " << index_path << "\n";
+        return 1;
+    }
+    if(!parse_fen(fen, position))
+    {
+        cerr << "Invalid FEN\n";
+        return 1;
+    }
+    auto start_time = chrono::steady_clock::now();
+    vector<string> lines = explorer_lines(index, position.key, 20);
+    auto found = index.find(position.key);
+    long micros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start_time).count();
+    for(auto& line : lines)
+        cout << line << "\n";
+    int shown = 0;
+    for(const IndexPosting* p = found.first; (p != found.second) && (shown < 10); p++)
+    {
+        if((p != found.first) && (p->game == (p - 1)->game)) continue;
+        uint32_t number;
+        string source = index.game_source(p->game, number);
+        cout << source << " #" << number << " ply " << p->ply << "\n";
+        shown++;
+    }
+    cout << "Query " << micros << " us\n";
+    return 0;
+}
+
+int solve_mate(int moves, const string& path, long max_nodes)
+{
+    GameRecord game;
+    if(!read_game_file(path, game))
+    {
+        cerr << "Can't open " << path << "\n";
+        return 1;
+    }
+    Board board;
+    board.set_start_position();
+    board.load_notation(game.notation);
+    while(board.get_turn() + 1 < board.get_turns_count())
+        board.step_forward();
+    MateSolver solver(max_nodes);
+    int mate_in;
+    string line;
+    auto start_time = chrono::steady_clock::now();
+    MateResult result = solver.solve(&board, ((board.get_turn() + 1) % 2 == 0 ? WHITE : BLACK), moves, mate_in, line);
+    long time = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time).count();
+    if(result == MateFound)
+        cout << "Mate in " << mate_in << ": " << line << "\n";
+    else if(result == NoMate)
+        cout << "No mate in " << moves << "\n";
+    else
+        cout << "Unknown, node limit reached" << "\n";
+    cout << solver.get_nodes() << " nodes, " << time << " ms" << "\n";
+    return (result == MateUnknown ? 2 : 0);
+}
+
+//Iterative deepening on the position after the last move: UCI info per iteration, JSON lines appended to the log
+int run_search(const string& path, int depth, const string& log_path)
+{
+    GameRecord game;
+    if(!read_game_file(path, game))
+    {
+        cerr << "Can't open " << path << "\n";
+        return 1;
+    }
+    ofstream log;
+    if(log_path != "")
+    {
+        log.open(log_path, ios::app);
+        if(!log.is_open())
         {
-            make_move_forward(extra_turns.at(cur_turn->get_extra_index()));
-            if(obj_from->get_color() == WHITE)
-                white_castling = true;
-            else
-                black_castling = true;
+            cerr << "Can't write " << log_path << "\n";
+            return 1;
+        }
+    }
+    Board board;
+    board.set_start_position();
+    board.load_notation(game.notation);
+    while(board.get_turn() + 1 < board.get_turns_count())
+        board.step_forward();
+    TranspositionTable tt;
+    AI ai;
+    PerfCounters counters;
+    ai.set_tt(&tt);
+    ai.set_cache(&analysis_cache());
+    ai.set_perf(&counters);
+    SearchInfo info = ai.search(&board, ((board.get_turn() + 1) % 2 == 0 ? WHITE : BLACK), depth, [&](const SearchInfo& iteration)
+    {
+        cout << uci_info(iteration) << endl;
+        if(log.is_open())
+            log << search_info_json(iteration) << "\n";
+    });
+    cout << "bestmove " << ((info.from == -1) ? "0000" : square_name(info.from) + square_name(info.to)) << "\n";
+    return 0;
+}
+
+//Labeled positions for tuning: sparse coefficient rows and white-perspective game results
+struct TuningSet
+{
+    vector<size_t> offsets{0};
+    vector<uint8_t> params;
+    vector<int16_t> counts;
+    vector<float> results;
+
+    size_t size() const { return results.size(); }
+    void add(const int* coefficients, double result)
+    {
+        for(int param = 0; param < EVAL_PARAMS_COUNT; param++)
+            if(coefficients[param] != 0)
+            {
+                params.push_back(param);
+                counts.push_back(coefficients[param]);
+            }
+        offsets.push_back(params.size());
+        results.push_back(result);
+    }
+    void append(const TuningSet& other)
+    {
+        for(size_t i = 0; i < other.size(); i++)
+        {
+            params.insert(params.end(), other.params.begin() + other.offsets[i], other.params.begin() + other.offsets[i + 1]);
+            counts.insert(counts.end(), other.counts.begin() + other.offsets[i], other.counts.begin() + other.offsets[i + 1]);
+            offsets.push_back(params.size());
+            results.push_back(other.results[i]);
         }
     }
-    void make_move_backward(Turn* cur_turn)
+};
+
+//Opening positions come from the book and say little about the evaluation
+const int TUNING_SKIP_PLIES = 8;
+const int TUNING_ITERATIONS = 500;
+const double TUNING_RATE = 1.0;
+
+void collect_tuning_positions(const vector<GameRecord>& games, size_t first, size_t step, TuningSet& set)
+{
+    AI ai;
+    int coefficients[EVAL_PARAMS_COUNT];
+    for(size_t g = first; g < games.size(); g += step)
     {
-        Object* obj_from = cur_turn->get_from();
-        Object* obj_to = cur_turn->get_to();
-        int x = obj_from->get_x();
-        int y = obj_from->get_y();
-        int new_x = obj_to->get_x();
-        int new_y = obj_to->get_y();
-        obj_from->set_x(new_x);
-        obj_from->set_y(new_y);
-        obj_to->set_x(x);
-        obj_to->set_y(y);
-        this->add_wd(obj_from);
-        this->add_wd(obj_to);
-        obj_from->dec_links();
-        if(cur_turn->get_extra_index() != -1)
+        if(games[g].result < 0) continue;
+        Board board;
+        board.set_start_position();
+        board.load_game(games[g]);
+        for(int i = 0; i < board.get_turns_count(); i++)
+        {
+            board.step_forward();
+            if(i + 1 < TUNING_SKIP_PLIES) continue;
+            memset(coefficients, 0, sizeof(coefficients));
+            EvalTerms terms{default_eval_params.values, coefficients};
+            ai.evaluate_terms(&board, terms);
+            set.add(coefficients, games[g].result);
+        }
+    }
+}
+
+//Mean squared error between results and sigmoid(k * eval); fills the gradient over weights when asked
+double tuning_error(const TuningSet& set, const vector<double>& weights, double k, vector<double>* gradient, int threads_count)
+{
+    vector<double> errors(threads_count, 0.0);
+    vector<vector<double>> gradients(threads_count, vector<double>(EVAL_PARAMS_COUNT, 0.0));
+    vector<thread> workers;
+    double scale = k * log(10.0) / 400.0;
+    for(int t = 0; t < threads_count; t++)
+        workers.push_back(thread([&, t]()
+        {
+            size_t begin = set.size() * t / threads_count;
+            size_t end = set.size() * (t + 1) / threads_count;
+            for(size_t i = begin; i < end; i++)
+            {
+                double eval = 0.0;
+                for(size_t j = set.offsets[i]; j < set.offsets[i + 1]; j++)
+                    eval += weights[set.params[j]] * set.counts[j];
+                double sigmoid = 1.0 / (1.0 + exp(-scale * eval));
+                double diff = set.results[i] - sigmoid;
+                errors[t] += diff * diff;
+                if(gradient == NULL) continue;
+                double factor = -2.0 * diff * sigmoid * (1.0 - sigmoid) * scale;
+                for(size_t j = set.offsets[i]; j < set.offsets[i + 1]; j++)
+                    gradients[t][set.params[j]] += factor * set.counts[j];
+            }
+        }));
+    for(auto& worker : workers)
+        worker.join();
+    double error = 0.0;
+    if(gradient != NULL)
+        gradient->assign(EVAL_PARAMS_COUNT, 0.0);
+    for(int t = 0; t < threads_count; t++)
+    {
+        error += errors[t];
+        if(gradient != NULL)
+            for(int param = 0; param < EVAL_PARAMS_COUNT; param++)
+                (*gradient)[param] += gradients[t][param] / set.size();
+    }
+    return error / set.size();
+}
+
+//Texel tuning: positions of finished games labeled with the result, k fitted first, then Adam over all weights
+int tune_eval(const string& out_path, const vector<string>& paths)
+{
+    vector<GameRecord> games;
+    for(auto& path : paths)
+        if(!read_game_collection(path, games))
+            cerr << "Can't open " << path << "\n";
+    int threads_count = max(1u, thread::hardware_concurrency());
+    vector<TuningSet> parts(threads_count);
+    vector<thread> workers;
+    for(int t = 0; t < threads_count; t++)
+        workers.push_back(thread(collect_tuning_positions, cref(games), t, threads_count, ref(parts[t])));
+    for(auto& worker : workers)
+        worker.join();
+    TuningSet set;
+    for(auto& part : parts)
+        set.append(part);
+    if(set.size() == 0)
+    {
+        cerr << "No positions from games with results\n";
+        return 1;
+    }
+    cout << set.size() << " positions from " << games.size() << " games, " << threads_count << " threads\n";
+
+    vector<double> weights(eval_params().values, eval_params().values + EVAL_PARAMS_COUNT);
+    double low = 0.01, high = 5.0;
+    for(int i = 0; i < 40; i++)
+    {
+        double a = low + (high - low) / 3, b = high - (high - low) / 3;
+        if(tuning_error(set, weights, a, NULL, threads_count) < tuning_error(set, weights, b, NULL, threads_count))
+            high = b;
+        else
+            low = a;
+    }
+    double k = (low + high) / 2;
+    cout << "k " << k << ", error " << tuning_error(set, weights, k, NULL, threads_count) << "\n";
+
+    vector<double> gradient, m(EVAL_PARAMS_COUNT, 0.0), v(EVAL_PARAMS_COUNT, 0.0);
+    const double beta1 = 0.9, beta2 = 0.999;
+    for(int iteration = 1; iteration <= TUNING_ITERATIONS; iteration++)
+    {
+        double error = tuning_error(set, weights, k, &gradient, threads_count);
+        for(int param = 0; param < EVAL_PARAMS_COUNT; param++)
+        {
+            m[param] = beta1 * m[param] + (1 - beta1) * gradient[param];
+            v[param] = beta2 * v[param] + (1 - beta2) * gradient[param] * gradient[param];
+            double m_hat = m[param] / (1 - pow(beta1, iteration));
+            double v_hat = v[param] / (1 - pow(beta2, iteration));
+            weights[param] -= TUNING_RATE * m_hat / (sqrt(v_hat) + 1e-12);
+        }
+        if(iteration % 50 == 0)
+            cout << "iteration " << iteration << ", error " << error << "\n";
+    }
+    EvalParams tuned;
+    for(int param = 0; param < EVAL_PARAMS_COUNT; param++)
+    {
+        tuned.values[param] = (int)lround(weights[param]);
+        weights[param] = tuned.values[param];
+    }
+    cout << "tuned error " << tuning_error(set, weights, k, NULL, threads_count) << "\n";
+    if(!write_eval_params(out_path, tuned))
+    {
+        cerr << "Can't write " << out_path << "\n";
+        return 1;
+    }
+    cout << "Parameters written to " << out_path << "\n";
+    return 0;
+}
+
+const size_t BATCH_BLOCK = 4096;
+//Every n-th packed position is also scored through static_analyze to check the batch path
+const size_t BATCH_CHECK_STEP = 97;
+
+//Scores all positions of the games with the batch evaluator and writes int32 centipawns in input order
+int batch_evaluate(const string& out_path, const vector<string>& paths)
+{
+    auto start_time = chrono::steady_clock::now();
+    vector<GameRecord> games;
+    for(auto& path : paths)
+        if(!read_game_collection(path, games))
+            cerr << "Can't open " << path << "\n";
+    PositionBatch batch;
+    vector<pair<size_t, int>> expected;
+    AI ai;
+    for(auto& game : games)
+    {
+        Board board;
+        board.set_network(NULL);
+        board.set_start_position();
+        board.load_game(game);
+        for(int i = 0; i <= board.get_turns_count(); i++)
         {
-            make_move_backward(extra_turns.at(cur_turn->get_extra_index()));
-            if(obj_from->get_color() == WHITE)
-                white_castling = false;
-            else
-                black_castling = false;
+            if(i > 0) board.step_forward();
+            if(batch.size() % BATCH_CHECK_STEP == 0)
+                expected.push_back({batch.size(), (int)lround(ai.static_analyze(&board) * 100)});
+            batch.add(board.get_position(WHITE));
         }
     }
-    void set_menu()
+    long pack_time = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time).count();
+
+    ofstream file(out_path, ios::binary);
+    if(!file.is_open())
     {
-        game_info[0] = "Domz0t's chess\n";
-        game_info[1] = "\n";
-        game_info[2] = "\n";
-        game_info[3] = "Press \"c\" to play classic chess\n";
-        game_info[4] = "Press \"l\" to load game\n";
-        game_info[5] = "Press \"f\" to flip the board\n";
-        game_info[6] = "\n";
-        game_info[7] = "\n";
-        game_info[8] = "Press \"e\" to exit\n";
+        cerr << "Can't write " << out_path << "\n";
+        return 1;
     }
-    void set_classic_chess_menu()
+    start_time = chrono::steady_clock::now();
+    ThreadPool pool(max(1u, thread::hardware_concurrency()));
+    vector<int32_t> scores(batch.size());
+    vector<future<void>> blocks;
+    for(size_t begin = 0; begin < batch.size(); begin += BATCH_BLOCK)
     {
-        game_info[0] = "Domz0t's chess\n";
-        game_info[1] = "\n";
-        game_info[2] = "\n";
-        game_info[3] = "Classic Chess\n";
-        game_info[4] = "\n";
-        game_info[5] = "\n";
-        game_info[6] = "\n";
-        game_info[7] = "Press \"b\" to back menu\n";
-        game_info[8] = "Press \"e\" to exit\n";
+        size_t end = min(begin + BATCH_BLOCK, batch.size());
+        blocks.push_back(pool.submit([&batch, &scores, begin, end]()
+        {
+            AI worker;
+            worker.evaluate_batch(batch, begin, end, scores.data() + begin);
+        }));
     }
-    void activate_start_loading()
+    //Blocks are written as soon as they and all blocks before them are done
+    for(size_t i = 0; i < blocks.size(); i++)
     {
-        Highlight hl(0, 0, (char*)"\x1b[47m");
-        Highlight hl_1(0, 0, (char*)"\x1b[42m");
-        Highlight hl_2(0, 0, (char*)"\x1b[43m");
-        Highlight hl_3(7, 0, (char*)"\x1b[44m");
-        Highlight hl_4(0, 7, (char*)"\x1b[45m");
-        Highlight hl_5(0, 0, (char*)"\x1b[46m");
-        Highlight hl_6(7, 7, (char*)"\x1b[41m");
-        Highlight hl_7(0, 0, (char*)"\x1b[40m");
-        this->add_highliter(&hl);
-        this->add_highliter(&hl_1);
-        this->add_highliter(&hl_2);
-        this->add_highliter(&hl_3);
-        this->add_highliter(&hl_4);
-        this->add_highliter(&hl_5);
-        this->add_highliter(&hl_6);
-        this->add_highliter(&hl_7);
-        for(int i = 0; i < height; i++)
+        blocks[i].get();
+        size_t begin = i * BATCH_BLOCK;
+        size_t end = min(begin + BATCH_BLOCK, batch.size());
+        file.write((const char*)(scores.data() + begin), (end - begin) * sizeof(int32_t));
+    }
+    file.close();
+    double eval_time = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start_time).count() / 1e6;
+    long mismatches = 0;
+    for(auto& check : expected)
+        if(scores[check.first] != check.second)
+            mismatches++;
+    printf("%zu positions from %zu games packed in %ld ms\n", batch.size(), games.size(), pack_time);
+    printf("evaluated in %.1f ms on %d threads, %.0f positions/s\n", eval_time * 1000, pool.size(), batch.size() / max(eval_time, 1e-9));
+    printf("%ld of %zu sampled positions differ from static_analyze\n", mismatches, expected.size());
+    return (mismatches == 0) ? 0 : 1;
+}
+
+//Fixed positions for benchmarks: start position and a few opening lines
+const char* const benchmark_games[] = {
+    "",
+    "e4 e5 Nf3 Nc6 Bb5 a6 Ba4 Nf6 O-O Be7",
+    "d4 d5 c4 e6 Nc3 Nf6 Bg5 Be7 e3 O-O Nf3 Nbd7",
+    "e4 c5 Nf3 d6 d4 cxd4 Nxd4 Nf6 Nc3 a6 Be3 e5",
+    "e4 e6 d4 d5 Nc3 Bb4 e5 c5 a3 Bxc3 bxc3 Ne7 Qg4 O-O Bd3 Nbc6",
+    "d4 Nf6 c4 g6 Nc3 Bg7 e4 d6 Nf3 O-O Be2 e5 O-O Nc6 d5 Ne7",
+    "e4 e5 Nf3 Nc6 Bc4 Bc5 c3 Nf6 d4 exd4 cxd4 Bb4 Nc3 Nxe4 O-O Bxc3 d5 Bf6 Re1 Ne7 Rxe4 d6",
+    "c4 e5 Nc3 Nf6 Nf3 Nc6 g3 d5 cxd5 Nxd5 Bg2 Nb6 O-O Be7 d3 O-O a3 Be6 b4 f6",
+    "e4 c6 d4 d5 exd5 cxd5 c4 Nf6 Nc3 e6 Nf3 Be7 cxd5 Nxd5 Bd3 Nc6 O-O O-O Re1 Bf6 Be4 Nce7 Qb3 Qb6 Qxb6 axb6",
+};
+
+//Engine setup for matches: "name=a,eval=params.txt,nnue=on,depth=6,nodes=20000,time=100" (time in ms per move)
+struct EngineConfig
+{
+    string name;
+    EvalParams params = default_eval_params;
+    bool use_network = false;
+    int depth = 0;
+    long nodes = 0;
+    long time = 0;
+};
+
+bool parse_engine_config(const string& spec, EngineConfig& config)
+{
+    config.name = spec;
+    config.params = eval_params();
+    stringstream options(spec);
+    string option;
+    while(getline(options, option, ','))
+    {
+        size_t equal = option.find('=');
+        string key = option.substr(0, equal);
+        string value = (equal == string::npos) ? "" : option.substr(equal + 1);
+        if(key == "name")
+            config.name = value;
+        else if(key == "eval")
         {
-            hl.set_x(i);
-            hl.set_y(i);
-            hl_1.set_x(height-i-1);
-            hl_1.set_y(i);
-            hl_2.set_y(i);
-            hl_3.set_y(i);
-            hl_4.set_x(i);
-            hl_5.set_x(height-i-1);
-            hl_6.set_x(height-i-1);
-            hl_7.set_x(i);
-            this->print_board();
-            usleep(100000);
+            if(!read_eval_params(value, config.params))
+            {
+                cerr << "Can't read evaluation parameters " << value << "\n";
+                return false;
+            }
         }
-        hl.set_y(0);
-        hl_1.set_y(1);
-        hl_2.set_y(2);
-        hl_3.set_y(3);
-        hl_4.set_y(4);
-        hl_5.set_y(5);
-        hl_6.set_y(6);
-        hl_7.set_y(7);
-        for(int i = 0; i < height; i++)
+        else if(key == "nnue")
+            config.use_network = (value == "on");
+        else if(key == "depth")
+            config.depth = atoi(value.c_str());
+        else if(key == "nodes")
+            config.nodes = atol(value.c_str());
+        else if(key == "time")
+            config.time = atol(value.c_str());
+        else
         {
-            hl.set_x(i);
-            hl_1.set_x(i);
-            hl_2.set_x(i);
-            hl_3.set_x(i);
-            hl_4.set_x(i);
-            hl_5.set_x(i);
-            hl_6.set_x(i);
-            hl_7.set_x(i);
-            this->print_board();
-            usleep(50000);
+            cerr << "Unknown engine option " << key << "\n";
+            return false;
         }
-        this->pop_last_highliter();
-        this->pop_last_highliter();
-        this->pop_last_highliter();
-        this->pop_last_highliter();
-        this->pop_last_highliter();
-        this->pop_last_highliter();
-        this->pop_last_highliter();
-        this->pop_last_highliter();
     }
-    void clear_game_info()
+    if(config.use_network && !nnue().is_loaded())
     {
-        while(turn >= 0)
-        {    
-            make_move_backward(turns.at(turn));
-            turn--; 
-        }
-        for(auto i : turns)
+        cerr << "No network loaded for " << config.name << "\n";
+        return false;
+    }
+    if((config.depth == 0) && (config.nodes == 0) && (config.time == 0))
+        config.depth = 3;
+    return true;
+}
+
+const int MATCH_MAX_PLIES = 300;
+//A game is adjudicated when both engines see at least this score for the same side for a number of plies
+const double MATCH_WIN_SCORE = 10.0;
+const int MATCH_WIN_PLIES = 4;
+//SPRT of elo0 against elo1 with error rates alpha and beta
+const double SPRT_ELO0 = 0.0;
+const double SPRT_ELO1 = 10.0;
+const double SPRT_ALPHA = 0.05;
+const double SPRT_BETA = 0.05;
+
+//Plays one game after the opening moves; returns the result for white
+double play_match_game(const GameRecord& opening, const EngineConfig* engines[2], string& reason)
+{
+    Board board;
+    board.set_start_position();
+    board.load_game(opening);
+    while(board.get_turn() + 1 < board.get_turns_count())
+        board.step_forward();
+    Color color = ((board.get_turn() + 1) % 2 == 0) ? WHITE : BLACK;
+    TranspositionTable white_tt(16), black_tt(16);
+    AI players[2];
+    for(int c = WHITE; c <= BLACK; c++)
+    {
+        players[c].set_tt(c == WHITE ? &white_tt : &black_tt);
+        players[c].set_params(&engines[c]->params);
+        players[c].set_limits(engines[c]->nodes, engines[c]->time);
+    }
+    int win_plies = 0;
+    double last_score = 0.0;
+    for(int ply = board.get_turn() + 1; ply < MATCH_MAX_PLIES; ply++)
+    {
+        board.set_network(engines[color]->use_network ? &nnue() : NULL);
+        SearchInfo info = players[color].search(&board, color, (engines[color]->depth > 0) ? engines[color]->depth : MAX_PLY - 1);
+        if(info.from == -1)
         {
-            delete i->get_replace();
-            delete i;
+            if(board.is_in_check(color))
+            {
+                reason = "mate";
+                return (color == WHITE) ? 0.0 : 1.0;
+            }
+            reason = "stalemate";
+            return 0.5;
         }
-        for(auto i : extra_turns)
+        if((fabs(info.score) >= MATCH_WIN_SCORE) && ((info.score > 0) == (last_score > 0)))
+            win_plies++;
+        else
+            win_plies = (fabs(info.score) >= MATCH_WIN_SCORE) ? 1 : 0;
+        last_score = info.score;
+        if(win_plies >= MATCH_WIN_PLIES)
         {
-            delete i->get_replace();
-            delete i;
+            reason = "adjudication";
+            return (info.score > 0) ? 1.0 : 0.0;
         }
-        turns.clear();
-        extra_turns.clear();
-        notation_turns.clear();
-        hl_v.clear();
-        free_extra_index = 0;
-        cur_state = Nothing;
-        white_castling = false;
-        black_castling = false;
+        board.play_move(board.get(info.from % 8, info.from / 8), board.get(info.to % 8, info.to / 8));
+        color = reverse_color(color);
+        reason = board.rule_draw(color);
+        if(!reason.empty())
+            return 0.5;
     }
-    void start()
-    {
-        regime = Menu;
-        cur_state = Nothing;
-        int temp;
-        int x = 4, y = 1;
-        int temp_x, temp_y;
-        set_input_mode();
-
-        set_menu();
-        activate_start_loading();
-
-        Highlight hl1(-1, -1, (char*)"\x1b[47m");
-        Highlight hl2(-1, -1, (char*)"\x1b[42m");
+    reason = "move limit";
+    return 0.5;
+}
 
-        this->print_board(); 
-        cout << "\n";
+struct MatchScore
+{
+    int wins = 0;
+    int losses = 0;
+    int draws = 0;
 
-        bool enter_firstly_pressed = false;
-        Object* obj_from;
-        Object* obj_to;
+    int games() const { return wins + losses + draws; }
+    double score() const { return (wins + draws / 2.0) / max(games(), 1); }
+    //Per-game variance; prior adds that many virtual games of each outcome
+    double variance(double prior = 0.0) const
+    {
+        double w = wins + prior, l = losses + prior, d = draws + prior;
+        if(w + l + d == 0) return 0.0;
+        double s = (w + d / 2) / (w + l + d);
+        return (w * (1 - s) * (1 - s) + l * s * s + d * (0.5 - s) * (0.5 - s)) / (w + l + d);
+    }
+    static double elo(double s)
+    {
+        s = min(max(s, 1e-6), 1 - 1e-6);
+        return -400.0 * log10(1.0 / s - 1.0);
+    }
+    //Elo difference with a 95% margin
+    double elo_margin() const
+    {
+        double error = 1.96 * sqrt(variance() / max(games(), 1));
+        return (elo(score() + error) - elo(score() - error)) / 2;
+    }
+    //Log-likelihood ratio of the generalized SPRT with the normal approximation
+    double llr() const
+    {
+        if(games() == 0) return 0.0;
+        //Half a virtual game of each outcome keeps one-sided results (all wins or all draws) finite
+        double var = variance(0.5);
+        double s0 = 1.0 / (1.0 + pow(10.0, -SPRT_ELO0 / 400.0));
+        double s1 = 1.0 / (1.0 + pow(10.0, -SPRT_ELO1 / 400.0));
+        return games() * (s1 - s0) * (2 * score() - s0 - s1) / (2 * var);
+    }
+};
 
-        while(true)
+//Plays engine A against engine B with colors swapped on every opening, stops early once SPRT decides
+int run_match(const string& spec_a, const string& spec_b, int games_count, const string& openings_path)
+{
+    EngineConfig engine_a, engine_b;
+    if(!parse_engine_config(spec_a, engine_a) || !parse_engine_config(spec_b, engine_b))
+        return 1;
+    vector<GameRecord> openings;
+    if(openings_path != "")
+    {
+        if(!read_game_collection(openings_path, openings))
         {
-            while(-1 == read(STDIN_FILENO, &temp, 1));
-            if((temp == 'w') && (regime == Classic))
-                if(board_flipped)
-                    y--;
-                else
-                    y++;
-            else if((temp == 's') && (regime == Classic))
-                if(board_flipped)
-                    y++;
-                else
-                    y--;
-            else if((temp == 'd') && (regime == Classic))
-                if(board_flipped)
-                    x--;
-                else
-                    x++;
-            else if((temp == 'a') && (regime == Classic))
-                if(board_flipped)
-                    x++;
-                else
-                    x--;
-            else if(temp == 'f')
-                board_flipped = !board_flipped;
-            else if(temp == 'b')
-            {
-                if(regime != Menu)
-                {
-                    clear_game_info();
-                    regime = Menu;
-                    set_menu();
-                }
-            }
-            else if(temp == 'e')
-            {
-                return;
-            }
-            else if(temp == 65)
-            {
-                if(turns.size() != 0)
-                {
-                    int size = turns.size() - 1;
-                    while(turn < size)
-                    {
-                        turn++;
-                        make_move_forward(turns.at(turn));
-                    }
-                    hl1.set_x(turns.at(turn)->get_from()->get_x());
-                    hl1.set_y(turns.at(turn)->get_from()->get_y());
-                    hl2.set_x(turns.at(turn)->get_to()->get_x());
-                    hl2.set_y(turns.at(turn)->get_to()->get_y());
-                }
-            }
-            else if(temp == 66)
-            {
-                while(turn > 0)
-                {
-                    make_move_backward(turns.at(turn));
-                    turn--;
-                }
-                if(turn != -1)
-                {
-                    hl1.set_x(turns.at(turn)->get_from()->get_x());
-                    hl1.set_y(turns.at(turn)->get_from()->get_y());
-                    hl2.set_x(turns.at(turn)->get_to()->get_x());
-                    hl2.set_y(turns.at(turn)->get_to()->get_y());
-                }
-            }
-            else if(temp == 67)
-            {
-                if(turns.size() != 0)
-                {
-                    turn++;
-                    if(turn > notation_turns.size()-1)
-                        turn = range(turn, -1, notation_turns.size()-1);
-                    else
-                    {
-                        make_move_forward(turns.at(turn));
-                        hl1.set_x(turns.at(turn)->get_from()->get_x());
-                        hl1.set_y(turns.at(turn)->get_from()->get_y());
-                        hl2.set_x(turns.at(turn)->get_to()->get_x());
-                        hl2.set_y(turns.at(turn)->get_to()->get_y());
-                    }
-                }
-            }
-            else if(temp == 68)
+            cerr << "Can't open " << openings_path << "\n";
+            return 1;
+        }
+    }
+    else
+        for(auto game : benchmark_games)
+        {
+            openings.emplace_back();
+            parse_notation(game, openings.back().notation);
+        }
+    if(openings.empty())
+    {
+        cerr << "No openings\n";
+        return 1;
+    }
+    double lower = log(SPRT_BETA / (1 - SPRT_ALPHA));
+    double upper = log((1 - SPRT_BETA) / SPRT_ALPHA);
+    MatchScore result;
+    mutex result_mutex;
+    atomic<bool> decided{false};
+    auto start_time = chrono::steady_clock::now();
+    {
+        ThreadPool pool(max(1u, thread::hardware_concurrency()));
+        for(int game = 0; game < games_count; game++)
+            pool.submit([&, game]()
             {
-                if(turn < 0)
-                    turn = range(turn, -1, notation_turns.size()-1);
+                if(decided) return;
+                bool a_white = (game % 2 == 0);
+                const EngineConfig* engines[2] = {a_white ? &engine_a : &engine_b, a_white ? &engine_b : &engine_a};
+                string reason;
+                double white_result = play_match_game(openings[(game / 2) % openings.size()], engines, reason);
+                double a_result = a_white ? white_result : 1.0 - white_result;
+                lock_guard<mutex> lock(result_mutex);
+                if(decided) return;
+                if(a_result == 1.0)
+                    result.wins++;
+                else if(a_result == 0.0)
+                    result.losses++;
                 else
-                {
-                    make_move_backward(turns.at(turn));
-                    hl1.set_x(turns.at(turn)->get_from()->get_x());
-                    hl1.set_y(turns.at(turn)->get_from()->get_y());
-                    hl2.set_x(turns.at(turn)->get_to()->get_x());
-                    hl2.set_y(turns.at(turn)->get_to()->get_y());
-                    turn--;
-                }
+                    result.draws++;
+                double llr = result.llr();
+                printf("Game %d (%s white): %s %s | +%d -%d =%d | Elo %.1f +/- %.1f | LLR %.2f (%.2f, %.2f)\n",
+                    game + 1, engines[WHITE]->name.c_str(),
+                    (white_result == 1.0) ? "1-0" : ((white_result == 0.0) ? "0-1" : "1/2-1/2"), reason.c_str(),
+                    result.wins, result.losses, result.draws, MatchScore::elo(result.score()), result.elo_margin(), llr, lower, upper);
+                fflush(stdout);
+                if((llr <= lower) || (llr >= upper))
+                    decided = true;
+            });
+    }
+    double seconds = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time).count() / 1000.0;
+    double llr = result.llr();
+    printf("%s vs %s: %d games in %.1f s, +%d -%d =%d, Elo %.1f +/- %.1f\n", engine_a.name.c_str(), engine_b.name.c_str(),
+        result.games(), seconds, result.wins, result.losses, result.draws, MatchScore::elo(result.score()), result.elo_margin());
+    printf("SPRT elo0 %.0f elo1 %.0f: LLR %.2f, %s\n", SPRT_ELO0, SPRT_ELO1, llr,
+        (llr >= upper) ? "H1 accepted" : ((llr <= lower) ? "H0 accepted" : "inconclusive"));
+    return 0;
+}
+
+//Self-play training record, 32 bytes: occupied squares, then one nibble (color * 6 + Obj) per occupied square
+//in square order, low nibble first. Score and result are from white's point of view.
+struct TrainingRecord
+{
+    uint64_t occupied;
+    uint8_t pieces[16];
+    int16_t score;
+    uint16_t ply;
+    //Bit 0 black to move, bits 1-2 evaluation flags, bits 3-6 castling rights (white short, white long, black short, black long)
+    uint8_t flags;
+    //1 white won, 0 draw, -1 black won
+    int8_t result;
+    uint8_t reserved[2];
+};
+static_assert(sizeof(TrainingRecord) == 32, "TrainingRecord must stay 32 bytes");
+
+void pack_training_record(const Position& position, int ply, double score, TrainingRecord& record)
+{
+    memset(&record, 0, sizeof(record));
+    int count = 0;
+    for(int sq = 0; sq < 64; sq++)
+    {
+        int color, type;
+        if(!position.piece_at(sq, color, type))
+            continue;
+        record.occupied |= 1ULL << sq;
+        record.pieces[count / 2] |= (color * 6 + type) << ((count % 2) * 4);
+        count++;
+    }
+    record.score = (int16_t)max(-32000L, min(32000L, lround(score * 100)));
+    record.ply = (uint16_t)ply;
+    record.flags = position.side | (position.eval_flags() << 1) | (position.castling << 3);
+}
+
+//Records per shard file before a worker starts the next one
+const long SELFPLAY_SHARD_RECORDS = 1 << 20;
+const int SELFPLAY_RANDOM_PLIES = 8;
+//Openings that a shallow search already sees as lost for one side are thrown away
+const double SELFPLAY_MAX_OPENING_SCORE = 2.0;
+const double SELFPLAY_MAX_RECORD_SCORE = 30.0;
+
+atomic<bool> selfplay_interrupted{false};
+
+//Append-only shard "selfplay-<worker>-<index>.bin" of one worker; reopening continues the last unfinished shard
+class TrainingShardWriter
+{
+    string dir;
+    int worker;
+    int index = 0;
+    long records = 0;
+    ofstream file;
+
+    string path(int i) const { return dir + "/selfplay-" + to_string(worker) + "-" + to_string(i) + ".bin"; }
+
+    public:
+    TrainingShardWriter(const string& _dir, int _worker) : dir(_dir), worker(_worker) {}
+    //Returns the number of records already written by earlier runs
+    long open()
+    {
+        long total = 0;
+        struct stat st;
+        while(stat(path(index).c_str(), &st) == 0)
+        {
+            records = st.st_size / sizeof(TrainingRecord);
+            total += records;
+            index++;
+        }
+        if((index > 0) && (records < SELFPLAY_SHARD_RECORDS))
+        {
+            //A run killed in the middle of a write leaves a partial record at the end
+            index--;
+            if(truncate(path(index).c_str(), records * sizeof(TrainingRecord)) != 0)
+                return -1;
+        }
+        else
+            records = 0;
+        file.open(path(index), ios::binary | ios::app);
+        return file.is_open() ? total : -1;
+    }
+    bool write(const vector<TrainingRecord>& game)
+    {
+        for(auto& record : game)
+        {
+            if(records == SELFPLAY_SHARD_RECORDS)
+            {
+                file.close();
+                index++;
+                records = 0;
+                file.open(path(index), ios::binary | ios::app);
+                if(!file.is_open()) return false;
             }
-            else if(temp == 'l')
+            file.write((const char*)&record, sizeof(record));
+            records++;
+        }
+        //A whole game at a time reaches the disk, so an interrupted run loses at most the games in progress
+        file.flush();
+        return file.good();
+    }
+};
+
+//Plays random opening moves; false if the position has no moves or is too unbalanced
+bool play_random_opening(Board& board, AI& ai, mt19937_64& random, Color& color)
+{
+    for(int ply = 0; ply < SELFPLAY_RANDOM_PLIES; ply++)
+    {
+        vector<Turn*> possible_turns;
+        ai.generate_turns(&board, color, possible_turns);
+        if(possible_turns.empty())
+            return false;
+        Turn* turn = possible_turns[random() % possible_turns.size()];
+        int from = turn->get_from_square(), to = turn->get_to_square();
+        ai.release_turns(&board, possible_turns);
+        board.play_move(board.get(from % 8, from / 8), board.get(to % 8, to / 8));
+        color = reverse_color(color);
+    }
+    SearchInfo info = ai.search(&board, color, 2);
+    return (info.from != -1) && (fabs(info.score) <= SELFPLAY_MAX_OPENING_SCORE);
+}
+
+//Plays one game with both sides using the same engine; quiet positions go to records, returns the result for white
+int play_selfplay_game(const EngineConfig& engine, mt19937_64& random, vector<TrainingRecord>& records)
+{
+    Board* board = NULL;
+    Color color = WHITE;
+    AI ai;
+    TranspositionTable tt(16);
+    ai.set_tt(&tt);
+    ai.set_params(&engine.params);
+    do
+    {
+        delete board;
+        board = new Board;
+        board->set_start_position();
+        color = WHITE;
+    } while(!play_random_opening(*board, ai, random, color));
+    board->set_network(engine.use_network ? &nnue() : NULL);
+    ai.set_limits(engine.nodes, engine.time);
+    records.clear();
+    int result = 0;
+    int win_plies = 0;
+    double last_score = 0.0;
+    for(int ply = SELFPLAY_RANDOM_PLIES; ply < MATCH_MAX_PLIES; ply++)
+    {
+        SearchInfo info = ai.search(board, color, (engine.depth > 0) ? engine.depth : MAX_PLY - 1);
+        if(info.from == -1)
+        {
+            result = board->is_in_check(color) ? ((color == WHITE) ? -1 : 1) : 0;
+            break;
+        }
+        if((fabs(info.score) >= MATCH_WIN_SCORE) && ((info.score > 0) == (last_score > 0)))
+            win_plies++;
+        else
+            win_plies = (fabs(info.score) >= MATCH_WIN_SCORE) ? 1 : 0;
+        last_score = info.score;
+        if(win_plies >= MATCH_WIN_PLIES)
+        {
+            result = (info.score > 0) ? 1 : -1;
+            break;
+        }
+        Object* from = board->get(info.from % 8, info.from / 8);
+        Object* to = board->get(info.to % 8, info.to / 8);
+        //Captures and checks are left out: their static score says little about the position
+        if((to->get_type() == Square) && !board->is_in_check(color) && (fabs(info.score) < SELFPLAY_MAX_RECORD_SCORE))
+        {
+            records.emplace_back();
+            pack_training_record(board->get_position(color), ply, info.score, records.back());
+        }
+        board->play_move(from, to);
+        color = reverse_color(color);
+        if(!board->rule_draw(color).empty())
+            break;
+    }
+    delete board;
+    return result;
+}
+
+//Fixed depth or node self-play on every core; each worker appends to its own shards in dir
+int run_selfplay(const string& dir, long games_count, const string& spec)
+{
+    EngineConfig engine;
+    if(!parse_engine_config(spec, engine))
+        return 1;
+    mkdir(dir.c_str(), 0755);
+    int threads_count = max(1u, thread::hardware_concurrency());
+    vector<TrainingShardWriter*> writers;
+    long existing = 0;
+    for(int worker = 0; worker < threads_count; worker++)
+    {
+        writers.push_back(new TrainingShardWriter(dir, worker));
+        long records = writers.back()->open();
+        if(records < 0)
+        {
+            cerr << "Can't write shards in " << dir << "\n";
+            for(auto writer : writers)
+                delete writer;
+            return 1;
+        }
+        existing += records;
+    }
+    printf("%ld records already in %s, playing on %d threads\n", existing, dir.c_str(), threads_count);
+    signal(SIGINT, [](int) { selfplay_interrupted = true; });
+    atomic<long> games_started{0}, games_done{0}, records_written{0};
+    atomic<bool> failed{false};
+    random_device seed_source;
+    auto start_time = chrono::steady_clock::now();
+    {
+        ThreadPool pool(threads_count);
+        for(int worker = 0; worker < threads_count; worker++)
+        {
+            uint64_t seed = ((uint64_t)seed_source() << 32) ^ seed_source() ^ worker;
+            pool.submit([&, worker, seed]()
             {
-                reset_input_mode();
-                string str;
-                cout << "Enter path to game: " << "\n";
-                cin >> str;
-                ifstream f;
-                f.open(str);
-                if(f.is_open())
+                mt19937_64 random(seed);
+                vector<TrainingRecord> records;
+                while(!selfplay_interrupted && !failed && ((games_count == 0) || (games_started++ < games_count)))
                 {
-                    clear_game_info();
-                    int pos = 0;
-                    regex r("([A-Za-z]+[0-9])|((O-)+O)");
-                    while(getline(f, str) && (pos != 10))
-                    {
-                        game_info[pos] = str;
-                        if(pos == 8)
-                            game_info[pos] += "\t\tPress \"b\" to back menu";
-                        game_info[pos++] += "\n";
-                    }
-                    if(!regex_search(str, r) || (pos != 10))
-                    {
-                        cout << "\nIncorrect File!" << "\n";
-                        skip = true;
-                    }
-                    else
+                    int result = play_selfplay_game(engine, random, records);
+                    if(selfplay_interrupted)
+                        break;
+                    for(auto& record : records)
+                        record.result = result;
+                    if(!writers[worker]->write(records))
                     {
-                        smatch m;
-                        while(regex_search(str, m, r))
-                        {
-                            notation_turns.push_back(m.str());
-                            str = m.suffix();
-                        }
-                        create_notation_turns_table();
-                        this->add_highliter(&hl1);
-                        this->add_highliter(&hl2);
-                        regime = View;
+                        failed = true;
+                        break;
                     }
-                }
-                else
-                {
-                    skip = true;
-                    cout << "\nFile doesn't exist!" << "\n";
-                }  
-                f.close();
-                cin.clear(); 
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');   
-                set_input_mode();
-            }
-            else if((temp == 10) && (regime == Classic))
-            {
-                if(enter_firstly_pressed == false)
-                {
-                    if((this->get(x, y)->get_color() == (((turn + 1) % 2 == 0) ? WHITE : BLACK)) && (this->get(x, y)->get_type() != Obj::Square))
+                    records_written += records.size();
+                    long done = ++games_done;
+                    if(done % 100 == 0)
                     {
-                        hl2.set_x(x);
-                        hl2.set_y(y);
-                        this->add_highliter(&hl2);
-                        enter_firstly_pressed = true;
-                        temp_x = x;
-                        temp_y = y;
+                        double seconds = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time).count() / 1000.0;
+                        printf("%ld games, %ld records, %.1f games/s\n", done, records_written.load(), done / max(seconds, 1e-3));
+                        fflush(stdout);
                     }
                 }
-                else
-                {
-                    bool tumbler = false;
-                    Turn* answer;
+            });
+        }
+    }
+    signal(SIGINT, SIG_DFL);
+    for(auto writer : writers)
+        delete writer;
+    if(failed)
+    {
+        cerr << "Can't write shards in " << dir << "\n";
+        return 1;
+    }
+    double seconds = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time).count() / 1000.0;
+    printf("%ld games, %ld records (%ld in total) in %.1f s\n", games_done.load(), records_written.load(), existing + records_written.load(), seconds);
+    return 0;
+}
 
-                    obj_from = this->get(temp_x, temp_y);
-                    obj_to = this->get(x, y);
-                    l1:
-                    // if(tumbler == false)
-                    // {
-                    //     obj_from = answer->get_from();
-                    //     obj_to = answer->get_to();
-                    // }
-                    if(obj_from->is_legal(obj_to, this)
-                    && (this->check_king_dependency(obj_from, obj_to) == NULL))
-                    {
-                        string str = "";
-                        if((cur_state != ShortCastling) && (cur_state != LongCastling))
-                        {
-                            if(obj_from->get_type() == King)
-                                str += "K";
-                            else if(obj_from->get_type() == Queen)
-                                str += "Q";
-                            else if(obj_from->get_type() == Knight)
-                                str += "N";
-                            else if(obj_from->get_type() == Bishop)
-                                str += "B";
-                            else if(obj_from->get_type() == Rook)
-                                str += "R";
-                            str += low_alphabet[obj_to->get_x()];
-                            str += ('1' + obj_to->get_y());
-                        }
-                        int high_border = turns.size() - 1;
-                        int low_border = turn;
-                        for(int i = high_border; i > low_border; i--)
-                        {
-                            if(turns.at(i)->get_extra_index() != -1)
-                            {
-                                free_extra_index--;
-                                delete extra_turns.at(free_extra_index)->get_replace();
-                                delete extra_turns.at(free_extra_index);
-                                extra_turns.pop_back();
-                            }
-                            delete turns.at(i)->get_replace();
-                            delete turns.at(i);
-                            turns.pop_back();
-                            notation_turns.pop_back();
-                        }
-                        turns.push_back(new Turn(obj_from, obj_to));
-                        turn++;
-                        if(cur_state != Nothing)
-                        {
-                            if(cur_state == EnPassant)
-                            {
-                                extra_turns.push_back(
-                                    new Turn(
-                                        this->get(obj_to->get_x(), (obj_from->get_y())),
-                                        this->get(obj_to->get_x(), (obj_from->get_y()))
-                                    )
-                                );
-                            }
-                            else
-                            {
-                                int yy = ((obj_from->get_color() == WHITE) ? 0 : 7);
-                                extra_turns.push_back(
-                                    new Turn(
-                                        this->get(((cur_state == ShortCastling) ? 7 : 0), yy),
-                                        this->get(((cur_state == ShortCastling) ? 5 : 3), yy)
-                                    )
-                                );
-                                str += ((cur_state == ShortCastling) ? "O-O" : "O-O-O");
-                            }
-                            turns.at(turn)->set_extra_index(free_extra_index++);
-                            cur_state = Nothing;
-                        }
-                        make_move_forward(turns.at(turn));
-                        notation_turns.push_back(str);  
-                        if(tumbler)
-                        {
-                            ai.analyze(this, (((turn + 1) % 2 == 0) ? WHITE : BLACK));
-                            tumbler = false;
-                            goto l1;
-                        }
+//Positions in flight per worker before the reader waits for the oldest result
+const int FEN_STREAM_WINDOW = 4;
 
-                    }
-                    else
-                    {
-                        x = temp_x;
-                        y = temp_y;
-                    }
-                    this->pop_last_highliter();
-                    enter_firstly_pressed = false;
-                }
-            }
-            else if(temp == 'c')
-            {
-                clear_game_info();
-                set_classic_chess_menu();
-                x = 4;
-                y = 1;
-                this->add_highliter(&hl1);
-                enter_firstly_pressed = false;
-                regime = Classic;
-            }
-            else if(temp == 'i')
-                AI_state = true;
-            if(regime == Classic)
-            {   
-                x = range(x, 0, 7);
-                y = range(y, 0, 7);
-                hl1.set_x(x);
-                hl1.set_y(y);
-            }
+//Contents of a JSON string literal
+string json_escape(const string& str)
+{
+    string escaped;
+    for(char c : str)
+    {
+        if((c == '"') || (c == '\\'))
+            escaped += '\\';
+        if((unsigned char)c < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            escaped += buf;
+        }
+        else
+            escaped += c;
+    }
+    return escaped;
+}
 
-            if(skip)
-            {
-                skip = false;
-                continue;
-            }
+//Score, best move and counters of a search as JSON fields, each with a leading comma
+string search_result_json(const SearchInfo& info)
+{
+    string json;
+    if(fabs(info.score) >= MATE_SCORE - MAX_PLY)
+        json += ",\"mate\":" + to_string((info.score > 0 ? 1 : -1) * (((int)(MATE_SCORE - fabs(info.score)) + 1) / 2));
+    else
+        json += ",\"cp\":" + to_string(lround(info.score * 100));
+    string pv = info.pv;
+    if(!pv.empty() && (pv.back() == ' ')) pv.pop_back();
+    json += ",\"best\":" + ((info.from == -1) ? string("null") : "\"" + square_name(info.from) + square_name(info.to) + "\"");
+    json += ",\"depth\":" + to_string(info.depth) + ",\"nodes\":" + to_string(info.nodes) + ",\"time\":" + to_string(info.time);
+    return json + ",\"pv\":\"" + pv + "\"";
+}
+
+//One FEN or EPD line as a JSON object; engine NULL takes the static evaluation. Scores are white-positive.
+string evaluate_fen_line(const string& line, long index, const EngineConfig* engine)
+{
+    static thread_local TranspositionTable tt(18);
+    static thread_local AI ai;
+    string fen;
+    vector<pair<string, string>> operations;
+    Color side;
+    Board board;
+    string json = "{\"index\":" + to_string(index);
+    if(!parse_epd(line, fen, operations) || !board.set_fen(fen, side))
+        return json + ",\"error\":\"invalid position\"}";
+    json += ",\"fen\":\"" + board.get_fen(side) + "\"";
+    for(auto& op : operations)
+        if(op.first == "id")
+            json += ",\"id\":\"" + json_escape(op.second) + "\"";
+    if(engine == NULL)
+    {
+        ai.set_params(&eval_params());
+        return json + ",\"cp\":" + to_string(lround(ai.static_analyze(&board) * 100)) + "}";
+    }
+    tt.clear();
+    ai.set_tt(&tt);
+    ai.set_params(&engine->params);
+    ai.set_limits(engine->nodes, engine->time);
+    board.set_network(engine->use_network ? &nnue() : NULL);
+    SearchInfo info = ai.search(&board, side, (engine->depth > 0) ? engine->depth : MAX_PLY - 1);
+    return json + search_result_json(info) + "}";
+}
 
-            this->print_board(); 
-            for(int i = 0; i < turns.size(); i++)
+//Headless scoring: FEN or EPD lines from stdin, JSON lines to stdout in input order
+int run_fen_stream(const string& spec)
+{
+    EngineConfig engine;
+    bool search = (spec != "static");
+    if(search && !parse_engine_config(spec, engine))
+        return 1;
+    ThreadPool pool(max(1u, thread::hardware_concurrency()));
+    size_t window = pool.size() * FEN_STREAM_WINDOW;
+    deque<future<string>> pending;
+    mutex pending_mutex;
+    condition_variable pending_changed;
+    bool input_done = false;
+    //Results are written as soon as they are ready in input order, so a client can wait for each answer
+    thread writer([&]()
+    {
+        while(true)
+        {
+            future<string> result;
             {
-                if((i) % 12 == 0) cout << "\n";
-                if(i % 2 == 0)
-                    cout << i/2 + 1 << ".";
-                if(i == (turn))
-                    cout << "\x1b[47m";
-                cout << notation_turns.at(i) << " ";
-                cout << "\x1b[0m";
+                unique_lock<mutex> lock(pending_mutex);
+                pending_changed.wait(lock, [&]() { return input_done || !pending.empty(); });
+                if(pending.empty()) return;
+                result = move(pending.front());
             }
-            cout << "\n";
-            if(this->check_mate(WHITE)) cout << "White king is mated!" << "\n";
-            else if(this->check_chess_check(WHITE)) cout << "White king is checked!" << "\n";
-            else if(this->check_mate(BLACK)) cout << "Black king is mated!" << "\n";
-            else if(this->check_chess_check(BLACK)) cout << "Black king is checked!" << "\n";
-            if(AI_state)
+            cout << result.get() << endl;
             {
-                ai.analyze(this, (((turn + 1) % 2 == 0) ? WHITE : BLACK));
-                AI_state = false;
+                lock_guard<mutex> lock(pending_mutex);
+                pending.pop_front();
             }
+            pending_changed.notify_all();
+        }
+    });
+    string line;
+    long index = 0;
+    while(getline(cin, line))
+    {
+        if(line.find_first_not_of(" \t\r") == string::npos)
+            continue;
+        unique_lock<mutex> lock(pending_mutex);
+        pending_changed.wait(lock, [&]() { return pending.size() < window; });
+        pending.push_back(pool.submit([line, index, &engine, search]()
+        {
+            return evaluate_fen_line(line, index, search ? &engine : NULL);
+        }));
+        index++;
+        lock.unlock();
+        pending_changed.notify_all();
+    }
+    {
+        lock_guard<mutex> lock(pending_mutex);
+        input_done = true;
+    }
+    pending_changed.notify_all();
+    writer.join();
+    return 0;
+}
+
+//Analysis server on a Unix domain socket. A request is one line "[engine] <fen>" (engine options as for match,
+//default from the command line); it gets JSON lines back tagged with its number on the connection:
+//"info" after every iteration, then "result" with the time spent queued and the total latency.
+//A "metrics" line returns queue depth, request counts and latency percentiles.
+const int SERVER_TT_BITS = 22;
+const int SERVER_POLL_MS = 200;
+const size_t SERVER_MAX_LINE = 65536;
+//A client that lets this much output pile up is dropped
+const size_t SERVER_MAX_OUTPUT = 16 << 20;
+//Latency percentiles cover this many of the last finished requests
+const size_t SERVER_LATENCY_SAMPLES = 1024;
+
+atomic<bool> server_interrupted{false};
+
+struct ServerRequest;
+
+//Kept open by its reader until every request is answered, so a client that shut down its side still gets every result
+struct ServerConnection
+{
+    int fd;
+    //Set when the client is gone; stops the running searches of the connection
+    atomic<bool> closed{false};
+    mutex write_mutex;
+    //Output the socket didn't take yet; the reader thread flushes it, so a search never waits for a slow client
+    string outbound;
+    //Queued and running requests, guarded by the server queue lock like pending
+    long requests = 0;
+    deque<ServerRequest> pending;
+
+    ServerConnection(int _fd) : fd(_fd) {}
+    void send_line(const string& line)
+    {
+        lock_guard<mutex> lock(write_mutex);
+        if(closed) return;
+        outbound += line;
+        outbound += '\n';
+        flush_locked();
+    }
+    void flush()
+    {
+        lock_guard<mutex> lock(write_mutex);
+        flush_locked();
+    }
+    bool has_output()
+    {
+        lock_guard<mutex> lock(write_mutex);
+        return !outbound.empty();
+    }
+    void flush_locked()
+    {
+        size_t sent = 0;
+        while(!closed && (sent < outbound.size()))
+        {
+            ssize_t count = send(fd, outbound.data() + sent, outbound.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if(count > 0)
+                sent += count;
+            else if((count < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+                break;
+            else if((count == 0) || (errno != EINTR))
+                closed = true;
+        }
+        outbound.erase(0, sent);
+        if(closed || (outbound.size() > SERVER_MAX_OUTPUT))
+        {
+            closed = true;
+            outbound.clear();
         }
     }
-    ~Board()
+    ~ServerConnection() { close(fd); }
+};
+
+struct ServerRequest
+{
+    shared_ptr<ServerConnection> connection;
+    long id = 0;
+    string fen;
+    EngineConfig engine;
+    chrono::steady_clock::time_point received;
+};
+
+class AnalysisServer
+{
+    EngineConfig default_engine;
+    TranspositionTable tt{SERVER_TT_BITS};
+    mutex queue_mutex;
+    //Connections with pending requests, served round-robin so a large batch from one client doesn't hold up the others
+    deque<shared_ptr<ServerConnection>> ready;
+    long queued = 0;
+    long running = 0;
+    long max_queued = 0;
+    long received = 0;
+    long completed = 0;
+    long cancelled = 0;
+    long connections = 0;
+    vector<double> wait_samples;
+    vector<double> latency_samples;
+    size_t next_sample = 0;
+    atomic<int> readers{0};
+    //Declared last, so the workers are joined before the queues and the table go away
+    ThreadPool pool;
+
+    void enqueue(const shared_ptr<ServerConnection>& connection, vector<ServerRequest>& batch);
+    void cancel(const shared_ptr<ServerConnection>& connection);
+    void run_next();
+    void read_requests(shared_ptr<ServerConnection> connection);
+
+    public:
+    AnalysisServer(const EngineConfig& engine, int threads_count) : default_engine(engine), pool(threads_count) {}
+    string metrics_json();
+    int serve(const string& path);
+};
+
+//Requests read together go into the queue under one lock
+void AnalysisServer::enqueue(const shared_ptr<ServerConnection>& connection, vector<ServerRequest>& batch)
+{
+    if(batch.empty()) return;
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        if(connection->pending.empty())
+            ready.push_back(connection);
+        for(auto& request : batch)
+            connection->pending.push_back(move(request));
+        connection->requests += batch.size();
+        queued += batch.size();
+        received += batch.size();
+        max_queued = max(max_queued, queued);
+    }
+    //One task per request; a task runs whichever request is next in turn
+    for(size_t i = 0; i < batch.size(); i++)
+        pool.submit([this]() { run_next(); });
+    batch.clear();
+}
+
+void AnalysisServer::cancel(const shared_ptr<ServerConnection>& connection)
+{
+    connection->closed = true;
+    lock_guard<mutex> lock(queue_mutex);
+    queued -= connection->pending.size();
+    cancelled += connection->pending.size();
+    connection->requests -= connection->pending.size();
+    connection->pending.clear();
+    ready.erase(remove(ready.begin(), ready.end(), connection), ready.end());
+}
+
+void AnalysisServer::run_next()
+{
+    static thread_local AI ai;
+    ServerRequest request;
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        if(ready.empty()) return;
+        shared_ptr<ServerConnection> connection = ready.front();
+        ready.pop_front();
+        request = move(connection->pending.front());
+        connection->pending.pop_front();
+        if(!connection->pending.empty())
+            ready.push_back(connection);
+        queued--;
+        running++;
+    }
+    ServerConnection& connection = *request.connection;
+    auto start_time = chrono::steady_clock::now();
+    string tag = "{\"id\":" + to_string(request.id);
+    Board board;
+    Color side;
+    SearchInfo info;
+    bool valid = board.set_fen(request.fen, side);
+    if(!valid)
+        connection.send_line(tag + ",\"type\":\"error\",\"error\":\"invalid position\"}");
+    else
+    {
+        ai.set_tt(&tt);
+        ai.set_cache(&analysis_cache());
+        ai.set_stop(&connection.closed);
+        ai.set_params(&request.engine.params);
+        ai.set_limits(request.engine.nodes, request.engine.time);
+        board.set_network(request.engine.use_network ? &nnue() : NULL);
+        info = ai.search(&board, side, (request.engine.depth > 0) ? request.engine.depth : MAX_PLY - 1, [&](const SearchInfo& iteration)
+        {
+            connection.send_line(tag + ",\"type\":\"info\"" + search_result_json(iteration) + "}");
+        });
+    }
+    auto end_time = chrono::steady_clock::now();
+    double wait = chrono::duration_cast<chrono::microseconds>(start_time - request.received).count() / 1000.0;
+    double latency = chrono::duration_cast<chrono::microseconds>(end_time - request.received).count() / 1000.0;
+    if(valid)
+    {
+        char buf[64];
+        snprintf(buf, sizeof(buf), ",\"wait\":%.1f,\"latency\":%.1f}", wait, latency);
+        connection.send_line(tag + ",\"type\":\"result\",\"fen\":\"" + board.get_fen(side) + "\"" + search_result_json(info) + buf);
+    }
+    lock_guard<mutex> lock(queue_mutex);
+    running--;
+    connection.requests--;
+    if(connection.closed)
     {
-        clear_game_info();
-        for(int i = 0; i < height* width; i++)
-            delete board[i];
-        delete [] board;
+        cancelled++;
+        return;
     }
-};
-
-class Pawn : public Object
-{
-    public:
-    Pawn(int _x, int _y, Color _clr) : Object(_x, _y, _clr)
+    completed++;
+    if(wait_samples.size() < SERVER_LATENCY_SAMPLES)
     {
-        if(this->get_color() == WHITE)
-            this->set_img((char*)"\u2659");
-        else
-            this->set_img((char*)"\u265F");
-        this->set_type(Obj::Pawn);
+        wait_samples.push_back(wait);
+        latency_samples.push_back(latency);
     }
-    virtual bool is_legal(Object* obj, Board* board) 
+    else
     {
-        int x = this->get_x();
-        int y = this->get_y();
-        int new_x = obj->get_x();
-        int new_y = obj->get_y();
+        wait_samples[next_sample] = wait;
+        latency_samples[next_sample] = latency;
+        next_sample = (next_sample + 1) % SERVER_LATENCY_SAMPLES;
+    }
+}
 
-        if(x == new_x && y == new_y) return false;
-        if((obj->get_type() != Square) && (obj->get_color() == this->get_color())) return false;
+string AnalysisServer::metrics_json()
+{
+    auto summary = [](vector<double> samples)
+    {
+        char buf[128];
+        if(samples.empty())
+            return string("{}");
+        sort(samples.begin(), samples.end());
+        double sum = 0;
+        for(double sample : samples)
+            sum += sample;
+        snprintf(buf, sizeof(buf), "{\"mean\":%.1f,\"p50\":%.1f,\"p95\":%.1f,\"max\":%.1f}", sum / samples.size(),
+            samples[samples.size() / 2], samples[samples.size() * 95 / 100], samples.back());
+        return string(buf);
+    };
+    lock_guard<mutex> lock(queue_mutex);
+    char buf[256];
+    snprintf(buf, sizeof(buf), "{\"type\":\"metrics\",\"queued\":%ld,\"running\":%ld,\"max_queued\":%ld,\"received\":%ld,"
+        "\"completed\":%ld,\"cancelled\":%ld,\"connections\":%ld,\"threads\":%d", queued, running, max_queued, received,
+        completed, cancelled, connections, pool.size());
+    return buf + string(",\"wait_ms\":") + summary(wait_samples) + ",\"latency_ms\":" + summary(latency_samples) + "}";
+}
 
-        if(this -> get_color() == WHITE)
+void AnalysisServer::read_requests(shared_ptr<ServerConnection> connection)
+{
+    string buffer;
+    char chunk[4096];
+    long next_id = 0;
+    vector<ServerRequest> batch;
+    bool reading = true;
+    while(!server_interrupted && !connection->closed)
+    {
+        bool output = connection->has_output();
+        if(!reading && !output)
         {
-            if(new_x == x)
-            {
-                if(new_y == y + 1)
-                {
-                    return (obj->get_type() == Obj::Square);
-                }
-                if(y == 1 && new_y == 3 && (obj->get_type() == Obj::Square) && (board->get(x, 2)->get_type() == Obj::Square))
-                {
-                    board->set_hit_field(board->get(x, 2));
-                    board->get(x, 2)->set_extra(board->get_turn());
-                    return true;
-                }
-            }
-            else if(abs(new_x - x) == 1)
-            {
-                if(new_y == y + 1)
-                {
-                    if((obj->get_type() != Obj::Square) && (obj->get_color() == BLACK)) 
-                        return true;
-                    if(
-                        (board->get_hit_field() != NULL) &&
-                        (obj->get_x() == board->get_hit_field()->get_x()) &&
-                        (obj->get_y() == board->get_hit_field()->get_y()) &&
-                        (board->get_turn() == (board->get_hit_field()->get_extra() + 1))
-                    ) 
-                    {
-                        board->set_cur_state(EnPassant);
-                        return true;
-                    }
-                }
-            }
+            lock_guard<mutex> lock(queue_mutex);
+            if(connection->requests == 0)
+                break;
+        }
+        pollfd poll_fd = {connection->fd, (short)((reading ? POLLIN : 0) | (output ? POLLOUT : 0)), 0};
+        if(poll(&poll_fd, 1, SERVER_POLL_MS) <= 0)
+            continue;
+        if(poll_fd.revents & POLLOUT)
+            connection->flush();
+        //A hangup after the end of input means the client closed without waiting for its results
+        if(!reading && (poll_fd.revents & (POLLHUP | POLLERR)))
+            connection->closed = true;
+        if(!reading || !(poll_fd.revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        ssize_t count = read(connection->fd, chunk, sizeof(chunk));
+        if(count < 0)
+            connection->closed = true;
+        if(count <= 0)
+        {
+            //The last line may come without a newline
+            reading = false;
+            buffer += "\n";
         }
         else
+            buffer.append(chunk, count);
+        size_t begin = 0, end;
+        while((end = buffer.find('\n', begin)) != string::npos)
         {
-            if(new_x == x)
+            string line = buffer.substr(begin, end - begin);
+            begin = end + 1;
+            size_t first = line.find_first_not_of(" \t\r");
+            if(first == string::npos)
+                continue;
+            line = line.substr(first, line.find_last_not_of(" \t\r") - first + 1);
+            if(line == "metrics")
             {
-                if(new_y == y - 1)
-                {
-                    return (obj->get_type() == Obj::Square);
-                }
-                if(y == 6 && new_y == 4 && (obj->get_type() == Obj::Square) && (board->get(x, 5)->get_type() == Obj::Square))
-                {
-                    board->set_hit_field(board->get(x, 5));
-                    board->get(x, 5)->set_extra(board->get_turn());
-                    return true;
-                }
+                enqueue(connection, batch);
+                connection->send_line(metrics_json());
+                continue;
             }
-            else if(abs(new_x - x) == 1)
+            ServerRequest request;
+            request.connection = connection;
+            request.id = next_id++;
+            request.received = chrono::steady_clock::now();
+            request.engine = default_engine;
+            //Engine specs are key=value options, a FEN has no '='
+            size_t space = line.find(' ');
+            string spec = line.substr(0, space);
+            request.fen = line;
+            if((spec.find('=') != string::npos) && (space != string::npos))
             {
-                if(new_y == y - 1)
+                request.fen = line.substr(space + 1);
+                if(!parse_engine_config(spec, request.engine))
                 {
-                    if((obj->get_type() != Obj::Square) && (obj->get_color() == WHITE)) 
-                        return true;
-                    if(
-                        (board->get_hit_field() != NULL) &&
-                        (obj->get_x() == board->get_hit_field()->get_x()) &&
-                        (obj->get_y() == board->get_hit_field()->get_y()) &&
-                        (board->get_turn() == (board->get_hit_field()->get_extra() + 1))
-                    ) 
-                    {
-                        board->set_cur_state(EnPassant);
-                        return true;
-                    }
+                    connection->send_line("{\"id\":" + to_string(request.id) + ",\"type\":\"error\",\"error\":\"invalid engine\"}");
+                    continue;
                 }
             }
+            batch.push_back(move(request));
+        }
+        buffer.erase(0, begin);
+        enqueue(connection, batch);
+        if(buffer.size() > SERVER_MAX_LINE)
+        {
+            connection->send_line("{\"type\":\"error\",\"error\":\"line too long\"}");
+            connection->closed = true;
         }
-        return false;
     }
+    if(server_interrupted || connection->closed)
+        cancel(connection);
+    readers--;
+}
 
-};
-
-class Rook : public Object
+int AnalysisServer::serve(const string& path)
 {
-    public:
-    Rook(int _x, int _y, Color _clr) : Object(_x, _y, _clr)
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path))
     {
-        if(this->get_color() == WHITE)
-            this->set_img((char*)"\u2656");
-        else
-            this->set_img((char*)"\u265C");
-        this->set_type(Obj::Rook);
+        cerr << "Socket path too long: " << path << "\n";
+        return 1;
     }
-    virtual bool is_legal(Object* obj, Board* board) 
+    strcpy(address.sun_path, path.c_str());
+    //A socket left behind by a server that didn't shut down
+    struct stat st;
+    if((stat(path.c_str(), &st) == 0) && S_ISSOCK(st.st_mode))
+        unlink(path.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if((listener == -1) || (bind(listener, (sockaddr*)&address, sizeof(address)) != 0) || (listen(listener, SOMAXCONN) != 0))
     {
-        int x = this->get_x();
-        int y = this->get_y();
-        int new_x = obj->get_x();
-        int new_y = obj->get_y();
-
-        if(x == new_x && y == new_y) return false;
-        if((obj->get_type() != Square) && (obj->get_color() == this->get_color())) return false;
-        if(x == new_x)
-        {
-            for(int i = min(y, new_y) + 1; i < max(y, new_y); i++)
-            {
-                if(board->get(x, i)->get_type() != Square)
-                    return false;
-            }
-            return true;
-        }
-        else
-        if(y == new_y)
+        cerr << "Can't listen on " << path << ": " << strerror(errno) << "\n";
+        if(listener != -1) close(listener);
+        return 1;
+    }
+    printf("Listening on %s, %d search threads, %d MB hash\n", path.c_str(), pool.size(),
+        (int)((TranspositionTable::ENTRY_SIZE << SERVER_TT_BITS) >> 20));
+    fflush(stdout);
+    signal(SIGINT, [](int) { server_interrupted = true; });
+    signal(SIGTERM, [](int) { server_interrupted = true; });
+    while(!server_interrupted)
+    {
+        pollfd poll_fd = {listener, POLLIN, 0};
+        if(poll(&poll_fd, 1, SERVER_POLL_MS) <= 0)
+            continue;
+        int fd = accept(listener, NULL, NULL);
+        if(fd == -1)
+            continue;
         {
-            for(int i = min(x, new_x) + 1; i < max(x, new_x); i++)
-            {
-                if(board->get(i, y)->get_type() != Square)
-                    return false;
-            }
-            return true;
+            lock_guard<mutex> lock(queue_mutex);
+            connections++;
         }
-        return false;
+        readers++;
+        thread(&AnalysisServer::read_requests, this, make_shared<ServerConnection>(fd)).detach();
     }
+    close(listener);
+    unlink(path.c_str());
+    while(readers > 0)
+        this_thread::sleep_for(chrono::milliseconds(10));
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    printf("%s\n", metrics_json().c_str());
+    return 0;
+}
 
-};
+int run_server(const string& path, const string& spec, int threads_count)
+{
+    EngineConfig engine;
+    if(!parse_engine_config(spec, engine))
+        return 1;
+    AnalysisServer server(engine, (threads_count > 0) ? threads_count : max(1u, thread::hardware_concurrency()));
+    return server.serve(path);
+}
 
-class Bishop : public Object
+//Matches a SAN ("Nbd7", "exd5", "O-O", check marks and annotations ignored) or coordinate ("g1f3") move against
+//the legal moves of the side; returns from * 64 + to or -1
+int find_san_move(Board* board, Color side, string san)
 {
-    public:
-    Bishop(int _x, int _y, Color _clr) : Object(_x, _y, _clr)
+    while(!san.empty() && strchr("+#!?", san.back()) != NULL)
+        san.pop_back();
+    size_t promotion = san.find('=');
+    if(promotion != string::npos)
+        san = san.substr(0, promotion);
+    replace(san.begin(), san.end(), '0', 'O');
+    AI ai;
+    vector<Turn*> possible_turns;
+    ai.generate_turns(board, side, possible_turns);
+    int result = -1;
+    for(auto turn : possible_turns)
     {
-        if(this->get_color() == WHITE)
-            this->set_img((char*)"\u2657");
+        int from = turn->get_from_square(), to = turn->get_to_square();
+        Obj type = turn->get_from()->get_type();
+        bool matches;
+        if((san == "O-O") || (san == "O-O-O"))
+            matches = (type == King) && (to - from == (san == "O-O" ? 2 : -2));
+        else if((san.size() == 4) && (square_name(from) + square_name(to) == san))
+            matches = true;
         else
-            this->set_img((char*)"\u265D");
-        this->set_type(Obj::Bishop);
-    }
-    virtual bool is_legal(Object* obj, Board* board) 
-    {
-        int x = this->get_x();
-        int y = this->get_y();
-        int new_x = obj->get_x();
-        int new_y = obj->get_y();
-
-        if(x == new_x && y == new_y) return false;
-        if((obj->get_type() != Square) && (obj->get_color() == this->get_color())) return false;
-        if(abs(x - new_x) == abs(y - new_y))
         {
-            int x_i = (x - new_x < 0) ? 1 : -1;
-            int y_i = (y - new_y < 0) ? 1 : -1;
-            int rez = abs(x - new_x) - 1;
-            for(int i = 0; i < rez; i++)
+            string rest = san;
+            Obj san_type = Pawn;
+            const char* found = (rest.empty() || !isupper(rest[0])) ? NULL : strchr(fen_pieces[WHITE], rest[0]);
+            if(found != NULL)
             {
-                x += x_i;
-                y += y_i;
-                if(board->get(x, y)->get_type() != Square)
-                    return false;
+                san_type = (Obj)(found - fen_pieces[WHITE]);
+                rest = rest.substr(1);
             }
-            return true;
+            rest.erase(remove(rest.begin(), rest.end(), 'x'), rest.end());
+            matches = (rest.size() >= 2) && (type == san_type) && (rest.substr(rest.size() - 2) == square_name(to));
+            for(size_t i = 0; matches && (i + 2 < rest.size()); i++)
+                matches = (rest[i] == square_name(from)[isdigit(rest[i]) ? 1 : 0]);
+        }
+        if(matches)
+        {
+            result = from * 64 + to;
+            break;
         }
-        return false;
     }
+    ai.release_turns(board, possible_turns);
+    return result;
+}
 
+struct EpdPosition
+{
+    string id;
+    string fen;
+    Color side;
+    vector<int> best_moves;
+    vector<int> avoid_moves;
+    string expected;
 };
 
-class Knight : public Object
+struct EpdResult
 {
-    public:
-    Knight(int _x, int _y, Color _clr) : Object(_x, _y, _clr)
+    int move = -1;
+    bool solved = false;
+    long time = 0;
+    long nodes = 0;
+};
+
+//Searches one suite position; the solve time and nodes are those of the first iteration from which the
+//best move stayed correct
+EpdResult run_epd_position(const EpdPosition& position, const EngineConfig& engine)
+{
+    static thread_local TranspositionTable tt(18);
+    static thread_local AI ai;
+    Board board;
+    Color side;
+    board.set_fen(position.fen, side);
+    board.set_network(engine.use_network ? &nnue() : NULL);
+    tt.clear();
+    ai.set_tt(&tt);
+    ai.set_params(&engine.params);
+    ai.set_limits(engine.nodes, engine.time);
+    auto correct = [&](int move)
     {
-        if(this->get_color() == WHITE)
-            this->set_img((char*)"\u2658");
-        else
-            this->set_img((char*)"\u265E");
-        this->set_type(Obj::Knight);
-    }
-    virtual bool is_legal(Object* obj, Board* board) 
+        if(move < 0) return false;
+        if(find(position.avoid_moves.begin(), position.avoid_moves.end(), move) != position.avoid_moves.end()) return false;
+        return position.best_moves.empty()
+            || (find(position.best_moves.begin(), position.best_moves.end(), move) != position.best_moves.end());
+    };
+    EpdResult result;
+    bool solving = false;
+    SearchInfo info = ai.search(&board, side, (engine.depth > 0) ? engine.depth : MAX_PLY - 1, [&](const SearchInfo& iteration)
     {
-        int x = this->get_x();
-        int y = this->get_y();
-        int new_x = obj->get_x();
-        int new_y = obj->get_y();
-
-        if(x == new_x && y == new_y) return false;
-        if((obj->get_type() != Square) && (obj->get_color() == this->get_color())) return false;
-        if((abs(x - new_x) == 2 && abs(y - new_y) == 1) || (abs(x - new_x) == 1 && abs(y - new_y) == 2))
-            return true;
-        return false;
-    }
-
-};
+        bool ok = correct(iteration.from * 64 + iteration.to);
+        if(ok && !solving)
+        {
+            result.time = iteration.time;
+            result.nodes = iteration.nodes;
+        }
+        solving = ok;
+    });
+    result.move = (info.from == -1) ? -1 : info.from * 64 + info.to;
+    result.solved = solving && correct(result.move);
+    return result;
+}
 
-class Queen : public Object
+//Runs a suite of EPD positions with bm/am opcodes under every engine configuration, positions in parallel.
+//Rows are printed in suite order and columns per engine, so runs of two builds can be diffed or pasted together.
+int run_epd_suite(const string& path, const vector<string>& specs)
 {
-    public:
-    Queen(int _x, int _y, Color _clr) : Object(_x, _y, _clr)
+    vector<EngineConfig> engines(specs.size());
+    for(size_t e = 0; e < specs.size(); e++)
+        if(!parse_engine_config(specs[e], engines[e]))
+            return 1;
+    ifstream file(path);
+    if(!file.is_open())
     {
-        if(this->get_color() == WHITE)
-            this->set_img((char*)"\u2655");
-        else
-            this->set_img((char*)"\u265B");
-        this->set_type(Obj::Queen);
+        cerr << "Can't open " << path << "\n";
+        return 1;
     }
-    virtual bool is_legal(Object* obj, Board* board) 
+    vector<EpdPosition> positions;
+    string line;
+    for(int line_number = 1; getline(file, line); line_number++)
     {
-        int x = this->get_x();
-        int y = this->get_y();
-        int new_x = obj->get_x();
-        int new_y = obj->get_y();
-
-        if(x == new_x && y == new_y) return false;
-        if((obj->get_type() != Square) && (obj->get_color() == this->get_color())) return false;
-        if(x == new_x)
+        if(line.find_first_not_of(" \t\r") == string::npos)
+            continue;
+        EpdPosition position;
+        vector<pair<string, string>> operations;
+        Board board;
+        if(!parse_epd(line, position.fen, operations) || !board.set_fen(position.fen, position.side))
         {
-            for(int i = min(y, new_y) + 1; i < max(y, new_y); i++)
-            {
-                if(board->get(x, i)->get_type() != Square)
-                    return false;
-            }
-            return true;
+            cerr << path << ":" << line_number << ": invalid position\n";
+            continue;
         }
-        else
-        if(y == new_y)
+        position.id = to_string(line_number);
+        bool valid = true;
+        for(auto& op : operations)
         {
-            for(int i = min(x, new_x) + 1; i < max(x, new_x); i++)
+            if(op.first == "id")
+                position.id = op.second;
+            if((op.first != "bm") && (op.first != "am"))
+                continue;
+            position.expected += (position.expected.empty() ? "" : " ") + op.first + " " + op.second;
+            stringstream moves(op.second);
+            string san;
+            while(moves >> san)
             {
-                if(board->get(i, y)->get_type() != Square)
-                    return false;
+                int move = find_san_move(&board, position.side, san);
+                if(move == -1)
+                {
+                    cerr << path << ":" << line_number << ": illegal move " << san << "\n";
+                    valid = false;
+                }
+                (op.first == "bm" ? position.best_moves : position.avoid_moves).push_back(move);
             }
-            return true;
         }
-        else
-        if(abs(x - new_x) == abs(y - new_y))
+        if(valid && (!position.best_moves.empty() || !position.avoid_moves.empty()))
+            positions.push_back(position);
+    }
+    vector<vector<future<EpdResult>>> results(engines.size());
+    {
+        ThreadPool pool(max(1u, thread::hardware_concurrency()));
+        for(size_t e = 0; e < engines.size(); e++)
+            for(auto& position : positions)
+                results[e].push_back(pool.submit([&position, &engine = engines[e]]() { return run_epd_position(position, engine); }));
+
+        printf("%-20s %-16s", "id", "expected");
+        for(auto& engine : engines)
+            printf(" | %-27.27s", engine.name.c_str());
+        printf("\n");
+        vector<int> solved(engines.size(), 0);
+        vector<long> times(engines.size(), 0), nodes(engines.size(), 0);
+        for(size_t i = 0; i < positions.size(); i++)
         {
-            int x_i = (x - new_x < 0) ? 1 : -1;
-            int y_i = (y - new_y < 0) ? 1 : -1;
-            int rez = abs(x - new_x) - 1;
-            for(int i = 0; i < rez; i++)
+            printf("%-20.20s %-16.16s", positions[i].id.c_str(), positions[i].expected.c_str());
+            for(size_t e = 0; e < engines.size(); e++)
             {
-                x += x_i;
-                y += y_i;
-                if(board->get(x, y)->get_type() != Square)
-                    return false;
+                EpdResult result = results[e][i].get();
+                string move = (result.move == -1) ? "-" : square_name(result.move / 64) + square_name(result.move % 64);
+                if(result.solved)
+                {
+                    solved[e]++;
+                    times[e] += result.time;
+                    nodes[e] += result.nodes;
+                    printf(" | %-4s ok %6ld ms %9ld", move.c_str(), result.time, result.nodes);
+                }
+                else
+                    printf(" | %-4s -- %6s    %9s", move.c_str(), "", "");
             }
-            return true;
+            printf("\n");
+            fflush(stdout);
         }
-        return false;
+        printf("%-37s", "solved / avg time / avg nodes");
+        for(size_t e = 0; e < engines.size(); e++)
+            printf(" | %3d/%-3zu %6ld ms %9ld", solved[e], positions.size(), times[e] / max(solved[e], 1), nodes[e] / max(solved[e], 1));
+        printf("\n");
     }
+    return 0;
+}
 
-};
+const int BENCH_DEPTH = 5;
+//Move generation and evaluation passes over the benchmark positions for the hardware counters
+const int BENCH_PHASE_REPEATS = 2000;
 
-class King : public Object
+//Keeps the optimizer from hoisting pure kernel calls out of benchmark loops
+inline void clobber_memory() { asm volatile("" : : : "memory"); }
+
+//Makes the value count as used, so the calls that computed it are not optimized away
+template<class T>
+inline void do_not_optimize(const T& value) { asm volatile("" : : "r,m"(value) : "memory"); }
+
+//Searches every benchmark position to a fixed depth with its own table and default evaluation.
+//Positions are independent, so the node count is the same for any number of threads.
+int run_bench(int depth, int threads_count)
 {
-    public:
-    King(int _x, int _y, Color _clr) : Object(_x, _y, _clr)
+    int count = sizeof(benchmark_games) / sizeof(benchmark_games[0]);
+    vector<long> nodes(count), times(count);
+    PerfSample search_perf;
+    mutex perf_mutex;
+    auto start_time = chrono::steady_clock::now();
     {
-        if(this->get_color() == WHITE)
-            this->set_img((char*)"\u2654");
-        else
-            this->set_img((char*)"\u265A");
-        this->set_type(Obj::King);
+        ThreadPool pool(max(1, threads_count));
+        for(int i = 0; i < count; i++)
+            pool.submit([&, i]()
+            {
+                vector<string> notation;
+                parse_notation(benchmark_games[i], notation);
+                Board board;
+                board.set_network(NULL);
+                board.set_start_position();
+                board.load_notation(notation);
+                while(board.get_turn() + 1 < board.get_turns_count())
+                    board.step_forward();
+                TranspositionTable tt;
+                AI ai;
+                PerfCounters counters;
+                ai.set_tt(&tt);
+                ai.set_params(&default_eval_params);
+                ai.set_perf(&counters);
+                SearchInfo info = ai.search(&board, ((board.get_turn() + 1) % 2 == 0 ? WHITE : BLACK), depth);
+                nodes[i] = info.nodes;
+                times[i] = info.time;
+                lock_guard<mutex> lock(perf_mutex);
+                search_perf += info.perf;
+            });
     }
-    virtual bool is_legal(Object* obj, Board* board)  
+    long time = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time).count();
+    long total = 0;
+    for(int i = 0; i < count; i++)
     {
-        if(obj == NULL) return false;
-        int x = this->get_x();
-        int y = this->get_y();
-        int new_x = obj->get_x();
-        int new_y = obj->get_y();
-        Color color = this->get_color();
+        printf("Position %d: %ld nodes, %ld ms\n", i + 1, nodes[i], times[i]);
+        total += nodes[i];
+    }
+    printf("===========================\n");
+    printf("Total time (ms) : %ld\n", time);
+    printf("Nodes searched  : %ld\n", total);
+    printf("Nodes/second    : %ld\n", total * 1000 / max(time, 1L));
 
-        if(x == new_x && y == new_y) return false;
-        if((obj->get_type() != Square) && (obj->get_color() == this->get_color())) return false;
-        if(abs(x - new_x) <= 1 && abs(y - new_y) <= 1)
+    PerfCounters counters;
+    if(!counters.available())
+    {
+        printf("Hardware counters unavailable\n");
+        return 0;
+    }
+    vector<Board*> boards;
+    for(int i = 0; i < count; i++)
+    {
+        vector<string> notation;
+        parse_notation(benchmark_games[i], notation);
+        boards.push_back(new Board);
+        boards.back()->set_network(NULL);
+        boards.back()->set_start_position();
+        boards.back()->load_notation(notation);
+        while(boards.back()->get_turn() + 1 < boards.back()->get_turns_count())
+            boards.back()->step_forward();
+    }
+    AI ai;
+    PerfSample phase_start = counters.read();
+    for(int r = 0; r < BENCH_PHASE_REPEATS; r++)
+        for(auto board : boards)
         {
-            if(board->check_king_dependency(this, obj) == NULL)
-                return true;
+            vector<Turn*> possible_turns;
+            ai.generate_turns(board, ((board->get_turn() + 1) % 2 == 0 ? WHITE : BLACK), possible_turns);
+            ai.release_turns(board, possible_turns);
         }
-        //King and Rook
-        int yy = (color == WHITE ? 0 : 7);
-        if(x == 4 && y == yy && (this->get_links() == 0))
+    PerfSample movegen_perf = counters.read() - phase_start;
+    long checksum = 0;
+    phase_start = counters.read();
+    for(int r = 0; r < BENCH_PHASE_REPEATS; r++)
+        for(auto board : boards)
         {
-            Object* right_rook = board->get(7, yy);
-            Object* left_rook = board->get(0, yy);
-            if(
-                (new_x == 6 && new_y == yy) && (board->get(5, yy)->get_type() == Square) 
-                && (board->get(6, yy)->get_type() == Square) && (right_rook->get_type() == Rook) 
-                && (right_rook->get_color() == color) && (right_rook->get_links() == 0)
-                && (board->is_hitted(this, (color == WHITE ? BLACK : WHITE)) == NULL)
-                && (board->is_hitted(board->get(5, yy), (color == WHITE ? BLACK : WHITE)) == NULL)
-                && (board->is_hitted(board->get(6, yy), (color == WHITE ? BLACK : WHITE)) == NULL)
-            )
+            EvalTerms terms{default_eval_params.values};
+            ai.evaluate_terms(board, terms);
+            checksum += terms.score;
+        }
+    PerfSample eval_perf = counters.read() - phase_start;
+    for(auto board : boards)
+        delete board;
+    long calls = (long)BENCH_PHASE_REPEATS * count;
+    printf("Search          : %s\n", perf_summary(search_perf, total, "node").c_str());
+    printf("Move generation : %s\n", perf_summary(movegen_perf, calls, "call").c_str());
+    printf("Evaluation      : %s\n", perf_summary(eval_perf, calls, "call").c_str());
+    do_not_optimize(checksum);
+    return 0;
+}
+
+//The piece rules as the virtual is_legal bodies had them before the kernels, kept as the rules-bench baseline.
+//The king still moves itself on the board and rescans every square to test its new square.
+bool reference_is_legal(Object* figure, Object* obj, Board* board);
+
+Object* reference_is_hitted(Board* board, Object* obj, Color color = UNCOLORED)
+{
+    Object* threat = NULL;
+    for(int y = 0; y < 8; y++)
+        for(int x = 0; x < 8; x++)
+        {
+            if((color != UNCOLORED) && (board->get(x, y)->get_color() != color)) continue;
+            if(reference_is_legal(board->get(x, y), obj, board))
+                threat = board->get(x, y);
+        }
+    return threat;
+}
+
+Object* reference_check_king_dependency(Board* board, Object* figure, Object* next_stop)
+{
+    Object* king = (figure->get_color() == WHITE ? board->get_white_king() : board->get_black_king());
+    int x = figure->get_x();
+    int y = figure->get_y();
+    Object* temp = board->get(next_stop->get_x(), next_stop->get_y());
+    figure->set_x(next_stop->get_x());
+    figure->set_y(next_stop->get_y());
+    board->add_wd(figure);
+    board->add_wd(new class Square(x, y, (x + y) % 2 == 1 ? WHITE : BLACK));
+    Object* threat = reference_is_hitted(board, king);
+    figure->set_x(x);
+    figure->set_y(y);
+    board->add(figure);
+    board->add_wd(temp);
+    return threat;
+}
+
+bool reference_is_legal(Object* figure, Object* obj, Board* board)
+{
+    int x = figure->get_x();
+    int y = figure->get_y();
+    int new_x = obj->get_x();
+    int new_y = obj->get_y();
+    Color color = figure->get_color();
+
+    if(figure->get_type() == Square) return false;
+    if(x == new_x && y == new_y) return false;
+    if((obj->get_type() != Square) && (obj->get_color() == color)) return false;
+    bool straight = (figure->get_type() == Rook) || (figure->get_type() == Queen);
+    bool diagonal = (figure->get_type() == Bishop) || (figure->get_type() == Queen);
+    switch(figure->get_type())
+    {
+        case Pawn:
+        {
+            int forward = (color == WHITE) ? 1 : -1;
+            int start = (color == WHITE) ? 1 : 6;
+            if(new_x == x)
             {
-                board->set_cur_state(ShortCastling);
-                return true;
+                if(new_y == y + forward)
+                    return (obj->get_type() == Square);
+                if(y == start && new_y == y + 2 * forward && (obj->get_type() == Square) && (board->get(x, y + forward)->get_type() == Square))
+                {
+                    board->set_hit_field(board->get(x, y + forward));
+                    board->get(x, y + forward)->set_extra(board->get_turn());
+                    return true;
+                }
             }
-            if( 
-                (new_x == 2 && new_y == yy) && (board->get(1, yy)->get_type() == Square) 
-                && (board->get(2, yy)->get_type() == Square) && (board->get(3, yy)->get_type() == Square)
-                && (left_rook->get_type() == Rook) 
-                && (left_rook->get_color() == color) && (left_rook->get_links() == 0)
-                && !board->is_hitted(this, (color == WHITE ? BLACK : WHITE))
-                && (board->is_hitted(board->get(3, yy), (color == WHITE ? BLACK : WHITE)) == NULL)
-                && (board->is_hitted(board->get(2, yy), (color == WHITE ? BLACK : WHITE)) == NULL)
-            )
+            else if(abs(new_x - x) == 1 && new_y == y + forward)
             {
-                board->set_cur_state(LongCastling);
-                return true;
+                if(obj->get_type() != Square)
+                    return true;
+                if(
+                    (board->get_hit_field() != NULL) &&
+                    (new_x == board->get_hit_field()->get_x()) &&
+                    (new_y == board->get_hit_field()->get_y()) &&
+                    (board->get_turn() == (board->get_hit_field()->get_extra() + 1))
+                )
+                {
+                    board->set_cur_state(EnPassant);
+                    return true;
+                }
+            }
+            return false;
+        }
+        case Knight:
+            return (abs(x - new_x) == 2 && abs(y - new_y) == 1) || (abs(x - new_x) == 1 && abs(y - new_y) == 2);
+        case King:
+        {
+            if(abs(x - new_x) <= 1 && abs(y - new_y) <= 1)
+            {
+                if(reference_check_king_dependency(board, figure, obj) == NULL)
+                    return true;
+            }
+            int yy = (color == WHITE ? 0 : 7);
+            Color enemy = reverse_color(color);
+            if(x == 4 && y == yy && (figure->get_links() == 0) && new_y == yy)
+            {
+                Object* right_rook = board->get(7, yy);
+                Object* left_rook = board->get(0, yy);
+                if(
+                    (new_x == 6) && (board->get(5, yy)->get_type() == Square)
+                    && (board->get(6, yy)->get_type() == Square) && (right_rook->get_type() == Rook)
+                    && (right_rook->get_color() == color) && (right_rook->get_links() == 0)
+                    && (reference_is_hitted(board, figure, enemy) == NULL)
+                    && (reference_is_hitted(board, board->get(5, yy), enemy) == NULL)
+                    && (reference_is_hitted(board, board->get(6, yy), enemy) == NULL)
+                )
+                {
+                    board->set_cur_state(ShortCastling);
+                    return true;
+                }
+                if(
+                    (new_x == 2) && (board->get(1, yy)->get_type() == Square)
+                    && (board->get(2, yy)->get_type() == Square) && (board->get(3, yy)->get_type() == Square)
+                    && (left_rook->get_type() == Rook)
+                    && (left_rook->get_color() == color) && (left_rook->get_links() == 0)
+                    && (reference_is_hitted(board, figure, enemy) == NULL)
+                    && (reference_is_hitted(board, board->get(3, yy), enemy) == NULL)
+                    && (reference_is_hitted(board, board->get(2, yy), enemy) == NULL)
+                )
+                {
+                    board->set_cur_state(LongCastling);
+                    return true;
+                }
             }
+            return false;
         }
-        return false;
+        default:
+            break;
+    }
+    if(straight && x == new_x)
+    {
+        for(int i = min(y, new_y) + 1; i < max(y, new_y); i++)
+            if(board->get(x, i)->get_type() != Square)
+                return false;
+        return true;
+    }
+    if(straight && y == new_y)
+    {
+        for(int i = min(x, new_x) + 1; i < max(x, new_x); i++)
+            if(board->get(i, y)->get_type() != Square)
+                return false;
+        return true;
+    }
+    if(diagonal && abs(x - new_x) == abs(y - new_y))
+    {
+        int x_i = (x - new_x < 0) ? 1 : -1;
+        int y_i = (y - new_y < 0) ? 1 : -1;
+        for(int i = abs(x - new_x) - 1; i > 0; i--)
+        {
+            x += x_i;
+            y += y_i;
+            if(board->get(x, y)->get_type() != Square)
+                return false;
+        }
+        return true;
     }
+    return false;
+}
 
-};
+template<class F>
+double measure_ns(long ops, F job)
+{
+    auto start_time = chrono::steady_clock::now();
+    job();
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_time).count() / (double)ops;
+}
 
-void Board::set_start_position()
+//The rules before the kernels (reference_is_legal), the UI's virtual is_legal and the search's direct kernel calls
+//over the same pairs of every piece with every square, then the attack scans for both kings, on the same positions.
+//The virtual calls forward into the kernels, so virtual against direct is the cost of the dispatch.
+int rules_benchmark(int repeats)
 {
-    this->clear();
-    this->add(new class Rook(0, 0, WHITE));
-    this->add(new class Rook(0, 7, BLACK));
-    this->add(new class Knight(1, 0, WHITE));
-    this->add(new class Knight(1, 7, BLACK));
-    this->add(new class Bishop(2, 0, WHITE));
-    this->add(new class Bishop(2, 7, BLACK));
-    this->add(new class Queen(3, 0, WHITE));
-    this->add(new class Queen(3, 7, BLACK));
-    this->add(new class King(4, 0, WHITE));
-    this->add(new class King(4, 7, BLACK));
-    this->add(new class Bishop(5, 0, WHITE));
-    this->add(new class Bishop(5, 7, BLACK));
-    this->add(new class Knight(6, 0, WHITE));
-    this->add(new class Knight(6, 7, BLACK));
-    this->add(new class Rook(7, 0, WHITE));
-    this->add(new class Rook(7, 7, BLACK));
-    for(int i = 0; i < 8; i++)
+    double legal_before = 0, legal_virtual = 0, legal_kernel = 0, attack_before = 0, attack_virtual = 0, attack_kernel = 0;
+    long checksum_before = 0, checksum_virtual = 0, checksum_kernel = 0;
+    for(auto game : benchmark_games)
     {
-        this->add(new class Pawn(i, 1, WHITE));
-        this->add(new class Pawn(i, 6, BLACK));
+        vector<string> notation;
+        parse_notation(game, notation);
+        Board board;
+        board.set_start_position();
+        board.load_notation(notation);
+        while(board.get_turn() + 1 < board.get_turns_count())
+            board.step_forward();
+        vector<Object*> pieces;
+        for(int from = 0; from < 64; from++)
+            if(board.get(from % 8, from / 8)->get_type() != Square)
+                pieces.push_back(board.get(from % 8, from / 8));
+        long ops = (long)repeats * pieces.size() * 64;
+        legal_before += measure_ns(ops, [&]()
+        {
+            for(int r = 0; r < repeats; r++, clobber_memory())
+                for(auto piece : pieces)
+                    for(int to = 0; to < 64; to++)
+                        checksum_before += reference_is_legal(piece, board.get(to % 8, to / 8), &board);
+        });
+        legal_virtual += measure_ns(ops, [&]()
+        {
+            for(int r = 0; r < repeats; r++, clobber_memory())
+                for(auto piece : pieces)
+                    for(int to = 0; to < 64; to++)
+                        checksum_virtual += piece->is_legal(board.get(to % 8, to / 8), &board);
+        });
+        legal_kernel += measure_ns(ops, [&]()
+        {
+            for(int r = 0; r < repeats; r++, clobber_memory())
+                for(auto piece : pieces)
+                    for(int to = 0; to < 64; to++)
+                        checksum_kernel += (piece->get_color() == WHITE)
+                            ? is_legal_kernel<WHITE>(piece, board.get(to % 8, to / 8), &board)
+                            : is_legal_kernel<BLACK>(piece, board.get(to % 8, to / 8), &board);
+        });
+        ops = (long)repeats * 64;
+        attack_before += measure_ns(ops, [&]()
+        {
+            for(int r = 0; r < repeats * 64; r++, clobber_memory())
+                checksum_before += (reference_is_hitted(&board, board.get_white_king(), BLACK) != NULL)
+                    + (reference_is_hitted(&board, board.get_black_king(), WHITE) != NULL);
+        });
+        attack_virtual += measure_ns(ops, [&]()
+        {
+            for(int r = 0; r < repeats * 64; r++, clobber_memory())
+                checksum_virtual += (board.is_hitted(board.get_white_king(), BLACK) != NULL)
+                    + (board.is_hitted(board.get_black_king(), WHITE) != NULL);
+        });
+        attack_kernel += measure_ns(ops, [&]()
+        {
+            for(int r = 0; r < repeats * 64; r++, clobber_memory())
+                checksum_kernel += (find_attacker<BLACK>(&board, board.get_white_king()->get_x(), board.get_white_king()->get_y()) != NULL)
+                    + (find_attacker<WHITE>(&board, board.get_black_king()->get_x(), board.get_black_king()->get_y()) != NULL);
+        });
+    }
+    do_not_optimize(checksum_before);
+    int count = sizeof(benchmark_games) / sizeof(benchmark_games[0]);
+    printf("%-28s %12s %12s %12s %8s\n", "", "before", "virtual", "kernel", "speedup");
+    printf("%-28s %9.1f ns %9.1f ns %9.1f ns %7.2fx\n", "is_legal (per piece/square)",
+        legal_before / count, legal_virtual / count, legal_kernel / count, legal_before / legal_kernel);
+    printf("%-28s %9.1f ns %9.1f ns %9.1f ns %7.2fx\n", "king attacked (both kings)",
+        attack_before / count, attack_virtual / count, attack_kernel / count, attack_before / attack_kernel);
+    if(checksum_virtual != checksum_kernel)
+    {
+        cerr << "Kernels disagree with virtual rules: " << checksum_virtual << " != " << checksum_kernel << "\n";
+        return 1;
     }
+    return 0;
 }
 
+//Micro-benchmarks run rounds for at least this long and keep the fastest of a few runs
+const long MICRO_MIN_NS = 50000000;
+const int MICRO_RUNS = 3;
 
-double AI::check_mobility(Object* obj, Board* board)
+struct MicroResult
 {
-    int hitted_fields = 0;
-    for(int i = 0; i < 64; i++)
-            if(obj->is_legal(board->board[i], board)) hitted_fields++;
-    return hitted_fields;
+    string name;
+    long ops = 0;
+    double ns = 0.0;
+    //Negative when the build has no allocation counter
+    double allocs = -1.0;
+};
+
+long current_allocations()
+{
+#ifdef SEARCH_STATS
+    return allocation_count;
+#else
+    return -1;
+#endif
 }
-bool AI::check_passed_pawn(Object* obj, Board* board)
+
+//job does one round and returns the number of operations in it
+template<class F>
+MicroResult micro_benchmark(const string& name, F job)
 {
-    int x = obj->get_x();
-    if(obj->get_color() == WHITE)
-    {
-        for(int i = obj->get_y() + 1; i < 7; i++)
-        {
-            if(
-                ((board->get(x - 1, i) != NULL) && (board->get(x - 1, i)->get_type() == Pawn) && (board->get(x - 1, i)->get_color() == BLACK)) ||
-                ((board->get(x, i) != NULL) && (board->get(x, i)->get_type() == Pawn) && (board->get(x, i)->get_color() == BLACK)) ||
-                ((board->get(x + 1, i) != NULL) && (board->get(x + 1, i)->get_type() == Pawn) && (board->get(x + 1, i)->get_color() == BLACK))
-            )
-                return false;
-        }
-    }
-    else
+    MicroResult result;
+    result.name = name;
+    result.ns = numeric_limits<double>::max();
+    for(int run = 0; run < MICRO_RUNS; run++)
     {
-        for(int i = obj->get_y() - 1; i > 0; i--)
+        long ops = 0, elapsed = 0;
+        long allocations = current_allocations();
+        auto start_time = chrono::steady_clock::now();
+        while(elapsed < MICRO_MIN_NS)
         {
-            if(
-                ((board->get(x - 1, i) != NULL) && (board->get(x - 1, i)->get_type() == Pawn) && (board->get(x - 1, i)->get_color() == WHITE)) ||
-                ((board->get(x, i) != NULL) && (board->get(x, i)->get_type() == Pawn) && (board->get(x, i)->get_color() == WHITE)) ||
-                ((board->get(x + 1, i) != NULL) && (board->get(x + 1, i)->get_type() == Pawn) && (board->get(x + 1, i)->get_color() == WHITE))
-            )
-                return false;
+            ops += job();
+            clobber_memory();
+            elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_time).count();
         }
+        result.ns = min(result.ns, elapsed / (double)ops);
+        result.ops = ops;
+        if(allocations >= 0)
+            result.allocs = (current_allocations() - allocations) / (double)ops;
     }
-    return true;
+    return result;
 }
-double AI::evaluate_best_answer(Board* board, Color turn_color, int depth)
+
+//Hot paths of the engine and the UI on the final positions of the benchmark games.
+//Results go to stdout as a table and, with out_path, are appended as JSON lines tagged with label.
+int micro_benchmarks(const string& out_path, const string& label)
 {
-    vector<Turn*> possible_turns;
-    Object* obj_from;
-    Object* obj_to;
-    Turn* temp_turn;
-    double evaluation;
-    for(int i = 0; i < 64; i++)
+    vector<Board*> boards;
+    vector<vector<string>> notations;
+    long notation_moves = 0;
+    for(auto game : benchmark_games)
     {
-        obj_from = board->board[i];
-        if(obj_from->get_type() == Square) continue;
-        if(obj_from->get_color() != turn_color) continue;
-        for(int j = 0; j < 64; j++)
+        notations.push_back({});
+        parse_notation(game, notations.back());
+        notation_moves += notations.back().size();
+        Board* board = new Board;
+        board->set_network(NULL);
+        board->set_start_position();
+        board->load_notation(notations.back());
+        while(board->get_turn() + 1 < board->get_turns_count())
+            board->step_forward();
+        boards.push_back(board);
+    }
+    //is_legal on a double push marks the passed square as the en passant field; the cases put the marks back,
+    //so every case sees the boards as the games left them
+    vector<Object*> hit_fields;
+    vector<vector<int>> extras(boards.size());
+    for(size_t i = 0; i < boards.size(); i++)
+    {
+        hit_fields.push_back(boards[i]->get_hit_field());
+        for(int sq = 0; sq < 64; sq++)
+            extras[i].push_back(boards[i]->get(sq % 8, sq / 8)->get_extra());
+    }
+    auto restore_marks = [&](size_t i)
+    {
+        boards[i]->set_hit_field(hit_fields[i]);
+        boards[i]->set_cur_state(Nothing);
+        //Only the third and sixth ranks are passed by a double push
+        for(int x = 0; x < 8; x++)
         {
-            obj_to = board->board[j];
-            if(obj_from->is_legal(obj_to, board)
-            && (board->check_king_dependency(obj_from, obj_to) == NULL))
+            boards[i]->get(x, 2)->set_extra(extras[i][2 * 8 + x]);
+            boards[i]->get(x, 5)->set_extra(extras[i][5 * 8 + x]);
+        }
+    };
+    vector<MicroResult> results;
+    long checksum = 0;
+    const char* piece_names[] = {"king", "queen", "rook", "bishop", "knight", "pawn"};
+    for(int type = King; type <= Pawn; type++)
+        results.push_back(micro_benchmark(string("is_legal/") + piece_names[type], [&]()
+        {
+            long ops = 0;
+            for(size_t i = 0; i < boards.size(); i++)
             {
-                temp_turn = new Turn(obj_from, obj_to);
-                if(board->cur_state != Nothing)
+                for(int from = 0; from < 64; from++)
                 {
-                    if(board->cur_state == EnPassant)
-                    {
-                        board->extra_turns.push_back(
-                            new Turn(
-                                board->get(obj_to->get_x(), (obj_from->get_y())),
-                                board->get(obj_to->get_x(), (obj_from->get_y()))
-                            )
-                        );
-                    }
-                    else
-                    {
-                        int yy = ((obj_from->get_color() == WHITE) ? 0 : 7);
-                        board->extra_turns.push_back(
-                            new Turn(
-                                board->get(((board->cur_state == ShortCastling) ? 7 : 0), yy),
-                                board->get(((board->cur_state == ShortCastling) ? 5 : 3), yy)
-                            )
-                        );
-                    }
-                    temp_turn->set_extra_index(board->free_extra_index++);
-                    board->cur_state = Nothing;
+                    Object* piece = boards[i]->get(from % 8, from / 8);
+                    if(piece->get_type() != type) continue;
+                    for(int to = 0; to < 64; to++)
+                        checksum += piece->is_legal(boards[i]->get(to % 8, to / 8), boards[i]);
+                    ops += 64;
                 }
-                board->make_move_forward(temp_turn);
-                if(depth > 0)
-                    temp_turn->set_ai_evaluation(evaluate_best_answer(board, reverse_color(turn_color), depth-1));
-                else
-                    temp_turn->set_ai_evaluation(static_analyze(board));
-                board->make_move_backward(temp_turn);
-                possible_turns.push_back(temp_turn);
+                restore_marks(i);
             }
+            return ops;
+        }));
+    results.push_back(micro_benchmark("is_hitted", [&]()
+    {
+        for(auto board : boards)
+            for(int sq = 0; sq < 64; sq++)
+                checksum += (board->is_hitted(board->get(sq % 8, sq / 8), WHITE) != NULL)
+                    + (board->is_hitted(board->get(sq % 8, sq / 8), BLACK) != NULL);
+        return (long)boards.size() * 128;
+    }));
+    //Pseudo-legal pairs of every position, as check_king_dependency sees them after is_legal
+    vector<vector<pair<int, int>>> pairs(boards.size());
+    for(size_t i = 0; i < boards.size(); i++)
+    {
+        for(int from = 0; from < 64; from++)
+            for(int to = 0; to < 64; to++)
+                if((boards[i]->get(from % 8, from / 8)->get_type() != Square)
+                    && boards[i]->get(from % 8, from / 8)->is_legal(boards[i]->get(to % 8, to / 8), boards[i]))
+                    pairs[i].push_back({from, to});
+        restore_marks(i);
+    }
+    results.push_back(micro_benchmark("check_king_dependency", [&]()
+    {
+        long ops = 0;
+        for(size_t i = 0; i < boards.size(); i++)
+            for(auto& pair : pairs[i])
+            {
+                Object* from = boards[i]->get(pair.first % 8, pair.first / 8);
+                Object* to = boards[i]->get(pair.second % 8, pair.second / 8);
+                checksum += (boards[i]->check_king_dependency(from, to) != NULL);
+                ops++;
+            }
+        return ops;
+    }));
+    AI ai;
+    results.push_back(micro_benchmark("make_move_forward+backward", [&]()
+    {
+        long ops = 0;
+        for(size_t i = 0; i < boards.size(); i++)
+        {
+            Color color = ((boards[i]->get_turn() + 1) % 2 == 0) ? WHITE : BLACK;
+            vector<Turn*> possible_turns;
+            ai.generate_turns(boards[i], color, possible_turns);
+            for(auto turn : possible_turns)
+            {
+                boards[i]->make_move_forward(turn);
+                boards[i]->make_move_backward(turn);
+            }
+            ops += possible_turns.size();
+            ai.release_turns(boards[i], possible_turns);
+            restore_marks(i);
+        }
+        return ops;
+    }));
+    results.push_back(micro_benchmark("static_analyze (cached)", [&]()
+    {
+        for(auto board : boards)
+            checksum += lround(ai.static_analyze(board) * 100);
+        return (long)boards.size();
+    }));
+    results.push_back(micro_benchmark("evaluate_terms", [&]()
+    {
+        for(auto board : boards)
+        {
+            EvalTerms terms{default_eval_params.values};
+            ai.evaluate_terms(board, terms);
+            checksum += terms.score;
+        }
+        return (long)boards.size();
+    }));
+    results.push_back(micro_benchmark("parse_notation (per move)", [&]()
+    {
+        for(auto game : benchmark_games)
+        {
+            vector<string> notation;
+            parse_notation(game, notation);
+            checksum += notation.size();
+        }
+        return notation_moves;
+    }));
+    Board notation_board;
+    notation_board.set_network(NULL);
+    notation_board.set_start_position();
+    results.push_back(micro_benchmark("create_notation_turns_table (per move)", [&]()
+    {
+        for(auto& notation : notations)
+        {
+            notation_board.clear_game_info();
+            notation_board.load_notation(notation);
+            checksum += notation_board.get_turns_count();
+        }
+        return notation_moves;
+    }));
+    //Frames go to /dev/null without the terminal clear, which would time a fork and exec
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    results.push_back(micro_benchmark("print_board (frame)", [&]()
+    {
+        boards.back()->print_board(false);
+        cout.flush();
+        return 1L;
+    }));
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(null_fd);
+    close(saved_stdout);
+
+    ofstream out;
+    if(out_path != "")
+    {
+        out.open(out_path, ios::app);
+        if(!out.is_open())
+        {
+            cerr << "Can't write " << out_path << "\n";
+            return 1;
         }
     }
-    if(turn_color == WHITE)
-        sort(possible_turns.begin(), possible_turns.end(), compareTurnsForWhite);
-    else
-        sort(possible_turns.begin(), possible_turns.end(), compareTurnsForBlack);   
-    evaluation = possible_turns.at(0)->get_ai_evaluation();
-    for(auto turn : possible_turns)
+    long timestamp = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+    printf("%-40s %12s %12s\n", "", "ns/op", "allocs/op");
+    for(auto& result : results)
     {
-        if(turn->get_extra_index() != -1)
+        char allocs[32] = "n/a";
+        if(result.allocs >= 0)
+            snprintf(allocs, sizeof(allocs), "%.2f", result.allocs);
+        printf("%-40s %12.1f %12s\n", result.name.c_str(), result.ns, allocs);
+        if(out.is_open())
         {
-            board->free_extra_index--;
-            delete board->extra_turns.at(board->free_extra_index)->get_replace();
-            delete board->extra_turns.at(board->free_extra_index);
-            board->extra_turns.pop_back();
+            char line[256];
+            snprintf(line, sizeof(line), "{\"label\":\"%s\",\"time\":%ld,\"name\":\"%s\",\"ns_per_op\":%.1f,\"allocs_per_op\":%s,\"ops\":%ld}\n",
+                label.c_str(), timestamp, result.name.c_str(), result.ns, (result.allocs >= 0 ? allocs : "null"), result.ops);
+            out << line;
         }
-        delete turn->get_replace();
-        delete turn;
     }
-    return evaluation;
+    do_not_optimize(checksum);
+    for(auto board : boards)
+        delete board;
+    return 0;
 }
-Turn* AI::analyze(Board* board, Color turn_color)
+
+//Walks the move tree comparing incremental accumulators with a full refresh and SIMD output with scalar
+long nnue_check_tree(AI& ai, Board* board, Nnue& network, Color turn_color, int depth, long& mismatches)
 {
+    long positions = 1;
+    int score = board->nnue_evaluate();
+    int fresh_score;
+    network.select_kernels(false);
+    if(!board->nnue_matches_refresh(fresh_score) || (fresh_score != score))
+        mismatches++;
+    network.select_kernels(true);
+    if(depth == 0) return positions;
     vector<Turn*> possible_turns;
-    Object* obj_from;
-    Object* obj_to;
-    Turn* temp_turn;
-    Turn* result;   
-    cout << "Analyzing" << endl;
-    for(int i = 0; i < 64; i++)
+    ai.generate_turns(board, turn_color, possible_turns);
+    for(auto temp_turn : possible_turns)
     {
-        obj_from = board->board[i];
-        if(obj_from->get_type() == Square) continue;
-        if(obj_from->get_color() != turn_color) continue;
-        for(int j = 0; j < 64; j++)
+        board->make_move_forward(temp_turn);
+        positions += nnue_check_tree(ai, board, network, reverse_color(turn_color), depth - 1, mismatches);
+        board->make_move_backward(temp_turn);
+    }
+    ai.release_turns(board, possible_turns);
+    return positions;
+}
+
+int nnue_check(const string& path, int depth)
+{
+    Nnue network;
+    if(path != "")
+    {
+        if(!network.load(path))
         {
-            obj_to = board->board[j];
-            if(obj_from->is_legal(obj_to, board)
-            && (board->check_king_dependency(obj_from, obj_to) == NULL))
-            {
-                temp_turn = new Turn(obj_from, obj_to);
-                if(board->cur_state != Nothing)
-                {
-                    if(board->cur_state == EnPassant)
-                    {
-                        board->extra_turns.push_back(
-                            new Turn(
-                                board->get(obj_to->get_x(), (obj_from->get_y())),
-                                board->get(obj_to->get_x(), (obj_from->get_y()))
-                            )
-                        );
-                    }
-                    else
-                    {
-                        int yy = ((obj_from->get_color() == WHITE) ? 0 : 7);
-                        board->extra_turns.push_back(
-                            new Turn(
-                                board->get(((board->cur_state == ShortCastling) ? 7 : 0), yy),
-                                board->get(((board->cur_state == ShortCastling) ? 5 : 3), yy)
-                            )
-                        );
-                    }
-                    temp_turn->set_extra_index(board->free_extra_index++);
-                    board->cur_state = Nothing;
-                }
-                board->make_move_forward(temp_turn);
-                temp_turn->set_ai_evaluation(evaluate_best_answer(board, reverse_color(turn_color), 1));
-                board->make_move_backward(temp_turn);
-                possible_turns.push_back(temp_turn);
-                if(possible_turns.size() % 7 == 0)
-                {
-                    cout << "\033[F";
-                    cout << "Analyzing";
-                    for(int k = 0; k < possible_turns.size() / 7; k++)
-                        cout << ".";
-                    cout << endl;
-                }
-            }
+            cerr << "Can't load network " << path << "\n";
+            return 1;
         }
     }
-    if(turn_color == WHITE)
-        sort(possible_turns.begin(), possible_turns.end(), compareTurnsForWhite);
     else
-        sort(possible_turns.begin(), possible_turns.end(), compareTurnsForBlack);
-
-    int border = min(5, (int)possible_turns.size());
-    cout << "\033[F";
-    for(int i = 0; i < border; i++)
-        cout << "Top " << i + 1 << ": " 
-        << board->low_alphabet[possible_turns.at(i)->get_from()->get_x()] << possible_turns.at(i)->get_from()->get_y() + 1 
-        << " -> "
-        << board->low_alphabet[possible_turns.at(i)->get_to()->get_x()] << possible_turns.at(i)->get_to()->get_y() + 1
-        <<  " " << possible_turns.at(i)->get_ai_evaluation() << "\n";
-    if(possible_turns.size() == 0) return NULL;
-    result = possible_turns.at(0);
-    for(int i = 1; i < possible_turns.size(); i++)
+        network.randomize(0x5EEDC0DE);
+    long positions = 0, mismatches = 0;
+    double nnue_time = 0, classic_time = 0;
+    for(auto game : benchmark_games)
     {
-        Turn* turn = possible_turns.at(i);
-        if(turn->get_extra_index() != -1)
+        vector<string> notation;
+        parse_notation(game, notation);
+        Board board;
+        board.set_start_position();
+        board.load_notation(notation);
+        while(board.get_turn() + 1 < board.get_turns_count())
+            board.step_forward();
+        Color turn_color = (notation.size() % 2 == 0) ? WHITE : BLACK;
+        AI ai;
+        board.set_network(&network);
+        positions += nnue_check_tree(ai, &board, network, turn_color, depth, mismatches);
+        nnue_time += measure_ns(1000, [&]()
         {
-            board->free_extra_index--;
-            delete board->extra_turns.at(board->free_extra_index)->get_replace();
-            delete board->extra_turns.at(board->free_extra_index);
-            board->extra_turns.pop_back();
-        }
-        delete turn->get_replace();
-        delete turn;
+            for(int i = 0; i < 1000; i++, clobber_memory())
+                ai.static_analyze(&board);
+        });
+        board.set_network(NULL);
+        classic_time += measure_ns(1000, [&]()
+        {
+            for(int i = 0; i < 1000; i++, clobber_memory())
+                ai.static_analyze(&board);
+        });
     }
-    return result;
+    int count = sizeof(benchmark_games) / sizeof(benchmark_games[0]);
+    printf("kernel %s, %ld positions, %ld mismatches\n", network.get_kernel_name(), positions, mismatches);
+    printf("static_analyze: network %.1f ns, classic %.1f ns\n", nnue_time / count, classic_time / count);
+    return (mismatches == 0) ? 0 : 1;
 }
-double AI::static_analyze(Board* board)
+
+//Checks the position key at every node of the move tree: unmake restores it, a board read back from the
+//node's FEN has it, and a packed move played on the bitboards gives the key of the board after the move
+long key_check_tree(AI& ai, Board* board, Color turn_color, int depth, long& mismatches)
 {
-    State save_state = board->cur_state;
-    Object* save_hit_field = board->hit_field;
-    double analyze_rate = 0.0;
-    Color color;
-    Object* obj;
-    Object* temp_obj;
-    int white_pawns_on_vert;
-    int black_pawns_on_vert;
-    int white_bishops = 0;
-    int black_bishops = 0;
-    for(int x = 0; x < 8; x++)
+    long positions = 1;
+    uint64_t key = board->hash(turn_color);
+    Position position;
+    if(!parse_fen(board->get_fen(turn_color), position) || (position.key != key))
+        mismatches++;
+    if(depth == 0) return positions;
+    vector<Turn*> possible_turns;
+    ai.generate_turns(board, turn_color, possible_turns);
+    for(auto temp_turn : possible_turns)
     {
-        black_pawns_on_vert = 0;
-        white_pawns_on_vert = 0;
-        for(int y = 0; y < 8; y++)
-        {
-            obj = board->get(x, y);
-            color = obj->get_color();
-            switch (obj->get_type())
-            {
-                case Square:
-                    break;
-                case Pawn:
-                    analyze_rate += (color == WHITE ? 1 : -1) * 100;
-                    if(color == WHITE)
-                    {
-                        white_pawns_on_vert++;
-                        temp_obj = board->get(obj->get_x() - 1, obj->get_y() - 1);
-                        if((temp_obj != NULL) && (temp_obj->get_type() == Pawn) && (temp_obj->get_color() == WHITE)) analyze_rate += 12;
-                        temp_obj = board->get(obj->get_x() + 1, obj->get_y() - 1);
-                        if((temp_obj != NULL) && (temp_obj->get_type() == Pawn) && (temp_obj->get_color() == WHITE)) analyze_rate += 12;
-                        if(check_passed_pawn(obj, board))
-                            analyze_rate += passed_pawn_reward[obj->get_y()];
-                        else
-                            analyze_rate += standard_pawn_reward[obj->get_y()];
-                    }
-                    else
-                    {
-                        black_pawns_on_vert++;
-                        temp_obj = board->get(obj->get_x() - 1, obj->get_y() + 1);
-                        if((temp_obj != NULL) && (temp_obj->get_type() == Pawn) && (temp_obj->get_color() == BLACK)) analyze_rate -= 12;
-                        temp_obj = board->get(obj->get_x() + 1, obj->get_y() + 1);
-                        if((temp_obj != NULL) && (temp_obj->get_type() == Pawn) && (temp_obj->get_color() == BLACK)) analyze_rate -= 12;
-                        if(check_passed_pawn(obj, board))
-                            analyze_rate -= passed_pawn_reward[7 - obj->get_y()];
-                        else
-                            analyze_rate -= standard_pawn_reward[7 - obj->get_y()];
-                    }
-                    break;
-                case Knight:
-                    analyze_rate += (color == WHITE ? 1 : -1) * 305;
-                    analyze_rate += (color == WHITE ? 1 : -1) * check_mobility(obj, board) * 9;
-                    break;
-                case Bishop:
-                    analyze_rate += (color == WHITE ? 1 : -1) * 333;
-                    analyze_rate += (color == WHITE ? 1 : -1) * check_mobility(obj, board) * 4;
-                    if(color == WHITE)
-                        white_bishops++;
-                    else
-                        black_bishops++;
-                    break;
-                case Rook:
-                    analyze_rate += (color == WHITE ? 1 : -1) * 563;
-                    analyze_rate += (color == WHITE ? 1 : -1) * check_mobility(obj, board) * 3;
-                    break;
-                case Queen:
-                    analyze_rate += (color == WHITE ? 1 : -1) * 950;
-                    analyze_rate += (color == WHITE ? 1 : -1) * check_mobility(obj, board) * 3;
-                    break;
-                case King:
-                    if(color == WHITE)
-                    {
-                        if((obj->get_links() != 0) && (!board->white_castling))
-                            analyze_rate -= 50;
-                    }
-                    else
-                    {
-                        if((obj->get_links() != 0) && (!board->black_castling))
-                            analyze_rate += 50;
-                    }
-                default:
-                    break;
-            } 
-        }
-        if(white_pawns_on_vert != 0)
-            analyze_rate += (white_pawns_on_vert - 1) * (-25);
-        if(black_pawns_on_vert != 0)
-            analyze_rate += (black_pawns_on_vert - 1) * (25);
+        Position packed = position;
+        apply_packed_move(packed, temp_turn->get_from_square() | (temp_turn->get_to_square() << 6));
+        board->make_move_forward(temp_turn);
+        if(packed.key != board->hash(reverse_color(turn_color)))
+            mismatches++;
+        positions += key_check_tree(ai, board, reverse_color(turn_color), depth - 1, mismatches);
+        board->make_move_backward(temp_turn);
+        if(board->hash(turn_color) != key)
+            mismatches++;
+    }
+    ai.release_turns(board, possible_turns);
+    return positions;
+}
+
+//Games ending where en passant can be taken: by White after castling, and by Black, not castled, against a castled White
+const char* const key_check_games[] = {
+    "1.e4 a6 2.Nf3 a5 3.Bc4 a4 4.O-O h6 5.e5 d5",
+    "1.Nf3 b5 2.g3 b4 3.Bg2 e6 4.O-O Bb7 5.c4"
+};
+
+int key_check(int depth)
+{
+    long positions = 0, mismatches = 0;
+    vector<const char*> games(key_check_games, key_check_games + sizeof(key_check_games) / sizeof(key_check_games[0]));
+    games.insert(games.end(), benchmark_games, benchmark_games + sizeof(benchmark_games) / sizeof(benchmark_games[0]));
+    for(auto game : games)
+    {
+        vector<string> notation;
+        parse_notation(game, notation);
+        Board board;
+        board.set_network(NULL);
+        board.set_start_position();
+        board.load_notation(notation);
+        while(board.get_turn() + 1 < board.get_turns_count())
+            board.step_forward();
+        AI ai;
+        positions += key_check_tree(ai, &board, (notation.size() % 2 == 0) ? WHITE : BLACK, depth, mismatches);
     }
-    if(white_bishops == 2) analyze_rate += 50;
-    if(black_bishops == 2) analyze_rate -= 50;
-    
-    board->cur_state = save_state;
-    board->hit_field = save_hit_field;
-    return analyze_rate/100;
+    printf("%ld positions, %ld key mismatches\n", positions, mismatches);
+    return (mismatches == 0) ? 0 : 1;
+}
+
+void print_usage()
+{
+    cout << "Usage:\n"
+        << "  chess                                   interactive mode\n"
+        << "  chess book <out.bin> <games|pgn>...     build opening book\n"
+        << "  chess pack <out.cgb> <games|pgn>...     convert games to the binary collection format\n"
+        << "  chess index <out.idx> <games|pgn|cgb>... index the positions of game collections\n"
+        << "  chess explore <index.idx> [fen]         games and move statistics of a position\n"
+        << "  chess bitbase [dir]                     generate endgame bitbases\n"
+        << "  chess mate <moves> <game> [nodes]       find a forced mate after the last move of the game\n"
+        << "  chess rules-bench [repeats]             time the rules before and after the kernels\n"
+        << "  chess nnue-check [net] [depth]          check incremental network updates against a full refresh\n"
+        << "  chess key-check [depth]                 check position keys through make/unmake, FEN and packed moves\n"
+        << "  chess tune <out.txt> <games|pgn>...     tune evaluation weights on finished games\n"
+        << "  chess batch-eval <out.bin> <games|pgn>... score every position of the games in batches\n"
+        << "  chess match <engine> <engine> [games] [openings] play engine configurations against each other\n"
+        << "  chess selfplay <dir> [games] [engine]   generate training positions from self-play games\n"
+        << "  chess search <game> [depth] [log.jsonl] search after the last move with UCI info and a JSON-lines log\n"
+        << "  chess bench [depth] [threads]           search the benchmark positions, prints the node signature\n"
+        << "  chess micro-bench [out.jsonl] [label]   time the hot paths in ns/op and allocations/op\n"
+        << "  chess fen-eval [engine|static]          score FEN/EPD lines from stdin as JSON lines\n"
+        << "  chess epd <suite.epd> [engine]...       run an EPD test suite with bm/am opcodes\n"
+        << "  chess serve [socket] [engine] [threads] analysis server on a Unix domain socket\n";
 }
 
+int run_command(int argc, char** argv)
+{
+    string command = argv[1];
+    if((command == "book") && (argc >= 4))
+        return build_book(argv[2], vector<string>(argv + 3, argv + argc));
+    if((command == "pack") && (argc >= 4))
+        return pack_games(argv[2], vector<string>(argv + 3, argv + argc));
+    if((command == "index") && (argc >= 4))
+        return build_position_index(argv[2], vector<string>(argv + 3, argv + argc));
+    if((command == "explore") && (argc >= 3))
+        return explore_position(argv[2], (argc >= 4) ? argv[3] : START_FEN);
+    if((command == "mate") && (argc >= 4))
+        return solve_mate(atoi(argv[2]), argv[3], (argc >= 5) ? atol(argv[4]) : 2000000);
+    if(command == "rules-bench")
+        return rules_benchmark((argc >= 3) ? atoi(argv[2]) : 200);
+    if((command == "tune") && (argc >= 4))
+        return tune_eval(argv[2], vector<string>(argv + 3, argv + argc));
+    if((command == "batch-eval") && (argc >= 4))
+        return batch_evaluate(argv[2], vector<string>(argv + 3, argv + argc));
+    if((command == "match") && (argc >= 4))
+        return run_match(argv[2], argv[3], (argc >= 5) ? atoi(argv[4]) : 100, (argc >= 6) ? argv[5] : "");
+    if((command == "selfplay") && (argc >= 3))
+        return run_selfplay(argv[2], (argc >= 4) ? atol(argv[3]) : 0, (argc >= 5) ? argv[4] : "depth=4");
+    if((command == "search") && (argc >= 3))
+        return run_search(argv[2], (argc >= 4) ? atoi(argv[3]) : 6, (argc >= 5) ? argv[4] : "");
+    if(command == "bench")
+        return run_bench((argc >= 3) ? atoi(argv[2]) : BENCH_DEPTH, (argc >= 4) ? atoi(argv[3]) : 1);
+    if(command == "micro-bench")
+        return micro_benchmarks((argc >= 3) ? argv[2] : "", (argc >= 4) ? argv[3] : "");
+    if(command == "fen-eval")
+        return run_fen_stream((argc >= 3) ? argv[2] : "depth=4");
+    if((command == "epd") && (argc >= 3))
+        return run_epd_suite(argv[2], (argc >= 4) ? vector<string>(argv + 3, argv + argc) : vector<string>{"time=1000"});
+    if(command == "serve")
+        return run_server((argc >= 3) ? argv[2] : "chess.sock", (argc >= 4) ? argv[3] : "depth=4", (argc >= 5) ? atoi(argv[4]) : 0);
+    if(command == "nnue-check")
+        return nnue_check((argc >= 3) ? argv[2] : "", (argc >= 4) ? atoi(argv[3]) : 3);
+    if(command == "key-check")
+        return key_check((argc >= 3) ? atoi(argv[2]) : 3);
+    if(command == "bitbase")
+        return generate_bitbases((argc >= 3) ? argv[2] : "bitbases");
+    print_usage();
+    return 1;
+}
 
-int main()
+int main(int argc, char** argv)
 {
+    if(argc > 1)
+        return run_command(argc, argv);
     Board board;
     board.set_start_position();
     board.start();